@@ -98,10 +98,15 @@ void onLearnComplete(uint8_t kbd, uint8_t key) {
     sendIRQ(IRQ_LEARN);
 }
 
+static bool SendVersion = false;
+
 void i2cReceive(uint8_t length) {
     uint8_t cmd = Wire.read();
     uint8_t value;
 
+    // Reply with the version on the next read
+    SendVersion = (cmd == I2C_CMD_GET_VERSION);
+
     switch (cmd) {
         case I2C_CMD_RESET: 
             resetEncoder();
@@ -125,6 +130,14 @@ void i2cReceive(uint8_t length) {
 }
 
 void i2cRequest() {
+    if (SendVersion) {
+        SendVersion = false;
+        Wire.write(I2C_VERSION_MAGIC);
+        Wire.write(I2C_PROTOCOL_VERSION);
+        Wire.write(I2C_SLAVE_CAPABILITIES);
+        return;
+    }
+
     Wire.write(MIDIChannel[0]);
     Wire.write(MIDIChannel[1]);
     if (kbd.isLearning()) {
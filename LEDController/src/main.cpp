@@ -56,10 +56,15 @@ static void resetEncoder(void)
     }
 }
 
+static bool SendVersion = false;
+
 void i2cReceive(uint8_t length) {
     uint8_t cmd = Wire.read();
     uint8_t ledIndex;
 
+    // Reply with the version on the next read
+    SendVersion = (cmd == I2C_CMD_GET_VERSION);
+
     switch (cmd) {
         case I2C_CMD_RESET:
             resetEncoder();
@@ -91,6 +96,14 @@ void i2cReceive(uint8_t length) {
 }
 
 void i2cRequest() {
+    if (SendVersion) {
+        SendVersion = false;
+        Wire.write(I2C_VERSION_MAGIC);
+        Wire.write(I2C_PROTOCOL_VERSION);
+        Wire.write(I2C_SLAVE_CAPABILITIES);
+        return;
+    }
+
     Wire.write(ButtonStatus);
 
     // BTN5 is a push button, reset the status when read via I2C
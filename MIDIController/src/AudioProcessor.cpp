@@ -10,6 +10,7 @@
  * See 'COPYRIGHT.txt' for copyright and licensing information.
  */
 #include "AudioProcessor.h"
+#include "I2CMaster.h"
 
 #include <Audio.h>
 #include <Wire.h>
@@ -49,12 +50,15 @@ void AudioProcessor::setFXInputGain(float gain)
 }
 
 void AudioProcessor::setVolume(float volume) {
+    // The codec is controlled with Wire on the port of the controller I2C bus
+    I2CPort.waitIdle();
     sgtl5000_1.volume(volume);
 }
 
 void AudioProcessor::begin()
 {
     AudioMemory(10);
+    I2CPort.waitIdle();
     sgtl5000_1.enable();
     sgtl5000_1.volume(0.9);
     mixer1.gain(0, 1.0);
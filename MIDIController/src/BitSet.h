@@ -0,0 +1,194 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Fixed-size bitset with word-level set operations.
+ * Used for note states, so that operations on whole chords are a few word
+ * operations instead of per-note loops.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+template<int N>
+class BitSet
+{
+    public:
+        static const int NUM_WORDS = (N + 31) / 32;
+
+    private:
+        uint32_t mWords[NUM_WORDS];
+
+    public:
+        constexpr BitSet() : mWords{} {}
+
+        /**
+         * Create a set containing all bits in [first, last), clipped to [0, N).
+         */
+        static constexpr BitSet range(int first, int last) {
+            BitSet set;
+            for (int i = (first < 0 ? 0 : first); i < last && i < N; i++) {
+                set.mWords[i >> 5] |= ((uint32_t)1 << (i & 31));
+            }
+            return set;
+        }
+
+        bool test(int bit) const { return (mWords[bit >> 5] >> (bit & 31)) & 0x01; }
+
+        void set(int bit) { mWords[bit >> 5] |= ((uint32_t)1 << (bit & 31)); }
+
+        void clear(int bit) { mWords[bit >> 5] &= ~((uint32_t)1 << (bit & 31)); }
+
+        void reset() {
+            for (int i = 0; i < NUM_WORDS; i++) {
+                mWords[i] = 0;
+            }
+        }
+
+        bool empty() const {
+            uint32_t any = 0;
+            for (int i = 0; i < NUM_WORDS; i++) {
+                any |= mWords[i];
+            }
+            return any == 0;
+        }
+
+        int count() const {
+            int count = 0;
+            for (int i = 0; i < NUM_WORDS; i++) {
+                count += __builtin_popcount(mWords[i]);
+            }
+            return count;
+        }
+
+        /**
+         * Get the lowest bit in the set, or -1 if the set is empty.
+         */
+        int lowest() const {
+            for (int i = 0; i < NUM_WORDS; i++) {
+                if (mWords[i]) {
+                    return i * 32 + __builtin_ctz(mWords[i]);
+                }
+            }
+            return -1;
+        }
+
+        /**
+         * Get the highest bit in the set, or -1 if the set is empty.
+         */
+        int highest() const {
+            for (int i = NUM_WORDS - 1; i >= 0; i--) {
+                if (mWords[i]) {
+                    return i * 32 + 31 - __builtin_clz(mWords[i]);
+                }
+            }
+            return -1;
+        }
+
+        /**
+         * Get the set with all bits moved up (positive shift) or down (negative shift).
+         * Bits shifted out of [0, N) are dropped.
+         */
+        BitSet shifted(int shift) const {
+            BitSet set;
+            int words = (shift >= 0 ? shift : -shift) >> 5;
+            int bits = (shift >= 0 ? shift : -shift) & 31;
+
+            if (shift >= 0) {
+                for (int i = NUM_WORDS - 1; i >= words; i--) {
+                    uint32_t word = mWords[i - words] << bits;
+                    if (bits && i - words > 0) {
+                        word |= mWords[i - words - 1] >> (32 - bits);
+                    }
+                    set.mWords[i] = word;
+                }
+                // keep unused bits of the last word cleared
+                if (N % 32) {
+                    set.mWords[NUM_WORDS - 1] &= ((uint32_t)1 << (N % 32)) - 1;
+                }
+            } else {
+                for (int i = 0; i + words < NUM_WORDS; i++) {
+                    uint32_t word = mWords[i + words] >> bits;
+                    if (bits && i + words + 1 < NUM_WORDS) {
+                        word |= mWords[i + words + 1] << (32 - bits);
+                    }
+                    set.mWords[i] = word;
+                }
+            }
+            return set;
+        }
+
+        /**
+         * Call f(bit) for every bit in the set, in ascending order.
+         */
+        template<typename F>
+        void forEach(F f) const {
+            for (int i = 0; i < NUM_WORDS; i++) {
+                uint32_t word = mWords[i];
+                while (word) {
+                    int bit = __builtin_ctz(word);
+                    word &= word - 1;
+                    f(i * 32 + bit);
+                }
+            }
+        }
+
+        BitSet &operator|=(const BitSet &other) {
+            for (int i = 0; i < NUM_WORDS; i++) {
+                mWords[i] |= other.mWords[i];
+            }
+            return *this;
+        }
+
+        BitSet &operator&=(const BitSet &other) {
+            for (int i = 0; i < NUM_WORDS; i++) {
+                mWords[i] &= other.mWords[i];
+            }
+            return *this;
+        }
+
+        BitSet &operator^=(const BitSet &other) {
+            for (int i = 0; i < NUM_WORDS; i++) {
+                mWords[i] ^= other.mWords[i];
+            }
+            return *this;
+        }
+
+        BitSet operator|(const BitSet &other) const { BitSet set(*this); set |= other; return set; }
+
+        BitSet operator&(const BitSet &other) const { BitSet set(*this); set &= other; return set; }
+
+        BitSet operator^(const BitSet &other) const { BitSet set(*this); set ^= other; return set; }
+
+        BitSet operator~() const {
+            BitSet set;
+            for (int i = 0; i < NUM_WORDS; i++) {
+                set.mWords[i] = ~mWords[i];
+            }
+            // keep unused bits of the last word cleared
+            if (N % 32) {
+                set.mWords[NUM_WORDS - 1] &= ((uint32_t)1 << (N % 32)) - 1;
+            }
+            return set;
+        }
+
+        bool operator==(const BitSet &other) const {
+            for (int i = 0; i < NUM_WORDS; i++) {
+                if (mWords[i] != other.mWords[i]) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool operator!=(const BitSet &other) const { return !(*this == other); }
+};
+
+static const int NUM_MIDI_NOTES = 128;
+
+// One bit per MIDI note number
+typedef BitSet<NUM_MIDI_NOTES> NoteSet;
@@ -0,0 +1,50 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Combination memory implementation
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "CombinationMemory.h"
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+CombinationMemory::CombinationMemory()
+{
+    reset();
+}
+
+void CombinationMemory::reset()
+{
+    for (int i = 0; i < MAX_COMBINATIONS; i++) {
+        for (int j = 0; j < MAX_DIVISION_CHANNEL + 1; j++) {
+            mGenerals[i].stops[j].reset();
+            mDivisionals[j][i].reset();
+        }
+    }
+}
+
+const Registration &CombinationMemory::general(int combination) const
+{
+    return mGenerals[combination - 1];
+}
+
+void CombinationMemory::storeGeneral(int combination, const Registration &registration)
+{
+    mGenerals[combination - 1] = registration;
+}
+
+const StopSet &CombinationMemory::divisional(MIDIDivision division, int combination) const
+{
+    return mDivisionals[division][combination - 1];
+}
+
+void CombinationMemory::storeDivisional(MIDIDivision division, int combination, const StopSet &stops)
+{
+    mDivisionals[division][combination - 1] = stops;
+}
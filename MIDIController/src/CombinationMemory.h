@@ -0,0 +1,75 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Stop state and general/divisional combination memories of the combination action.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+#include "BitSet.h"
+
+// Maximum number of stops per division, stop numbers are 0..MAX_STOPS-1
+static const int MAX_STOPS = 64;
+
+// Combination pistons are numbered 1..MAX_COMBINATIONS
+static const int MAX_COMBINATIONS = 16;
+
+// One bit per stop of a division
+typedef BitSet<MAX_STOPS> StopSet;
+
+/**
+ * Stop state of all divisions.
+ */
+struct Registration {
+    StopSet stops[MAX_DIVISION_CHANNEL+1];
+};
+
+inline bool operator==(const Registration &a, const Registration &b)
+{
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        if (a.stops[i] != b.stops[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+class CombinationMemory
+{
+    private:
+        Registration mGenerals[MAX_COMBINATIONS];
+
+        StopSet mDivisionals[MAX_DIVISION_CHANNEL+1][MAX_COMBINATIONS];
+
+    public:
+        CombinationMemory();
+
+        static bool validCombination(int combination) { return combination >= 1 && combination <= MAX_COMBINATIONS; }
+
+        /**
+         * Clear all combinations.
+         */
+        void reset();
+
+        /**
+         * \param combination number of the combination, 1..MAX_COMBINATIONS.
+         */
+        const Registration &general(int combination) const;
+
+        void storeGeneral(int combination, const Registration &registration);
+
+        /**
+         * \param combination number of the combination, 1..MAX_COMBINATIONS.
+         */
+        const StopSet &divisional(MIDIDivision division, int combination) const;
+
+        void storeDivisional(MIDIDivision division, int combination, const StopSet &stops);
+};
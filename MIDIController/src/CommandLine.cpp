@@ -18,6 +18,8 @@
 
 #include <common_config.h>
 
+#include "Profiler.h"
+
 bool CommandParser::parseDivision(const char* arg, MIDIDivision &division)
 {
     if (strcmp(arg, "pedal") == 0) {
@@ -50,6 +52,12 @@ bool CommandParser::parseDivision(const char* arg, MIDIDivision &division)
 bool CommandParser::parseInteger(const char* arg, int &value, int minValue, int maxValue)
 {
     const char* c = arg;
+    if (*c == '-') {
+        c++;
+    }
+    if (*c == '\0') {
+        return false;
+    }
     while (*c != '\0') {
         if (*c < '0' || *c > '9') {
             return false;
@@ -71,14 +79,16 @@ CommandLine::CommandLine()
 {
 }
 
-void CommandLine::addCommand(const char* cmd, CommandParser* parser)
+bool CommandLine::addCommand(const char* cmd, CommandParser* parser)
 {
     if (mNumCommands >= MAX_PARSERS) {
-        return;
+        Serial.printf("Too many commands, ignoring '%s'! Increase MAX_PARSERS.\n", cmd);
+        return false;
     }
     mCommands[mNumCommands] = cmd;
     mParsers[mNumCommands] = parser;
     mNumCommands++;
+    return true;
 }
 
 void CommandLine::printCommandHelp(int cmd)
@@ -231,6 +241,8 @@ void CommandLine::begin()
 
 void CommandLine::loop()
 {
+    ProfileScope scope(ProfileSection::PS_CMDLINE);
+
     while (Serial.available()) {
         char c = Serial.read();
 
@@ -259,6 +271,9 @@ void CommandLine::loop()
                 }
                 if (c == '\n') {
                     processEOL();
+
+                    // Run one command per call, so that other tasks run between commands
+                    return;
                 }
                 break;
             case 8: // Backspace
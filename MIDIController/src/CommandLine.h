@@ -53,7 +53,7 @@ class CommandParser
                                                                   }
 };
 
-static const int MAX_PARSERS = 16;
+static const int MAX_PARSERS = 24;
 static const int MAX_TOKEN_LENGTH = 32;
 
 class CommandLine
@@ -89,7 +89,11 @@ class CommandLine
     public:
         explicit CommandLine();
 
-        void addCommand(const char* cmd, CommandParser *parser);
+        /**
+         * Register a command parser.
+         * \return false if there are already MAX_PARSERS commands.
+         */
+        bool addCommand(const char* cmd, CommandParser *parser);
 
         void begin();
 
@@ -11,16 +11,13 @@
 #include "ControllerDriver.h"
 
 #include <Arduino.h>
-#include <Wire.h>
-#include <TCA9548.h>
+#include <EEPROM.h>
 
 #include <inttypes.h>
 
 #include <common_config.h>
 
-
-// I2C Multiplexer:
-TCA9548 MP(0x70);
+#include "Profiler.h"
 
 // I2C Multiplexer Ports
 static const int I2C_PORT_PANEL     = 0;
@@ -39,9 +36,65 @@ static const int PIN_INT_STOP_LEFT  = 40;
 static const int PIN_INT_TOESTUD    = 30;
 static const int PIN_INT_PANEL      = 36;
 
+// Pins of the IRQ lines, indexed by IRQLine
+static const int IRQ_PINS[NUM_IRQ_LINES] = { PIN_INT_KEYBOARD, PIN_INT_TECHNICS, PIN_INT_TOESTUD, PIN_INT_STOP_LEFT };
+
+static const char* IRQ_NAMES[NUM_IRQ_LINES] = { "Kbd", "Technics", "ToeStud", "StopLeft" };
+
+// Default level of the asserted IRQ lines, as driven by sendIRQ() of the encoder firmware.
+// The PistonEncoder, PedalEncoder, ToeStudEncoder and LEDController assert with high.
+// The Keyboard line is shared by the KeyboardEncoder, which asserts with low, and the
+// PistonEncoder of the keyboards; it uses the level of the KeyboardEncoder.
+// The level can be changed with 'bus irq' and stored in EEPROM if the wiring differs.
+static const bool IRQ_ACTIVE_HIGH[NUM_IRQ_LINES] = { false, true, true, true };
+
+// EEPROM layout: magic, then one bit per IRQ line that is asserted high. Behind the piston map.
+static const int IRQ_EEPROM_ADDRESS = 1024;
+static const uint8_t IRQ_EEPROM_MAGIC = 0xA7;
+
+// Maximum number of status reads queued when an IRQ line is serviced
+static const uint8_t MAX_IRQ_READS = 2;
+
+// Last controller read when an IRQ line is serviced
+static const Controller IRQ_LAST_READ[NUM_IRQ_LINES] = {
+    Controller::MC_Piston_Keyboard, Controller::MC_Piston_Technics, Controller::MC_ToeStud, Controller::MC_LEDController
+};
+
+// Controllers behind the multiplexer that reply to the version request
+static const Controller MUX_CONTROLLERS[NUM_MUX_CONTROLLERS] = {
+    Controller::MC_Keyboard, Controller::MC_Piston_Keyboard, Controller::MC_Technics, Controller::MC_Piston_Technics,
+    Controller::MC_Pedal, Controller::MC_ToeStud, Controller::MC_LEDController
+};
+
+// Interrupt requests latched by the pin interrupts, one bit per IRQ line
+static volatile uint8_t IRQPending = 0;
+static volatile uint32_t IRQTime[NUM_IRQ_LINES];
+
+static void latchIRQ(IRQLine line)
+{
+    if ((IRQPending & (1 << line)) == 0) {
+        IRQTime[line] = micros();
+        IRQPending |= (1 << line);
+    }
+}
+
+static void onIRQKeyboard() { latchIRQ(IRQLine::IL_Keyboard); }
+static void onIRQTechnics() { latchIRQ(IRQLine::IL_Technics); }
+static void onIRQToeStud()  { latchIRQ(IRQLine::IL_ToeStud); }
+static void onIRQStopLeft() { latchIRQ(IRQLine::IL_StopLeft); }
+
+static void (* const IRQ_HANDLERS[NUM_IRQ_LINES])() = { onIRQKeyboard, onIRQTechnics, onIRQToeStud, onIRQStopLeft };
+
 
 ControllerDriver::ControllerDriver() 
 {
+    resetIRQStats();
+
+    for (int i = 0; i < NUM_MUX_CONTROLLERS; i++) {
+        mVersion[i] = 0;
+        mCapabilities[i] = 0;
+    }
+
     for (int i = 0; i < MAX_PISTON_LED_DIVISIONS; i++) {
         for (int j = 0; j < MAX_PISTON_LED_BYTES; j++) {
             mPistonLEDState[i][j] = 0;
@@ -49,74 +102,167 @@ ControllerDriver::ControllerDriver()
     }
 }
 
-void ControllerDriver::selectController(Controller controller)
+uint8_t ControllerDriver::getMuxPort(Controller controller)
 {
     switch (controller) {
         case Controller::MC_Keyboard:
         case Controller::MC_Piston_Keyboard:
-            MP.selectChannel(6);
-            break;
+            return I2C_PORT_KEYBOARD;
         case Controller::MC_Technics:
         case Controller::MC_Piston_Technics:
-            MP.selectChannel(5);
-            break;
+            return I2C_PORT_TECHNICS;
         case Controller::MC_Pedal:
         case Controller::MC_ToeStud:
-            MP.selectChannel(4);
-            break;
+            return I2C_PORT_TOESTUDS;
         case Controller::MC_Panel:
-            MP.selectChannel(0);
-            break;
+            return I2C_PORT_PANEL;
         case Controller::MC_LEDController:
             // On StopLeft port
-            MP.selectChannel(2);
-            break;
+            return I2C_PORT_STOPLEFT;
         case Controller::MC_MainPanel:
-            break;
+        default:
+            return I2C_NO_MUX_PORT;
+    }
+}
+
+bool ControllerDriver::sendCommand(Controller controller, uint8_t command, const uint8_t *data, uint8_t length)
+{
+    return mBus.write(controller, getMuxPort(controller), command, data, length);
+}
+
+uint8_t ControllerDriver::getStatusLength(Controller controller, uint8_t &countOffset) const
+{
+    countOffset = I2C_NO_COUNT;
+
+    switch (controller) {
+        case Controller::MC_Keyboard:
+        case Controller::MC_Technics:
+            return 3;
+        case Controller::MC_Pedal:
+            return 2;
+        case Controller::MC_Piston_Keyboard:
+        case Controller::MC_Piston_Technics:
+            if (mCountedReads) {
+                countOffset = 0;
+                return MAX_I2C_DATA;
+            }
+            return 8;
+        case Controller::MC_ToeStud:
+            // Event count follows the three pedal values
+            if (mCountedReads) {
+                countOffset = 6;
+                return MAX_I2C_DATA;
+            }
+            return 16;
+        case Controller::MC_LEDController:
+        default:
+            return 1;
     }
 }
 
-void ControllerDriver::beginTransmission(Controller controller)
+void ControllerDriver::requestStatus(Controller controller)
 {
-    selectController(controller);
-    Wire.beginTransmission(controller);
+    uint8_t countOffset;
+    uint8_t length = getStatusLength(controller, countOffset);
+
+    mBus.read(controller, getMuxPort(controller), length, onReadCompleted, this, countOffset);
 }
 
-void ControllerDriver::requestTransmission(Controller controller, uint8_t length)
+void ControllerDriver::onVersionRead(void *context, const I2CTransaction &transaction)
 {
-    selectController(controller);
-    Wire.requestFrom(controller, length);
+    static_cast<ControllerDriver*>(context)->versionRead(transaction);
 }
 
-void ControllerDriver::resetAll()
+void ControllerDriver::versionRead(const I2CTransaction &transaction)
+{
+    for (int i = 0; i < NUM_MUX_CONTROLLERS; i++) {
+        if (MUX_CONTROLLERS[i] != transaction.controller) {
+            continue;
+        }
+
+        if (transaction.status == I2CStatus::IS_OK && transaction.length >= I2C_VERSION_LENGTH &&
+            transaction.data[0] == I2C_VERSION_MAGIC)
+        {
+            mVersion[i] = transaction.data[1];
+            mCapabilities[i] = transaction.data[2];
+        } else if (transaction.status == I2CStatus::IS_OK) {
+            // Firmware without the version request replies with its status and
+            // removes the events it sent from its queue.
+            processStatus(transaction);
+        }
+        mVersionPending &= ~(1 << i);
+    }
+
+    if (mVersionPending == 0) {
+        updatePortClocks();
+    }
+}
+
+void ControllerDriver::updatePortClocks()
+{
+    for (int port = 0; port < NUM_MUX_PORTS; port++) {
+        bool used = false;
+        bool fast = mFastMode;
+
+        for (int i = 0; i < NUM_MUX_CONTROLLERS; i++) {
+            if (getMuxPort(MUX_CONTROLLERS[i]) == port) {
+                used = true;
+                if ((mCapabilities[i] & I2C_CAP_FAST_MODE) == 0) {
+                    fast = false;
+                }
+            }
+        }
+
+        mBus.setFastMode(port, used && fast);
+    }
+}
+
+void ControllerDriver::negotiateClock()
 {
-    beginTransmission(Controller::MC_Keyboard);
-    Wire.write(I2C_CMD_RESET);
-    Wire.endTransmission();
+    for (int port = 0; port < NUM_MUX_PORTS; port++) {
+        mBus.setFastMode(port, false);
+    }
 
-    beginTransmission(Controller::MC_Piston_Keyboard);
-    Wire.write(I2C_CMD_RESET);
-    Wire.endTransmission();
+    for (int i = 0; i < NUM_MUX_CONTROLLERS; i++) {
+        Controller controller = MUX_CONTROLLERS[i];
 
-    beginTransmission(Controller::MC_Technics);
-    Wire.write(I2C_CMD_RESET);
-    Wire.endTransmission();
+        mVersion[i] = 0;
+        mCapabilities[i] = 0;
 
-    beginTransmission(Controller::MC_Piston_Technics);
-    Wire.write(I2C_CMD_RESET);
-    Wire.endTransmission();
+        // Read the whole status, in case the controller replies with its status
+        uint8_t countOffset;
+        uint8_t length = getStatusLength(controller, countOffset);
+        if (length < I2C_VERSION_LENGTH) {
+            length = I2C_VERSION_LENGTH;
+        }
 
-    beginTransmission(Controller::MC_Pedal);
-    Wire.write(I2C_CMD_RESET);
-    Wire.endTransmission();
+        if (sendCommand(controller, I2C_CMD_GET_VERSION) &&
+            mBus.read(controller, getMuxPort(controller), length, onVersionRead, this, countOffset))
+        {
+            mVersionPending |= (1 << i);
+        }
+    }
+}
 
-    beginTransmission(Controller::MC_ToeStud);
-    Wire.write(I2C_CMD_RESET);
-    Wire.endTransmission();
+void ControllerDriver::setFastMode(bool enabled)
+{
+    mFastMode = enabled;
 
-    beginTransmission(Controller::MC_LEDController);
-    Wire.write(I2C_CMD_RESET);
-    Wire.endTransmission();
+    // A running negotiation uses the new setting when it completes
+    if (mVersionPending == 0) {
+        updatePortClocks();
+    }
+}
+
+void ControllerDriver::resetAll()
+{
+    sendCommand(Controller::MC_Keyboard, I2C_CMD_RESET);
+    sendCommand(Controller::MC_Piston_Keyboard, I2C_CMD_RESET);
+    sendCommand(Controller::MC_Technics, I2C_CMD_RESET);
+    sendCommand(Controller::MC_Piston_Technics, I2C_CMD_RESET);
+    sendCommand(Controller::MC_Pedal, I2C_CMD_RESET);
+    sendCommand(Controller::MC_ToeStud, I2C_CMD_RESET);
+    sendCommand(Controller::MC_LEDController, I2C_CMD_RESET);
 }
 
 MIDIDivision ControllerDriver::getPistonDivision(Controller controller, uint8_t kbd, uint8_t &btnIndex) {
@@ -142,16 +288,15 @@ MIDIDivision ControllerDriver::getPistonDivision(Controller controller, uint8_t
     }
 }
 
-void ControllerDriver::readPistons(Controller controller) {
+void ControllerDriver::readPistons(Controller controller, const uint8_t *data, uint8_t length) {
 
-    if (!Wire.available()) {
+    if (length == 0) {
         return;
     }
-    // First byte is queue length; ignore
-    (void) Wire.read();
 
-    while (Wire.available()) {
-        uint8_t btn = Wire.read();
+    // First byte is the number of events
+    for (int i = 1; i < length && i <= data[0]; i++) {
+        uint8_t btn = data[i];
         if (btn == 0xFF) {
             break;
         }
@@ -168,95 +313,119 @@ void ControllerDriver::readPistons(Controller controller) {
     }
 }
 
-void ControllerDriver::readStatusKeyboard()
+void ControllerDriver::readLEDControlButtons(uint8_t buttons)
 {
-    requestTransmission(Controller::MC_Keyboard, 3);
-    if (Wire.available() >= 3) {
-        uint8_t channel1 = Wire.read();
-        uint8_t channel2 = Wire.read();
-        uint8_t trainedKey  = Wire.read();
-
-        if (mKeyboardStatusCallback) {
-            mKeyboardStatusCallback(channel1, channel2, trainedKey > 0,
-                                    trainedKey != 0xFF ? trainedKey : 0);
+    for (int i = 0; i < 5; i++) {
+        if ( (buttons & (1<<i)) != (mLEDControlButtons & (1<<i)) ) {
+            if (mLEDControllerCallback) {
+                mLEDControllerCallback(i, (buttons & (1<<i)) ? 1 : 0);
+            }
         }
     }
-    
-    requestTransmission(Controller::MC_Piston_Keyboard, 8);
-    readPistons(Controller::MC_Piston_Keyboard);
+
+    // Only lower 4 switches are stored, pushbuttons are only triggerd once
+    mLEDControlButtons = buttons & 0x0F;
 }
 
-void ControllerDriver::readStatusTechnics()
+void ControllerDriver::onReadCompleted(void *context, const I2CTransaction &transaction)
 {
-    requestTransmission(Controller::MC_Technics, 3);
-    if (Wire.available() >= 3) {
-        uint8_t channel   = Wire.read();
-        uint8_t wheelHigh = Wire.read();
-        uint8_t wheelLow  = Wire.read();
-
-        uint16_t wheel = (wheelHigh << 8) | wheelLow;
-
-        if (mTechnicsStatusCallback) {
-            mTechnicsStatusCallback(channel, wheel);
-        }
-    }
-    
-    requestTransmission(Controller::MC_Piston_Technics, 8);
-    readPistons(Controller::MC_Piston_Technics);
+    static_cast<ControllerDriver*>(context)->readCompleted(transaction);
 }
 
-void ControllerDriver::readStatusPedal()
+void ControllerDriver::readCompleted(const I2CTransaction &transaction)
 {
-    requestTransmission(Controller::MC_Pedal, 2);
-    if (Wire.available() >= 2) {
-        uint8_t channel   = Wire.read();
-        uint8_t intensity = Wire.read();
-
-        if (mPedalStatusCallback) {
-            mPedalStatusCallback(channel, intensity);
+    // The last status read of an IRQ line completes the interrupt request
+    for (int i = 0; i < NUM_IRQ_LINES; i++) {
+        if (transaction.controller == IRQ_LAST_READ[i]) {
+            irqServiced((IRQLine)i);
         }
     }
-    
-    requestTransmission(Controller::MC_ToeStud, 16);
-    if (Wire.available() >= 7) {
-        uint8_t pedal1High = Wire.read();
-        uint8_t pedal1Low  = Wire.read();
-        uint8_t pedal2High = Wire.read();
-        uint8_t pedal2Low  = Wire.read();
-        uint8_t pedal3High = Wire.read();
-        uint8_t pedal3Low  = Wire.read();
-
-        uint16_t pedalCrescendo = pedal1High << 8 | pedal1Low;
-        uint16_t pedalSwell     = pedal2High << 8 | pedal2Low;
-        uint16_t pedalChoir     = pedal3High << 8 | pedal3Low;
-
-        if (mToeStudStatusCallback) {
-            mToeStudStatusCallback(pedalCrescendo, pedalSwell, pedalChoir);
-        }
 
-        readPistons(Controller::MC_ToeStud);
+    if (transaction.status == I2CStatus::IS_OK) {
+        processStatus(transaction);
     }
 }
 
-void ControllerDriver::readStatusStopLeft()
+void ControllerDriver::processStatus(const I2CTransaction &transaction)
 {
-    requestTransmission(Controller::MC_LEDController, 1);
-    if (Wire.available() >= 1) {
-        uint8_t buttons = Wire.read();
-        
-        for (int i = 0; i < 5; i++) {
-            if ( (buttons & (1<<i)) != (mLEDControlButtons & (1<<i)) ) {
-                if (mLEDControllerCallback) {
-                    mLEDControllerCallback(i, (buttons & (1<<i)) ? 1 : 0);
+    const uint8_t *data = transaction.data;
+    uint8_t length = transaction.length;
+
+    switch (transaction.controller) {
+        case Controller::MC_Keyboard:
+            if (length >= 3 && mKeyboardStatusCallback) {
+                uint8_t trainedKey = data[2];
+                mKeyboardStatusCallback(data[0], data[1], trainedKey > 0,
+                                        trainedKey != 0xFF ? trainedKey : 0);
+            }
+            break;
+
+        case Controller::MC_Technics:
+            if (length >= 3 && mTechnicsStatusCallback) {
+                uint16_t wheel = (data[1] << 8) | data[2];
+                mTechnicsStatusCallback(data[0], wheel);
+            }
+            break;
+
+        case Controller::MC_Pedal:
+            if (length >= 2 && mPedalStatusCallback) {
+                mPedalStatusCallback(data[0], data[1]);
+            }
+            break;
+
+        case Controller::MC_ToeStud:
+            if (length >= 7) {
+                uint16_t pedalCrescendo = data[0] << 8 | data[1];
+                uint16_t pedalSwell     = data[2] << 8 | data[3];
+                uint16_t pedalChoir     = data[4] << 8 | data[5];
+
+                if (mToeStudStatusCallback) {
+                    mToeStudStatusCallback(pedalCrescendo, pedalSwell, pedalChoir);
                 }
+
+                readPistons(Controller::MC_ToeStud, data + 6, length - 6);
             }
-        }
+            break;
 
-        // Only lower 4 switches are stored, pushbuttons are only triggerd once
-        mLEDControlButtons = buttons & 0x0F;
+        case Controller::MC_Piston_Keyboard:
+        case Controller::MC_Piston_Technics:
+            readPistons(transaction.controller, data, length);
+            break;
+
+        case Controller::MC_LEDController:
+            if (length >= 1) {
+                readLEDControlButtons(data[0]);
+            }
+            break;
+
+        default:
+            break;
     }
 }
 
+void ControllerDriver::readStatusKeyboard()
+{
+    requestStatus(Controller::MC_Keyboard);
+    requestStatus(Controller::MC_Piston_Keyboard);
+}
+
+void ControllerDriver::readStatusTechnics()
+{
+    requestStatus(Controller::MC_Technics);
+    requestStatus(Controller::MC_Piston_Technics);
+}
+
+void ControllerDriver::readStatusPedal()
+{
+    requestStatus(Controller::MC_Pedal);
+    requestStatus(Controller::MC_ToeStud);
+}
+
+void ControllerDriver::readStatusStopLeft()
+{
+    requestStatus(Controller::MC_LEDController);
+}
+
 void ControllerDriver::readStatusStopRight()
 {
     // No controllers here yet
@@ -274,137 +443,166 @@ void ControllerDriver::readAll()
 
 void ControllerDriver::setPedalChannel(uint8_t channel)
 {
-    beginTransmission(Controller::MC_Pedal);
-    Wire.write(I2C_CMD_SET_CHANNEL);
-    Wire.write(channel);
-    Wire.endTransmission();
+    sendCommand(Controller::MC_Pedal, I2C_CMD_SET_CHANNEL, &channel, 1);
 }
 
 void ControllerDriver::setPedalLEDIntensity(uint8_t intensity)
 {
-    beginTransmission(Controller::MC_Pedal);
-    Wire.write(I2C_CMD_LED_INTENSITY);
-    Wire.write(intensity);
-    Wire.endTransmission();
+    sendCommand(Controller::MC_Pedal, I2C_CMD_LED_INTENSITY, &intensity, 1);
 }
 
 void ControllerDriver::setToestudSensitivity(uint8_t sensitivity)
 {
-    beginTransmission(Controller::MC_ToeStud);
-    Wire.write(I2C_CMD_SET_SENSITIVITY);
-    Wire.write(sensitivity);
-    Wire.endTransmission();
+    sendCommand(Controller::MC_ToeStud, I2C_CMD_SET_SENSITIVITY, &sensitivity, 1);
 }
 
 void ControllerDriver::setTechnicsChannel(uint8_t channel)
 {
-    beginTransmission(Controller::MC_Technics);
-    Wire.write(I2C_CMD_SET_CHANNEL);
-    Wire.write(channel);
-    Wire.endTransmission();
+    sendCommand(Controller::MC_Technics, I2C_CMD_SET_CHANNEL, &channel, 1);
 }
 
 void ControllerDriver::setKeyboardChannels(uint8_t channel1, uint8_t channel2)
 {
-    beginTransmission(Controller::MC_Keyboard);
-    Wire.write(I2C_CMD_SET_CHANNEL);
-    Wire.write(channel1);
-    Wire.write(channel2);
-    Wire.endTransmission();
+    uint8_t channels[2] = { channel1, channel2 };
+    sendCommand(Controller::MC_Keyboard, I2C_CMD_SET_CHANNEL, channels, 2);
 }
 
 void ControllerDriver::startCalibrateAnalogInputs()
 {
-    beginTransmission(Controller::MC_Technics);
-    Wire.write(I2C_CMD_CALIBRATE);
-    Wire.endTransmission();
-
-    beginTransmission(Controller::MC_ToeStud);
-    Wire.write(I2C_CMD_CALIBRATE);
-    Wire.endTransmission();
+    sendCommand(Controller::MC_Technics, I2C_CMD_CALIBRATE);
+    sendCommand(Controller::MC_ToeStud, I2C_CMD_CALIBRATE);
 }
 
 void ControllerDriver::stopCalibrateAnalogInputs()
 {
-    beginTransmission(Controller::MC_Technics);
-    Wire.write(I2C_CMD_STOP_CALIBRATE);
-    Wire.endTransmission();
-
-    beginTransmission(Controller::MC_ToeStud);
-    Wire.write(I2C_CMD_STOP_CALIBRATE);
-    Wire.endTransmission();
+    sendCommand(Controller::MC_Technics, I2C_CMD_STOP_CALIBRATE);
+    sendCommand(Controller::MC_ToeStud, I2C_CMD_STOP_CALIBRATE);
 }
 
 void ControllerDriver::trainKeyboard(uint8_t keyboard)
 {
-    beginTransmission(Controller::MC_Keyboard);
-    Wire.write(I2C_CMD_CALIBRATE);
-    Wire.write(keyboard);
-    Wire.endTransmission();
+    sendCommand(Controller::MC_Keyboard, I2C_CMD_CALIBRATE, &keyboard, 1);
 }
 
-void ControllerDriver::setPistonLED(MIDIDivision division, uint8_t piston, bool ledOn)
+int ControllerDriver::getPistonLEDIndex(MIDIDivision division)
 {
-    if (piston > MAX_PISTON_LED_BYTES*8) {
-        return;
+    switch (division) {
+        case MIDIDivision::MD_Choir:
+        case MIDIDivision::MD_Pedal:
+            // Pedal pistons are on the choir controller
+            return 0;
+        case MIDIDivision::MD_Swell:
+            return 1;
+        case MIDIDivision::MD_Solo:
+            return 2;
+        default:
+            return -1;
     }
+}
 
-    int idx = getPistonLEDIndex(division);
+void ControllerDriver::updatePistonLEDs(int idx, uint32_t leds, uint32_t field)
+{
+    for (int i = 0; i < MAX_PISTON_LED_BYTES; i++) {
+        uint8_t mask = field >> (i * 8);
+        uint8_t state = (mPistonLEDState[idx][i] & ~mask) | ((leds >> (i * 8)) & mask);
+
+        if (state != mPistonLEDState[idx][i]) {
+            mPistonLEDState[idx][i] = state;
+            mPistonLEDDirty |= (1 << idx);
+        }
+    }
+}
 
+void ControllerDriver::setPistonLED(MIDIDivision division, uint8_t piston, bool ledOn)
+{
     if (division == MIDIDivision::MD_Pedal) {
         // Lower pistons are Pedal pistons, start with offset
         piston += PEDAL_PISTON_OFFSET;
     }
 
-    uint8_t state = mPistonLEDState[idx][piston/8];
-    if (ledOn) {
-        state |=  (1<<(piston % 8));
-    } else {
-        state &= ~(1<<(piston % 8));
+    if (piston >= MAX_PISTON_LED_BYTES*8) {
+        return;
+    }
+
+    int idx = getPistonLEDIndex(division);
+    if (idx < 0) {
+        return;
+    }
+
+    updatePistonLEDs(idx, ledOn ? (1UL << piston) : 0, 1UL << piston);
+}
+
+void ControllerDriver::setPistonLEDs(MIDIDivision division, uint32_t leds)
+{
+    static const uint32_t ALL_LEDS = 0xFFFFFFFF;
+
+    int idx = getPistonLEDIndex(division);
+    if (idx < 0) {
+        return;
     }
-    mPistonLEDState[idx][piston/8] = state;
 
     switch (division) {
         case MIDIDivision::MD_Choir:
-        case MIDIDivision::MD_Pedal:
-            beginTransmission(Controller::MC_Piston_Technics);
-            Wire.write(I2C_CMD_SET_LEDS);
-            for (int i = 0; i < MAX_PISTON_LED_BYTES; i++) {
-                Wire.write(mPistonLEDState[idx][i]);
-            }
-            Wire.endTransmission();
+            // Upper LEDs belong to the Pedal pistons
+            updatePistonLEDs(idx, leds, (1UL << PEDAL_PISTON_OFFSET) - 1);
             break;
-        case MIDIDivision::MD_Swell:
-        case MIDIDivision::MD_Solo:
-            beginTransmission(Controller::MC_Piston_Keyboard);
-            Wire.write(I2C_CMD_SET_LEDS);
-            for (int i = 0; i < MAX_PISTON_LED_BYTES; i++) {
-                uint8_t mask = mPistonLEDState[idx][i];
-                if (division == MIDIDivision::MD_Solo && i == 0) {
-                    // Set highest bit to indicate keyboard number 2
-                    mask |= (1<<7);
-                }
-                Wire.write(mask);
-            }
-            Wire.endTransmission();
+        case MIDIDivision::MD_Pedal:
+            updatePistonLEDs(idx, leds << PEDAL_PISTON_OFFSET, ALL_LEDS << PEDAL_PISTON_OFFSET);
             break;
         default:
-            // Ignore other controllers
+            updatePistonLEDs(idx, leds, ALL_LEDS);
             break;
     }
 }
 
+void ControllerDriver::flushPistonLEDs()
+{
+    if (!mPistonLEDDirty) {
+        return;
+    }
+    if (mPistonLEDRefresh > 0 && millis() - mPistonLEDFlushTime < mPistonLEDRefresh) {
+        return;
+    }
+    mPistonLEDFlushTime = millis();
+
+    for (int idx = 0; idx < MAX_PISTON_LED_DIVISIONS; idx++) {
+        if ((mPistonLEDDirty & (1 << idx)) == 0) {
+            continue;
+        }
+
+        // Choir and Pedal LEDs are on the Technics piston controller, Swell and Solo on the Keyboard
+        Controller controller = (idx == 0) ? Controller::MC_Piston_Technics : Controller::MC_Piston_Keyboard;
+
+        if (mBus.isQueued(controller, false)) {
+            // Send the latest state once the previous write is done
+            continue;
+        }
+
+        uint8_t masks[MAX_PISTON_LED_BYTES];
+        for (int i = 0; i < MAX_PISTON_LED_BYTES; i++) {
+            masks[i] = mPistonLEDState[idx][i];
+        }
+        if (idx == 2) {
+            // Set highest bit to indicate keyboard number 2
+            masks[0] |= (1<<7);
+        }
+
+        if (sendCommand(controller, I2C_CMD_SET_LEDS, masks, MAX_PISTON_LED_BYTES)) {
+            mPistonLEDDirty &= ~(1 << idx);
+        }
+    }
+}
+
 void ControllerDriver::setLEDControllerRGB(int led, const uint8_t *rgb)
 {
     Serial.printf("Begin LED: %d\n", led);
-    beginTransmission(Controller::MC_LEDController);
-    Wire.write(I2C_CMD_LED_INTENSITY);    
-    Wire.write((uint8_t)led);
+    uint8_t data[4];
+    data[0] = (uint8_t)led;
     int numLeds = (led < 2) ? 3 : 1;
     for (int i = 0; i < numLeds; i++) {
-        Wire.write(rgb[i]);
+        data[i + 1] = rgb[i];
     }
-    Wire.endTransmission();
+    sendCommand(Controller::MC_LEDController, I2C_CMD_LED_INTENSITY, data, numLeds + 1);
 }
 
 void ControllerDriver::printIRQStatus()
@@ -420,6 +618,219 @@ void ControllerDriver::printIRQStatus()
     Serial.printf(" ToeStud=%s Panel=%s", irqToestud ? "HI":"LO", irqPanel ? "HI":"LO");
     Serial.printf(" StopLeft=%s StopRight=%s", irqStopLeft ? "HI":"LO", irqStopRight ? "HI":"LO");
     Serial.println();
+
+    for (int i = 0; i < NUM_IRQ_LINES; i++) {
+        const IRQLineStats &stats = mIRQStats[i];
+        Serial.printf("IRQ %s: active=%s count=%lu", IRQ_NAMES[i], (mIRQActiveHigh & (1 << i)) ? "HI":"LO", stats.count);
+        if (stats.count > 0) {
+            Serial.printf(" latency avg=%luus max=%luus", stats.totalLatency / stats.count, stats.maxLatency);
+        }
+        Serial.println();
+    }
+}
+
+void ControllerDriver::setIRQPolarity(IRQLine line, bool activeHigh)
+{
+    if (activeHigh) {
+        mIRQActiveHigh |= (1 << line);
+    } else {
+        mIRQActiveHigh &= ~(1 << line);
+    }
+
+    if (mIRQAttached) {
+        // Latch on the new edge
+        attachIRQ(line);
+    }
+}
+
+int ControllerDriver::findIRQLine(const char *name)
+{
+    for (int i = 0; i < NUM_IRQ_LINES; i++) {
+        if (strcasecmp(name, IRQ_NAMES[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool ControllerDriver::loadIRQPolarity()
+{
+    if (EEPROM.read(IRQ_EEPROM_ADDRESS) != IRQ_EEPROM_MAGIC) {
+        return false;
+    }
+
+    uint8_t activeHigh = EEPROM.read(IRQ_EEPROM_ADDRESS + 1);
+    for (int i = 0; i < NUM_IRQ_LINES; i++) {
+        setIRQPolarity((IRQLine)i, activeHigh & (1 << i));
+    }
+    return true;
+}
+
+void ControllerDriver::saveIRQPolarity()
+{
+    EEPROM.update(IRQ_EEPROM_ADDRESS, IRQ_EEPROM_MAGIC);
+    EEPROM.update(IRQ_EEPROM_ADDRESS + 1, mIRQActiveHigh);
+}
+
+void ControllerDriver::clearIRQPolarity()
+{
+    EEPROM.update(IRQ_EEPROM_ADDRESS, 0xFF);
+
+    for (int i = 0; i < NUM_IRQ_LINES; i++) {
+        setIRQPolarity((IRQLine)i, IRQ_ACTIVE_HIGH[i]);
+    }
+}
+
+void ControllerDriver::resetIRQStats()
+{
+    for (int i = 0; i < NUM_IRQ_LINES; i++) {
+        mIRQStats[i] = {};
+    }
+}
+
+bool ControllerDriver::irqAsserted(IRQLine line) const
+{
+    bool activeHigh = mIRQActiveHigh & (1 << line);
+    return digitalRead(IRQ_PINS[line]) == (activeHigh ? HIGH : LOW);
+}
+
+void ControllerDriver::attachIRQ(IRQLine line)
+{
+    bool activeHigh = mIRQActiveHigh & (1 << line);
+    attachInterrupt(digitalPinToInterrupt(IRQ_PINS[line]), IRQ_HANDLERS[line], activeHigh ? RISING : FALLING);
+
+    // The line may have been asserted before the interrupt was attached
+    if (irqAsserted(line)) {
+        noInterrupts();
+        latchIRQ(line);
+        interrupts();
+    }
+}
+
+void ControllerDriver::serviceIRQ(IRQLine line)
+{
+    if (I2C_QUEUE_SIZE - mBus.queued() < MAX_IRQ_READS) {
+        // Queue is full, try again with the next loop
+        noInterrupts();
+        latchIRQ(line);
+        interrupts();
+        return;
+    }
+
+    switch (line) {
+        case IRQLine::IL_Keyboard:
+            readStatusKeyboard();
+            break;
+        case IRQLine::IL_Technics:
+            readStatusTechnics();
+            break;
+        case IRQLine::IL_ToeStud:
+            readStatusPedal();
+            break;
+        case IRQLine::IL_StopLeft:
+            readStatusStopLeft();
+            break;
+    }
+
+    mIRQServicing |= (1 << line);
+}
+
+void ControllerDriver::irqServiced(IRQLine line)
+{
+    if ((mIRQServicing & (1 << line)) == 0) {
+        // Status read requested by the command line
+        return;
+    }
+    mIRQServicing &= ~(1 << line);
+
+    uint32_t latency = micros() - mIRQTime[line];
+    IRQLineStats &stats = mIRQStats[line];
+    stats.count++;
+    stats.totalLatency += latency;
+    if (latency > stats.maxLatency) {
+        stats.maxLatency = latency;
+    }
+
+    // Controllers keep the line asserted while they have more events queued,
+    // there is no new edge in that case.
+    if (irqAsserted(line)) {
+        noInterrupts();
+        latchIRQ(line);
+        interrupts();
+    }
+}
+
+static const char* deviceName(uint8_t address)
+{
+    switch (address) {
+        case Controller::MC_Keyboard:        return "Keyboard";
+        case Controller::MC_Technics:        return "Technics";
+        case Controller::MC_ToeStud:         return "ToeStud";
+        case Controller::MC_Pedal:           return "Pedal";
+        case Controller::MC_Panel:           return "Panel";
+        case Controller::MC_LEDController:   return "LEDController";
+        case Controller::MC_Piston_Keyboard: return "PistonKbd";
+        case Controller::MC_Piston_Technics: return "PistonTechnics";
+        case Controller::MC_MainPanel:       return "MainPanel";
+        case I2C_MUX_ADDRESS:                return "Mux";
+        default:                             return "?";
+    }
+}
+
+void ControllerDriver::printBusStatus()
+{
+    const I2CBusStats &stats = mBus.stats();
+
+    Serial.printf("I2C: Transactions=%lu Queued=%hhu", stats.transactions, mBus.queued());
+    Serial.printf(" MuxSelects=%lu Saved=%lu Reordered=%lu", stats.muxSelects, stats.muxSelectsSaved, stats.reordered);
+    Serial.printf(" Retries=%lu", stats.retries);
+    Serial.println();
+
+    Serial.printf("I2C Clock: FastMode=%s ClockChanges=%lu Fallbacks=%lu", mFastMode ? "on" : "off",
+                  stats.clockChanges, stats.clockFallbacks);
+    Serial.println();
+
+    for (int i = 0; i < NUM_MUX_CONTROLLERS; i++) {
+        Controller controller = MUX_CONTROLLERS[i];
+        uint8_t port = getMuxPort(controller);
+
+        Serial.printf("  %-14s port %hhu: %lukHz", deviceName(controller), port, mBus.portClock(port) / 1000);
+        if (mVersionPending & (1 << i)) {
+            Serial.print(" (probing)");
+        } else if (mVersion[i] == 0) {
+            Serial.print(" (no version)");
+        } else {
+            Serial.printf(" version %hhu%s", mVersion[i], (mCapabilities[i] & I2C_CAP_FAST_MODE) ? " fast" : "");
+        }
+        Serial.println();
+    }
+}
+
+void ControllerDriver::printBusDevices()
+{
+    for (int i = 0; i < mBus.numDevices(); i++) {
+        const I2CDeviceStats &stats = mBus.device(i);
+
+        Serial.printf("%-14s 0x%02x", deviceName(stats.address), stats.address);
+        if (stats.muxPort != I2C_NO_MUX_PORT) {
+            Serial.printf(" port %hhu:", stats.muxPort);
+        } else {
+            Serial.print("       :");
+        }
+        Serial.printf(" transfers=%lu written=%lu read=%lu", stats.transfers, stats.bytesWritten, stats.bytesRead);
+        Serial.printf(" nack=%lu timeout=%lu error=%lu retry=%lu", stats.nacks, stats.timeouts, stats.errors, stats.retries);
+        Serial.println();
+
+        Serial.print("    us:");
+        for (int j = 0; j < I2C_DURATION_BUCKETS; j++) {
+            if (j < I2C_DURATION_BUCKETS - 1) {
+                Serial.printf(" <%d=%lu", 128 << j, stats.durations[j]);
+            } else {
+                Serial.printf(" >=%d=%lu", 128 << (j - 1), stats.durations[j]);
+            }
+        }
+        Serial.println();
+    }
 }
 
 void ControllerDriver::begin()
@@ -431,26 +842,49 @@ void ControllerDriver::begin()
     pinMode(PIN_INT_STOP_LEFT,  INPUT);
     pinMode(PIN_INT_STOP_RIGHT, INPUT);
 
-    Wire.begin();
-    MP.begin();
+    mBus.begin();
+
+    negotiateClock();
+
+    // Use the stored IRQ levels if there are any
+    for (int i = 0; i < NUM_IRQ_LINES; i++) {
+        setIRQPolarity((IRQLine)i, IRQ_ACTIVE_HIGH[i]);
+    }
+    loadIRQPolarity();
+
+    for (int i = 0; i < NUM_IRQ_LINES; i++) {
+        attachIRQ((IRQLine)i);
+    }
+    mIRQAttached = true;
 }
 
 void ControllerDriver::loop()
 {
-    // Read interrupt request lines until interrupt is cleared
-    if (digitalRead(PIN_INT_KEYBOARD) == LOW) {
-        readStatusKeyboard();
-    }
-    if (digitalRead(PIN_INT_TECHNICS) == LOW) {
-        readStatusTechnics();
-    }
-    if (digitalRead(PIN_INT_TOESTUD) == LOW) {
-        readStatusPedal();
+    ProfileScope scope(ProfileSection::PS_CONTROLLER);
+
+    flushPistonLEDs();
+
+    mBus.loop();
+
+    if (!IRQPending) {
+        return;
     }
-    if (digitalRead(PIN_INT_STOP_LEFT) == LOW) {
-        readStatusStopLeft();
+
+    // Take the latched requests of lines that are not being serviced; requests that
+    // arrive while the status is read are checked when the reads complete.
+    noInterrupts();
+    uint8_t pending = IRQPending & ~mIRQServicing;
+    IRQPending &= ~pending;
+    for (int i = 0; i < NUM_IRQ_LINES; i++) {
+        if (pending & (1 << i)) {
+            mIRQTime[i] = IRQTime[i];
+        }
     }
-    if (digitalRead(PIN_INT_STOP_RIGHT) == LOW) {
-        readStatusStopRight();
+    interrupts();
+
+    for (int i = 0; i < NUM_IRQ_LINES; i++) {
+        if (pending & (1 << i)) {
+            serviceIRQ((IRQLine)i);
+        }
     }
 }
@@ -14,6 +14,8 @@
 
 #include <common_config.h>
 
+#include "I2CBus.h"
+
 using KeyboardStatusCallback =  void(*)(uint8_t channel1, uint8_t channel2, bool training, uint8_t lastKey);
 using TechnicsStatusCallback = void(*)(uint8_t channel, uint16_t wheel);
 using ToeStudStatusCallback = void(*)(uint16_t crescendo, uint16_t swell, uint16_t choir);
@@ -28,6 +30,29 @@ static const uint8_t MAX_PISTON_LED_BYTES = 4;
 // Offset of Pedal pistons in choir manual
 static const uint8_t PEDAL_PISTON_OFFSET = 12;
 
+/**
+ * Interrupt request lines of the controllers, in order of service priority.
+ */
+enum IRQLine : uint8_t {
+    IL_Keyboard = 0,  // Keyboard and Swell/Solo pistons
+    IL_Technics = 1,  // Technics and Choir/Pedal pistons
+    IL_ToeStud  = 2,  // Pedal and ToeStuds
+    IL_StopLeft = 3   // LED controller
+};
+
+static const uint8_t NUM_IRQ_LINES = 4;
+
+// Number of controllers behind the multiplexer whose version is read
+static const uint8_t NUM_MUX_CONTROLLERS = 7;
+
+struct IRQLineStats {
+    // Number of serviced interrupt requests
+    uint32_t count;
+    // Time from the interrupt request until the status reads completed, in us
+    uint32_t maxLatency;
+    uint32_t totalLatency;
+};
+
 class ControllerDriver
 {
     private:
@@ -41,15 +66,90 @@ class ControllerDriver
 
         uint8_t mPistonLEDState[MAX_PISTON_LED_DIVISIONS][MAX_PISTON_LED_BYTES];
 
+        // One bit per LED division whose state has not been sent yet
+        uint8_t  mPistonLEDDirty = 0;
+
+        // Minimum time between LED updates in ms, 0 to send changes on every loop
+        uint16_t mPistonLEDRefresh = 0;
+
+        uint32_t mPistonLEDFlushTime = 0;
+
         uint8_t mLEDControlButtons = 0;
 
+        I2CBus mBus;
+
+        // Read only the queued events of the piston and toestud controllers
+        bool mCountedReads = true;
+
+        // One bit per IRQ line; set if the line is asserted with a high level
+        uint8_t mIRQActiveHigh = 0;
+
+        // Set once begin() attached the pin interrupts
+        bool mIRQAttached = false;
+
+        // One bit per IRQ line whose status reads are running
+        uint8_t mIRQServicing = 0;
+
+        // Time of the interrupt request that is being serviced
+        uint32_t mIRQTime[NUM_IRQ_LINES];
+
+        IRQLineStats mIRQStats[NUM_IRQ_LINES];
+
+        // Protocol version and capabilities of the controllers, 0 if unknown
+        uint8_t mVersion[NUM_MUX_CONTROLLERS];
+        uint8_t mCapabilities[NUM_MUX_CONTROLLERS];
+
+        // One bit per controller whose version read is queued
+        uint8_t mVersionPending = 0;
+
+        // Use fast mode on ports whose controllers all support it
+        bool mFastMode = true;
+
+        bool irqAsserted(IRQLine line) const;
+
+        void attachIRQ(IRQLine line);
+
+        /**
+         * Queue the status reads of the controllers of an IRQ line.
+         */
+        void serviceIRQ(IRQLine line);
+
+        /**
+         * Called when the last status read of an IRQ line completed.
+         */
+        void irqServiced(IRQLine line);
+
         int  getPistonLEDIndex(MIDIDivision division);
 
-        void selectController(Controller controller);
+        static uint8_t getMuxPort(Controller controller);
+
+        bool sendCommand(Controller controller, uint8_t command, const uint8_t *data = nullptr, uint8_t length = 0);
+
+        /**
+         * Get the number of bytes of the status read of a controller.
+         * \param countOffset Set to the offset of the event count of a counted read, or I2C_NO_COUNT.
+         */
+        uint8_t getStatusLength(Controller controller, uint8_t &countOffset) const;
+
+        void requestStatus(Controller controller);
+
+        static void onReadCompleted(void *context, const I2CTransaction &transaction);
+
+        void readCompleted(const I2CTransaction &transaction);
 
-        void beginTransmission(Controller controller);
+        /**
+         * Pass the status of a controller to the callbacks.
+         */
+        void processStatus(const I2CTransaction &transaction);
+
+        static void onVersionRead(void *context, const I2CTransaction &transaction);
 
-        void requestTransmission(Controller controller, uint8_t length);
+        void versionRead(const I2CTransaction &transaction);
+
+        /**
+         * Switch the ports whose controllers all support fast mode to the fast clock.
+         */
+        void updatePortClocks();
 
         /**
          * Get the division of a button message.
@@ -59,13 +159,91 @@ class ControllerDriver
          */
         MIDIDivision getPistonDivision(Controller controller, uint8_t kbd, uint8_t &btnIndex);
 
-        void readPistons(Controller controller);
+        void readPistons(Controller controller, const uint8_t *data, uint8_t length);
+
+        void readLEDControlButtons(uint8_t buttons);
+
+        /**
+         * Update the LED state bits selected by the field mask.
+         */
+        void updatePistonLEDs(int idx, uint32_t leds, uint32_t field);
+
+        /**
+         * Send the LED state of all controllers whose state changed, one write per controller.
+         */
+        void flushPistonLEDs();
 
     public:
         explicit ControllerDriver();
 
         void printIRQStatus();
 
+        /**
+         * Set the level of an asserted IRQ line. begin() sets the stored level, or the level
+         * asserted by the encoder firmware; later calls change the edge of the pin interrupt.
+         */
+        void setIRQPolarity(IRQLine line, bool activeHigh);
+
+        bool irqActiveHigh(IRQLine line) const { return mIRQActiveHigh & (1 << line); }
+
+        /**
+         * Get the IRQ line with the given name as printed by printIRQStatus(), or -1.
+         */
+        static int findIRQLine(const char *name);
+
+        /**
+         * Load the IRQ levels stored in EEPROM.
+         */
+        bool loadIRQPolarity();
+
+        /**
+         * Store the current IRQ levels in EEPROM.
+         */
+        void saveIRQPolarity();
+
+        /**
+         * Invalidate the IRQ levels in EEPROM and use the default levels.
+         */
+        void clearIRQPolarity();
+
+        const IRQLineStats &irqStats(IRQLine line) const { return mIRQStats[line]; }
+
+        void resetIRQStats();
+
+        /**
+         * Enable or disable counted status reads. If disabled, the piston and toestud status
+         * is read with the fixed length of older firmware, for devices that do not support
+         * the master holding the bus between the count and the events.
+         */
+        void setCountedReads(bool enabled) { mCountedReads = enabled; }
+
+        bool countedReads() const { return mCountedReads; }
+
+        void printBusStatus();
+
+        /**
+         * Print the transfer statistics of all devices.
+         */
+        void printBusDevices();
+
+        void resetBusStats() { mBus.resetStats(); }
+
+        /**
+         * Read the version and capabilities of the controllers with the standard clock,
+         * then raise the clock of the ports whose controllers all support fast mode.
+         * Ports fall back to the standard clock on errors until the next negotiation.
+         */
+        void negotiateClock();
+
+        /**
+         * Enable or disable fast mode on the ports whose controllers support it.
+         */
+        void setFastMode(bool enabled);
+
+        bool fastMode() const { return mFastMode; }
+
+        const I2CBusStats &busStats() const { return mBus.stats(); }
+
         void setKeyboardStatusCallback(KeyboardStatusCallback callback) { mKeyboardStatusCallback = callback; }
 
         void setTechnicsStatusCallback(TechnicsStatusCallback callback) { mTechnicsStatusCallback = callback; }
@@ -78,6 +256,11 @@ class ControllerDriver
 
         void setLEDControllerCallback(LEDControllerCallback callback) { mLEDControllerCallback = callback; }
 
+        /**
+         * The read and write functions below only queue the I2C transactions; the
+         * callbacks are called from loop() when the reads complete.
+         */
+
 
         void resetAll();
 
@@ -113,8 +296,23 @@ class ControllerDriver
         void trainKeyboard(uint8_t keyboard);
 
 
+        /**
+         * Set the LED of a piston. LED changes are sent by the next loop().
+         */
         void setPistonLED(MIDIDivision division, uint8_t piston, bool ledOn);
 
+        /**
+         * Set the LEDs of all pistons of a division, one bit per piston.
+         */
+        void setPistonLEDs(MIDIDivision division, uint32_t leds);
+
+        /**
+         * Set the minimum time between LED updates to a controller.
+         */
+        void setPistonLEDRefresh(uint16_t ms) { mPistonLEDRefresh = ms; }
+
+        uint16_t pistonLEDRefresh() const { return mPistonLEDRefresh; }
+
         void setLEDControllerRGB(int led, const uint8_t *rgb);
 
 
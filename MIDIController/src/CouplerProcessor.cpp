@@ -16,6 +16,8 @@
 
 #include <common_config.h>
 
+#include "Profiler.h"
+
 static const int COUPLER_NUM_SOUND_DIVISIONS = 5;
 static const int COUPLER_NUM_DIVISIONS = 6;
 
@@ -28,6 +30,54 @@ static const MIDIDivision COUPLER_DIVISIONS[COUPLER_NUM_DIVISIONS] = {
     MIDIDivision::MD_Control
 };
 
+// Transposition in semitones of each coupler footage
+static const int8_t COUPLER_FOOTAGE_SHIFT[COUPLER_NUM_FOOTAGES] = { 0, 12, -12 };
+
+static constexpr NoteSet couplerSourceRange(int shift)
+{
+    return NoteSet::range(COUPLER_LOWEST_NOTE - shift, COUPLER_LOWEST_NOTE + COUPLER_NUM_NOTES - shift);
+}
+
+// Source notes of each footage that are transposed into the coupler note range
+static constexpr NoteSet COUPLER_SOURCE_RANGE[COUPLER_NUM_FOOTAGES] = {
+    couplerSourceRange(0),
+    couplerSourceRange(12),
+    couplerSourceRange(-12)
+};
+
+// Footages selected by successive long presses of a coupler piston
+static const CouplerState COUPLER_FOOTAGE_CYCLE[] = {
+    CS_SUPER, CS_SUB, CS_SUB | CS_SUPER, CS_SUB | CS_UNISON | CS_SUPER
+};
+
+// Transpositions selected by successive presses of a transpose piston
+static const CouplerState TRANSPOSE_CYCLE[] = {
+    CS_SUPER, CS_SUB, CS_SUB | CS_SUPER, CS_OFF
+};
+
+/**
+ * \param holder Footage index, or COUPLER_NUM_FOOTAGES + MelodyMode.
+ */
+static HolderMask getHolderBit(MIDIDivision source, int holder)
+{
+    return (HolderMask)1 << (source * COUPLER_HOLDERS_PER_DIVISION + holder);
+}
+
+static HolderMask getHolderMask(MIDIDivision source)
+{
+    return (((HolderMask)1 << COUPLER_HOLDERS_PER_DIVISION) - 1) << (source * COUPLER_HOLDERS_PER_DIVISION);
+}
+
+static CouplerState nextCouplerState(CouplerState state, const CouplerState *cycle, int length)
+{
+    for (int i = 0; i < length; i++) {
+        if (cycle[i] == state) {
+            return cycle[(i + 1) % length];
+        }
+    }
+    return cycle[0];
+}
+
 CouplerProcessor::CouplerProcessor(MIDIRouter &router)
 : mMIDIRouter(router), mCouplerMode(CouplerMode::CM_ENABLED)
 {
@@ -50,9 +100,16 @@ CouplerProcessor::CouplerProcessor(MIDIRouter &router)
     mChannelDivisions[MIDIDivision::MD_Solo ] = MIDIDivision::MD_Solo;
     mChannelDivisions[MIDIDivision::MD_Control] = MIDIDivision::MD_Control;
 
+    // No manual transfers
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        mTransfer[i] = (MIDIDivision)i;
+    }
+    updateDivisionTable();
+
     // Map divisions to MIDI ports
     for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
         mInjectPorts[i] = MIDIPort::MP_MIDI1;
+        mSelectedCombination[i] = 0;
     }
     mInjectPorts[MIDIDivision::MD_Pedal]   = MIDIPort::MP_Pedal;
     mInjectPorts[MIDIDivision::MD_Choir]   = MIDIPort::MP_Technics;
@@ -61,135 +118,67 @@ CouplerProcessor::CouplerProcessor(MIDIRouter &router)
     mInjectPorts[MIDIDivision::MD_Solo]    = MIDIPort::MP_Keyboard;
     mInjectPorts[MIDIDivision::MD_Control] = MIDIPort::MP_Pedal;
 
-    // initialize piston command mapping
     for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
-        for (int j = 0; j < MAX_PISTONS; j++) {
-            mPistonCommands[i][j].type = PCT_NONE;
-            mPistonCommands[i][j].division = MIDIDivision::MD_MIDI;
-            mPistonCommands[i][j].param.value = 0;
-        }
-    }
-
-    mPistonCommands[MD_Control][2]  = {.division = MD_Control, .type = PCT_SOUNDOFF, .param = BT_ALL};        // Top row, right (right to left)
-    mPistonCommands[MD_Control][3]  = {.division = MD_Control, .type = PCT_SEQUENCE, .param = BT_NEXT};
-    mPistonCommands[MD_Control][4]  = {.division = MD_Control, .type = PCT_SEQUENCE, .param = BT_PREV};
-    mPistonCommands[MD_Control][5]  = {.division = MD_Pedal,   .type = PCT_COMBINATION, .param = 4}; // Bottom row, right (right to left)
-    mPistonCommands[MD_Control][6]  = {.division = MD_Pedal,   .type = PCT_COMBINATION, .param = 3};
-    mPistonCommands[MD_Control][7]  = {.division = MD_Pedal,   .type = PCT_COMBINATION, .param = 2};
-    mPistonCommands[MD_Control][8]  = {.division = MD_Pedal,   .type = PCT_COMBINATION, .param = 1};
-    mPistonCommands[MD_Control][9]  = {.division = MD_Control, .type = PCT_PAGE, .param = BT_NEXT};
-    mPistonCommands[MD_Control][11] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 5}; // Top row, left
-    mPistonCommands[MD_Control][12] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 6};
-    mPistonCommands[MD_Control][13] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 7};
-    mPistonCommands[MD_Control][14] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 8};
-    mPistonCommands[MD_Control][15] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 1}; // Bottom row, left
-    mPistonCommands[MD_Control][16] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 2};
-    mPistonCommands[MD_Control][17] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 3};
-    mPistonCommands[MD_Control][18] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 4};
-    mPistonCommands[MD_Control][19] = {.division = MD_Control, .type = PCT_PAGE, .param = BT_PREV};
-
-    mPistonCommands[MD_Pedal][0]  = {.division = MD_Pedal, .type = PCT_CRESCENDO, .param = 0};
-    mPistonCommands[MD_Pedal][1]  = {.division = MD_Pedal, .type = PCT_CLEAR,     .param = 0};
-    mPistonCommands[MD_Pedal][2]  = {.division = MD_Pedal, .type = PCT_COMBINATION, .param = 5};
-    mPistonCommands[MD_Pedal][3]  = {.division = MD_Pedal, .type = PCT_COMBINATION, .param = 4};
-    mPistonCommands[MD_Pedal][4]  = {.division = MD_Pedal, .type = PCT_COMBINATION, .param = 3};
-    mPistonCommands[MD_Pedal][5]  = {.division = MD_Pedal, .type = PCT_COMBINATION, .param = 2};
-    mPistonCommands[MD_Pedal][6]  = {.division = MD_Pedal, .type = PCT_COMBINATION, .param = 1};
-    mPistonCommands[MD_Pedal][7]  = {.division = MD_Pedal, .type = PCT_OFF,       .param = 0};
-    mPistonCommands[MD_Pedal][8]  = {.division = MD_Pedal, .type = PCT_TRANSPOSE, .param = BT_TOGGLE};
-    mPistonCommands[MD_Pedal][9]  = {.division = MD_Pedal, .type = PCT_COUPLER, .param = MIDIDivision::MD_Choir};
-    mPistonCommands[MD_Pedal][10] = {.division = MD_Pedal, .type = PCT_COUPLER, .param = MIDIDivision::MD_Great};
-    mPistonCommands[MD_Pedal][11] = {.division = MD_Pedal, .type = PCT_COUPLER, .param = MIDIDivision::MD_Swell};
-    mPistonCommands[MD_Pedal][17] = {.division = MD_Pedal, .type = PCT_COUPLER, .param = MIDIDivision::MD_Solo};
-
-    mPistonCommands[MD_Choir][0]  = {.division = MD_Choir, .type = PCT_CRESCENDO, .param = 0};
-    mPistonCommands[MD_Choir][1]  = {.division = MD_Choir, .type = PCT_CLEAR,     .param = 0};
-    mPistonCommands[MD_Choir][2]  = {.division = MD_Choir, .type = PCT_COMBINATION, .param = 5};
-    mPistonCommands[MD_Choir][3]  = {.division = MD_Choir, .type = PCT_COMBINATION, .param = 4};
-    mPistonCommands[MD_Choir][4]  = {.division = MD_Choir, .type = PCT_COMBINATION, .param = 3};
-    mPistonCommands[MD_Choir][5]  = {.division = MD_Choir, .type = PCT_COMBINATION, .param = 2};
-    mPistonCommands[MD_Choir][6]  = {.division = MD_Choir, .type = PCT_COMBINATION, .param = 1};
-    mPistonCommands[MD_Choir][7]  = {.division = MD_Choir, .type = PCT_OFF,       .param = 0};
-    mPistonCommands[MD_Choir][8]  = {.division = MD_Choir, .type = PCT_TRANSPOSE, .param = BT_TOGGLE};
-    mPistonCommands[MD_Choir][9]  = {.division = MD_Choir, .type = PCT_COUPLER, .param = MIDIDivision::MD_Great};
-    mPistonCommands[MD_Choir][10] = {.division = MD_Choir, .type = PCT_COUPLER, .param = MIDIDivision::MD_Swell};
-    mPistonCommands[MD_Choir][11] = {.division = MD_Choir, .type = PCT_COUPLER, .param = MIDIDivision::MD_Solo};
-
-    mPistonCommands[MD_Swell][0]  = {.division = MD_Swell, .type = PCT_CRESCENDO, .param = 0};
-    mPistonCommands[MD_Swell][1]  = {.division = MD_Swell, .type = PCT_CLEAR,     .param = 0};
-    mPistonCommands[MD_Swell][2]  = {.division = MD_Swell, .type = PCT_COMBINATION, .param = 5};
-    mPistonCommands[MD_Swell][3]  = {.division = MD_Swell, .type = PCT_COMBINATION, .param = 4};
-    mPistonCommands[MD_Swell][4]  = {.division = MD_Swell, .type = PCT_COMBINATION, .param = 3};
-    mPistonCommands[MD_Swell][5]  = {.division = MD_Swell, .type = PCT_COMBINATION, .param = 2};
-    mPistonCommands[MD_Swell][6]  = {.division = MD_Swell, .type = PCT_COMBINATION, .param = 1};
-    mPistonCommands[MD_Swell][7]  = {.division = MD_Swell, .type = PCT_OFF,       .param = 0};
-    mPistonCommands[MD_Swell][8]  = {.division = MD_Swell, .type = PCT_TRANSPOSE, .param = BT_TOGGLE};
-    mPistonCommands[MD_Swell][9]  = {.division = MD_Swell, .type = PCT_COUPLER, .param = MIDIDivision::MD_Pedal};
-    mPistonCommands[MD_Swell][10] = {.division = MD_Swell, .type = PCT_COUPLER, .param = MIDIDivision::MD_Great};
-    mPistonCommands[MD_Swell][11] = {.division = MD_Swell, .type = PCT_COUPLER, .param = MIDIDivision::MD_Solo};
-
-    mPistonCommands[MD_Swell][12] = {.division = MD_Control, .type = PCT_PAGE, .param = BT_NEXT};
-    mPistonCommands[MD_Swell][13] = {.division = MD_Control, .type = PCT_PAGE, .param = BT_PREV};
-    mPistonCommands[MD_Swell][14] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 12};
-    mPistonCommands[MD_Swell][15] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 11};
-    mPistonCommands[MD_Swell][16] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 10};
-    mPistonCommands[MD_Swell][17] = {.division = MD_Control, .type = PCT_COMBINATION, .param =  9};
-    mPistonCommands[MD_Swell][18] = {.division = MD_Control, .type = PCT_CLEAR, .param = 0};
-    mPistonCommands[MD_Swell][19] = {.division = MD_Control, .type = PCT_HOLD,  .param = 0};
-    mPistonCommands[MD_Swell][20] = {.division = MD_Control, .type = PCT_SET,   .param = 0};
-
-    mPistonCommands[MD_Solo][0]  = {.division = MD_Solo, .type = PCT_CRESCENDO, .param = 0};
-    mPistonCommands[MD_Solo][1]  = {.division = MD_Solo, .type = PCT_CLEAR,     .param = 0};
-    mPistonCommands[MD_Solo][2]  = {.division = MD_Solo, .type = PCT_COMBINATION, .param = 5};
-    mPistonCommands[MD_Solo][3]  = {.division = MD_Solo, .type = PCT_COMBINATION, .param = 4};
-    mPistonCommands[MD_Solo][4]  = {.division = MD_Solo, .type = PCT_COMBINATION, .param = 3};
-    mPistonCommands[MD_Solo][5]  = {.division = MD_Solo, .type = PCT_COMBINATION, .param = 2};
-    mPistonCommands[MD_Solo][6]  = {.division = MD_Solo, .type = PCT_COMBINATION, .param = 1};
-    mPistonCommands[MD_Solo][7]  = {.division = MD_Solo, .type = PCT_OFF,       .param = 0};
-    mPistonCommands[MD_Solo][8]  = {.division = MD_Solo, .type = PCT_TRANSPOSE, .param = BT_TOGGLE};
-    mPistonCommands[MD_Solo][9]  = {.division = MD_Solo, .type = PCT_COUPLER, .param = MIDIDivision::MD_Choir};
-    mPistonCommands[MD_Solo][10] = {.division = MD_Solo, .type = PCT_COUPLER, .param = MIDIDivision::MD_Great};
-    mPistonCommands[MD_Solo][11] = {.division = MD_Solo, .type = PCT_COUPLER, .param = MIDIDivision::MD_Swell};
-
-    mPistonCommands[MD_Solo][12] = {.division = MD_Control, .type = PCT_SEQUENCE, .param = BT_NEXT};
-    mPistonCommands[MD_Solo][13] = {.division = MD_Control, .type = PCT_SEQUENCE, .param = BT_PREV};
-    mPistonCommands[MD_Solo][14] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 8};
-    mPistonCommands[MD_Solo][15] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 7};
-    mPistonCommands[MD_Solo][16] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 6};
-    mPistonCommands[MD_Solo][17] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 5};
-    mPistonCommands[MD_Solo][18] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 4};
-    mPistonCommands[MD_Solo][19] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 3};
-    mPistonCommands[MD_Solo][20] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 2};
-    mPistonCommands[MD_Solo][21] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 1};
+        for (int note = 0; note < NUM_MIDI_NOTES; note++) {
+            mSoundingOutputs[i][note] = { mInjectPorts[i], mDivisionChannels[i] };
+        }
+    }
 
     // initialize coupler and note status
     for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
         mCoupler[i].enabled = true;
         mCoupler[i].crescendo = false;
+        mCoupler[i].latched = false;
         for (int j = 0; j < MAX_DIVISION_CHANNEL + 1; j++) {
             mCoupler[i].couple[j] = CS_OFF;
         }
 
-        for (int j = 0; j < COUPLER_NUM_NOTES; j++) {
-            mPressedNotes[i][j].sourceMask = 0;
-            mPressedNotes[i][j].pressed = false;
-            mPressedNotes[i][j].velocity = 0;
+        for (int j = 0; j < NUM_MELODY_MODES; j++) {
+            mMelodyTarget[j][i] = MIDIDivision::MD_MIDI;
+            mMelodyNote[j][i] = -1;
         }
+        mInputNRPN[i] = -1;
+        mOutputNRPN[i] = -1;
+
+        for (int j = 0; j < NUM_MIDI_NOTES; j++) {
+            mNoteStatus[i][j].sourceMask = 0;
+            mNoteStatus[i][j].velocity = 0;
+            mNoteStatus[i][j].coupledVelocity = 0;
+        }
+
+        mVelocityCurves[i] = VELOCITY_CURVES[VC_LINEAR];
+        mNumRoutes[i] = 0;
     }
+
+    takeSnapshot();
+    mSnapshots[mActiveSnapshot ^ 1] = mSnapshots[mActiveSnapshot];
+    mSnapshotChanged = false;
 }
 
-MIDIDivision CouplerProcessor::getDivision(MIDIPort inPort, const MidiMessage &msg)
+void CouplerProcessor::updateDivisionTable()
 {
-    // We ignore the input port and rely only on the input channel,
-    // since most input ports share multiple divisions.
-
-    // .. except for Great input channel (MIDI2), as this is the external keyboard.
-    // Accept all channels from there as Great input
-    if (inPort == MIDIPort::MP_MIDI2) {
-        return MIDIDivision::MD_Great;
+    uint8_t next = mActiveDivisionTable ^ 1;
+
+    for (int port = 0; port < NUM_MIDI_PORTS; port++) {
+        for (int channel = 0; channel < NUM_MIDI_CHANNELS; channel++) {
+            // We ignore the input port and rely only on the input channel,
+            // since most input ports share multiple divisions.
+            // .. except for Great input channel (MIDI2), as this is the external keyboard.
+            // Accept all channels from there as Great input
+            MIDIDivision division = (port == MIDIPort::MP_MIDI2) ? MIDIDivision::MD_Great : mChannelDivisions[channel];
+
+            DivisionMapping &mapping = mDivisionTables[next][port][channel];
+            mapping.division = mTransfer[division];
+            mapping.transferred = mapping.division != division;
+        }
     }
 
-    return mChannelDivisions[msg.channel];
+    mActiveDivisionTable = next;
+}
+
+const DivisionMapping &CouplerProcessor::getDivision(MIDIPort inPort, const MidiMessage &msg)
+{
+    return mDivisionTables[mActiveDivisionTable][inPort][msg.channel % NUM_MIDI_CHANNELS];
 }
 
 void CouplerProcessor::setDivisionChannel(MIDIDivision division, uint8_t channel)
@@ -205,47 +194,395 @@ void CouplerProcessor::setDivisionChannel(MIDIDivision division, uint8_t channel
     }
     
     mDivisionChannels[division] = channel;
+    mOutputNRPN[division] = -1;
     mChannelDivisions[channel] = division;
+
+    updateDivisionTable();
+}
+
+void CouplerProcessor::transferDivisions(MIDIDivision a, MIDIDivision b)
+{
+    if (a == b || a == MIDIDivision::MD_MIDI || b == MIDIDivision::MD_MIDI) {
+        return;
+    }
+
+    if (mCouplerMode == CouplerMode::CM_ENABLED) {
+        clearHolders(a);
+        clearHolders(b);
+
+        // Keys held on the manuals move with the manuals to their new division
+        NoteSet pressed = mPressedNotes[a];
+        mPressedNotes[a] = mPressedNotes[b];
+        mPressedNotes[b] = pressed;
+
+        NoteSet latchedNotes = mLatchedNotes[a];
+        mLatchedNotes[a] = mLatchedNotes[b];
+        mLatchedNotes[b] = latchedNotes;
+
+        NoteSet forwarded = mForwardedNotes[a];
+        mForwardedNotes[a] = mForwardedNotes[b];
+        mForwardedNotes[b] = forwarded;
+        for (int note = 0; note < NUM_MIDI_NOTES; note++) {
+            NoteOutput output = mForwardedOutputs[a][note];
+            mForwardedOutputs[a][note] = mForwardedOutputs[b][note];
+            mForwardedOutputs[b][note] = output;
+        }
+
+        // Keys from before the coupler was enabled sound on the output of their old division
+        mHandoverNotes[a].forEach([&](int note) { sendOutputNoteOff(a, note); });
+        mHandoverNotes[b].forEach([&](int note) { sendOutputNoteOff(b, note); });
+        mHandoverNotes[a].reset();
+        mHandoverNotes[b].reset();
+
+        bool latch = mCoupler[a].latched;
+        mCoupler[a].latched = mCoupler[b].latched;
+        mCoupler[b].latched = latch;
+
+        (keyNotes(a) | keyNotes(b)).forEach([&](int note) {
+            uint8_t velocity = getNoteStatus(a, note).velocity;
+            getNoteStatus(a, note).velocity = getNoteStatus(b, note).velocity;
+            getNoteStatus(b, note).velocity = velocity;
+        });
+    } else {
+        // Held keys are not tracked, NoteOffs would be sent to the new division
+        allDivisionNotesOff(a);
+        allDivisionNotesOff(b);
+    }
+
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        if (mTransfer[i] == a) {
+            mTransfer[i] = b;
+        } else if (mTransfer[i] == b) {
+            mTransfer[i] = a;
+        }
+    }
+    updateDivisionTable();
+
+    if (mCouplerMode == CouplerMode::CM_ENABLED) {
+        addHolders(a);
+        addHolders(b);
+
+        // Send only the difference; notes sounding on both divisions before and after keep sounding
+        for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+            syncDivision(COUPLER_DIVISIONS[i]);
+        }
+    }
 }
 
 void CouplerProcessor::setCouplerMode(CouplerMode mode)
 {
     if (mCouplerMode == CouplerMode::CM_ENABLED && mode != mCouplerMode) {
         allCouplerNotesOff();
+
+        // Latched keys that are no longer pressed are released
+        for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+            mLatchedNotes[i].reset();
+            mCoupler[i].latched = false;
+        }
+        for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+            syncDivision(COUPLER_DIVISIONS[i]);
+        }
+
+        // Move pressed keys back to key pitch, their NoteOffs are sent untransposed
+        int transpose = mTranspose;
+        setTranspose(0);
+        mTranspose = transpose;
+        takeSnapshot();
+
+        // Played notes are forwarded as-is from now on, except for the NoteOffs of the
+        // keys that still sound on the division output
+        for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+            mHandoverNotes[i] |= mSoundingNotes[i];
+            mPressedNotes[i].reset();
+            mVoiceLimiters[i].reset();
+            mSoundingNotes[i].reset();
+        }
+        for (int i = 0; i < NUM_MIDI_PORTS; i++) {
+            mPortVoiceLimiters[i].reset();
+        }
     }
 
     mCouplerMode = mode;
 }
 
-NoteStatus &CouplerProcessor::getNoteStatus(MIDIDivision division, int note)
+void CouplerProcessor::setVelocityCurve(MIDIDivision division, VelocityCurve curve)
 {
-    return mPressedNotes[division][note - COUPLER_LOWEST_NOTE];
+    mVelocityCurves[division] = VELOCITY_CURVES[curve];
+}
+
+void CouplerProcessor::setVelocityCurve(MIDIDivision division, const VelocityTable &curve)
+{
+    mVelocityCurves[division] = curve;
+    // Keep NoteOn with velocity 0 a NoteOff
+    mVelocityCurves[division].velocity[0] = 0;
+}
+
+NoteStatus &CouplerProcessor::getNoteStatus(MIDIDivision division, uint8_t note)
+{
+    return mNoteStatus[division][note & 0x7F];
+}
+
+NoteSet CouplerProcessor::keyNotes(MIDIDivision division) const
+{
+    return mPressedNotes[division] | mLatchedNotes[division];
+}
+
+NoteSet CouplerProcessor::heldNotes(MIDIDivision division) const
+{
+    NoteSet held = mCoupledNotes[division];
+    if (mCoupler[division].enabled) {
+        held |= keyNotes(division);
+    }
+    return held;
+}
+
+bool CouplerProcessor::isHeld(MIDIDivision division, uint8_t note) const
+{
+    return mCoupledNotes[division].test(note) || 
+           (mCoupler[division].enabled && (mPressedNotes[division].test(note) || mLatchedNotes[division].test(note)));
+}
+
+uint8_t CouplerProcessor::getNoteVelocity(MIDIDivision division, uint8_t note)
+{
+    NoteStatus &status = getNoteStatus(division, note);
+
+    if (mCoupler[division].enabled && (mPressedNotes[division].test(note) || mLatchedNotes[division].test(note))) {
+        return status.velocity;
+    }
+    return status.coupledVelocity;
+}
+
+MidiMessage CouplerProcessor::applyVelocityCurve(MIDIDivision division, const MidiMessage &msg) const
+{
+    MidiMessage vmsg = msg;
+    vmsg.data2 = mVelocityCurves[division].velocity[msg.data2 & 0x7F];
+    return vmsg;
 }
 
 void CouplerProcessor::sendCouplerNoteOn(MIDIDivision division, int note, uint8_t velocity)
 {
+    sendCouplerNoteOn(division, note, velocity, { mInjectPorts[division], mDivisionChannels[division] });
+}
+
+void CouplerProcessor::sendCouplerNoteOn(MIDIDivision division, int note, uint8_t velocity, const NoteOutput &output)
+{
+    note += mTranspose;
+    if (note < 0 || note >= NUM_MIDI_NOTES) {
+        return;
+    }
+
+    allocateVoice(division, note);
+
     MidiMessage msg;
-    msg.channel = mDivisionChannels[division];
+    msg.channel = output.channel;
     msg.type = midi::MidiType::NoteOn;
     msg.data1 = note;
-    msg.data2 = velocity;
+    msg.data2 = mVelocityCurves[division].velocity[velocity & 0x7F];
     msg.length = 3;
     msg.valid = true;
 
-    mMIDIRouter.injectMessage(mInjectPorts[division], msg);
+    mTrace.record(CTT_NOTE_ON, division, note, msg.data2);
+
+    mSoundingOutputs[division][note] = output;
+    mMIDIRouter.injectMessage(output.port, msg);
 }
 
 void CouplerProcessor::sendCouplerNoteOff(MIDIDivision division, int note)
+{
+    note += mTranspose;
+    if (note < 0 || note >= NUM_MIDI_NOTES) {
+        return;
+    }
+
+    // A note stolen by either limiter has already been turned off
+    bool divisionVoice = mVoiceLimiters[division].noteOff(note);
+    bool portVoice = mPortVoiceLimiters[mInjectPorts[division]].noteOff(note, division);
+    if (divisionVoice && portVoice) {
+        sendOutputNoteOff(division, note);
+    }
+}
+
+void CouplerProcessor::sendOutputNoteOff(MIDIDivision division, uint8_t note)
+{
+    mTrace.record(CTT_NOTE_OFF, division, note);
+
+    sendNoteOff(mSoundingOutputs[division][note], note);
+}
+
+void CouplerProcessor::sendNoteOff(const NoteOutput &output, uint8_t note)
 {
     MidiMessage msg;
-    msg.channel = mDivisionChannels[division];
+    msg.channel = output.channel;
     msg.type = midi::MidiType::NoteOff;
     msg.data1 = note;
     msg.data2 = 0;
     msg.length = 3;
     msg.valid = true;
 
-    mMIDIRouter.injectMessage(mInjectPorts[division], msg);
+    mMIDIRouter.injectMessage(output.port, msg);
+}
+
+NoteSet CouplerProcessor::audibleNotes(MIDIDivision division) const
+{
+    // Notes stolen by one limiter are removed from the other, so either one has all voices
+    const VoiceLimiter &portVoices = mPortVoiceLimiters[mInjectPorts[division]];
+    const VoiceLimiter &voices = mVoiceLimiters[division];
+
+    NoteSet audible;
+    if (voices.limited()) {
+        for (int i = 0; i < voices.numVoices(); i++) {
+            audible.set(voices.voice(i));
+        }
+    } else if (portVoices.limited()) {
+        for (int i = 0; i < portVoices.numVoices(); i++) {
+            if (portVoices.voiceOwner(i) == division) {
+                audible.set(portVoices.voice(i));
+            }
+        }
+    } else {
+        audible = mSoundingNotes[division].shifted(mTranspose);
+    }
+    return audible;
+}
+
+void CouplerProcessor::allocateVoice(MIDIDivision division, uint8_t note)
+{
+    int stolen = mVoiceLimiters[division].noteOn(note);
+    if (stolen >= 0) {
+        mPortVoiceLimiters[mInjectPorts[division]].noteOff(stolen, division);
+        sendOutputNoteOff(division, stolen);
+    }
+
+    allocatePortVoice(division, note);
+}
+
+void CouplerProcessor::allocatePortVoice(MIDIDivision division, uint8_t note)
+{
+    VoiceLimiter::Voice stolen;
+    if (mPortVoiceLimiters[mInjectPorts[division]].noteOn(note, division, stolen)) {
+        MIDIDivision owner = (MIDIDivision) stolen.owner;
+        mVoiceLimiters[owner].noteOff(stolen.note);
+        sendOutputNoteOff(owner, stolen.note);
+    }
+}
+
+void CouplerProcessor::setPolyphony(MIDIDivision division, uint8_t maxVoices, StealPolicy policy)
+{
+    VoiceLimiter &voices = mVoiceLimiters[division];
+
+    if (mCouplerMode != CouplerMode::CM_ENABLED) {
+        voices.setLimit(maxVoices, policy);
+        return;
+    }
+
+    const VoiceLimiter &portVoices = mPortVoiceLimiters[mInjectPorts[division]];
+
+    // Notes that are sounding at the output, oldest first. Stolen notes are held, but silent.
+    uint8_t sounding[NUM_MIDI_NOTES];
+    int numSounding = 0;
+    if (voices.limited()) {
+        for (int i = 0; i < voices.numVoices(); i++) {
+            sounding[numSounding++] = voices.voice(i);
+        }
+    } else if (portVoices.limited()) {
+        for (int i = 0; i < portVoices.numVoices(); i++) {
+            if (portVoices.voiceOwner(i) == division) {
+                sounding[numSounding++] = portVoices.voice(i);
+            }
+        }
+    } else {
+        mSoundingNotes[division].shifted(mTranspose).forEach([&](int note) {
+            sounding[numSounding++] = note;
+        });
+    }
+
+    voices.setLimit(maxVoices, policy);
+
+    // Allocate voices for the notes that are already sounding, turn off any excess notes
+    NoteSet audible;
+    for (int i = 0; i < numSounding; i++) {
+        allocateVoice(division, sounding[i]);
+        audible.set(sounding[i]);
+    }
+
+    // Without a limit, notes stolen before sound again
+    if (!voices.limited()) {
+        (mSoundingNotes[division] & ~audible.shifted(-mTranspose)).forEach([&](int note) {
+            sendCouplerNoteOn(division, note, getNoteVelocity(division, note));
+        });
+    }
+}
+
+void CouplerProcessor::setPortPolyphony(MIDIDivision division, uint8_t maxVoices, StealPolicy policy)
+{
+    MIDIPort port = mInjectPorts[division];
+    VoiceLimiter &voices = mPortVoiceLimiters[port];
+
+    if (mCouplerMode != CouplerMode::CM_ENABLED) {
+        voices.setLimit(maxVoices, policy);
+        return;
+    }
+
+    NoteSet audible[MAX_DIVISION_CHANNEL+1];
+    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+        MIDIDivision div = COUPLER_DIVISIONS[i];
+        if (mInjectPorts[div] == port) {
+            audible[div] = audibleNotes(div);
+        }
+    }
+
+    // Voices that are sounding at the port, oldest first if the port was limited, else by division
+    VoiceLimiter::Voice sounding[MAX_VOICES];
+    int numSounding = 0;
+    bool wasLimited = voices.limited();
+    for (int i = 0; i < voices.numVoices(); i++) {
+        sounding[numSounding++] = { voices.voice(i), voices.voiceOwner(i) };
+    }
+
+    voices.setLimit(maxVoices, policy);
+
+    // Allocate port voices for the notes that are already sounding, turn off any excess notes
+    if (wasLimited) {
+        for (int i = 0; i < numSounding; i++) {
+            allocatePortVoice((MIDIDivision) sounding[i].owner, sounding[i].note);
+        }
+    } else {
+        for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+            MIDIDivision div = COUPLER_DIVISIONS[i];
+            if (mInjectPorts[div] != port) {
+                continue;
+            }
+            const VoiceLimiter &divisionVoices = mVoiceLimiters[div];
+            if (divisionVoices.limited()) {
+                // Stealing from the division removes its voices, allocate a copy
+                uint8_t notes[MAX_VOICES];
+                int numNotes = divisionVoices.numVoices();
+                for (int j = 0; j < numNotes; j++) {
+                    notes[j] = divisionVoices.voice(j);
+                }
+                for (int j = 0; j < numNotes; j++) {
+                    allocatePortVoice(div, notes[j]);
+                }
+            } else {
+                audible[div].forEach([&](int note) {
+                    allocatePortVoice(div, note);
+                });
+            }
+        }
+    }
+
+    // Without a port limit, notes stolen by the port sound again, unless the division limits them
+    if (!voices.limited()) {
+        for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+            MIDIDivision div = COUPLER_DIVISIONS[i];
+            if (mInjectPorts[div] != port || mVoiceLimiters[div].limited()) {
+                continue;
+            }
+            (mSoundingNotes[div] & ~audible[div].shifted(-mTranspose)).forEach([&](int note) {
+                sendCouplerNoteOn(div, note, getNoteVelocity(div, note));
+            });
+        }
+    }
 }
 
 void CouplerProcessor::sendControlChange(MIDIDivision division, midi::MidiControlChangeNumber ccNumber, uint8_t value)
@@ -263,312 +600,926 @@ void CouplerProcessor::sendControlChange(MIDIDivision division, midi::MidiContro
 
 void CouplerProcessor::sendNRPN(MIDIDivision division, int parameterNumber, uint8_t value)
 {
-    sendControlChange(division, midi::MidiControlChangeNumber::NRPNMSB, (parameterNumber >> 7) & 0x7F);
-    sendControlChange(division, midi::MidiControlChangeNumber::NRPNLSB, (parameterNumber     ) & 0x7F);
+    int selected = mOutputNRPN[division];
+
+    // Receivers keep the selected parameter until a new MSB or LSB is received
+    if (selected < 0 || ((selected >> 7) & 0x7F) != ((parameterNumber >> 7) & 0x7F)) {
+        sendControlChange(division, midi::MidiControlChangeNumber::NRPNMSB, (parameterNumber >> 7) & 0x7F);
+    }
+    if (selected < 0 || (selected & 0x7F) != (parameterNumber & 0x7F)) {
+        sendControlChange(division, midi::MidiControlChangeNumber::NRPNLSB, (parameterNumber     ) & 0x7F);
+    }
     sendControlChange(division, midi::MidiControlChangeNumber::DataEntryMSB, value);
+
+    mOutputNRPN[division] = parameterNumber & 0x3FFF;
+}
+
+void CouplerProcessor::resetOutputNRPN()
+{
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        mOutputNRPN[i] = -1;
+    }
 }
 
-void CouplerProcessor::playCoupledNote(MIDIDivision source, MIDIDivision target, int sourceNote, int note, bool sendMidi)
+void CouplerProcessor::syncNote(MIDIDivision division, uint8_t note)
 {
-    if (note < COUPLER_LOWEST_NOTE || note >= COUPLER_LOWEST_NOTE + COUPLER_NUM_NOTES) {
+    bool held = isHeld(division, note);
+
+    if (held == mSoundingNotes[division].test(note)) {
+        mTrace.record(CTT_SUPPRESSED, division, note, held);
         return;
     }
 
+    if (held) {
+        sendCouplerNoteOn(division, note, getNoteVelocity(division, note));
+        mSoundingNotes[division].set(note);
+    } else {
+        sendCouplerNoteOff(division, note);
+        mSoundingNotes[division].clear(note);
+    }
+}
+
+void CouplerProcessor::syncDivision(MIDIDivision division)
+{
+    NoteSet held = heldNotes(division);
+    NoteSet changed = held ^ mSoundingNotes[division];
+
+    changed.forEach([&](int note) {
+        if (held.test(note)) {
+            sendCouplerNoteOn(division, note, getNoteVelocity(division, note));
+        } else {
+            sendCouplerNoteOff(division, note);
+        }
+    });
+
+    mSoundingNotes[division] = held;
+}
+
+void CouplerProcessor::addHolder(MIDIDivision target, uint8_t note, HolderMask holder, uint8_t velocity)
+{
     NoteStatus &status = getNoteStatus(target, note);
 
-    if (status.sourceMask == 0 && !status.pressed && sendMidi) {
-        sendCouplerNoteOn(target, note, getNoteStatus(source, sourceNote).velocity);
+    if (mTrace.enabled() && (holder & ~status.sourceMask)) {
+        mTrace.record(CTT_HOLDER_ADD, target, note, __builtin_ctzll(holder & ~status.sourceMask));
+    }
+
+    if (status.sourceMask == 0) {
+        status.coupledVelocity = velocity;
+        mCoupledNotes[target].set(note);
     }
-    status.sourceMask |= (1<<source);
+    status.sourceMask |= holder;
 }
 
-void CouplerProcessor::clearCoupledNote(MIDIDivision source, MIDIDivision target, int note, bool sendMidi)
+void CouplerProcessor::removeHolder(MIDIDivision target, uint8_t note, HolderMask holder)
 {
-    if (note < COUPLER_LOWEST_NOTE || note >= COUPLER_LOWEST_NOTE + COUPLER_NUM_NOTES) {
-        return;
+    NoteStatus &status = getNoteStatus(target, note);
+
+    if (mTrace.enabled() && (holder & status.sourceMask)) {
+        mTrace.record(CTT_HOLDER_REMOVE, target, note, __builtin_ctzll(holder & status.sourceMask));
     }
 
-    NoteStatus &status = getNoteStatus(target, note);
+    status.sourceMask &= ~holder;
+    if (status.sourceMask == 0) {
+        mCoupledNotes[target].clear(note);
+    }
+}
+
+void CouplerProcessor::playCoupledNote(MIDIDivision source, const CouplerRoute &route, uint8_t note, uint8_t velocity)
+{
+    addHolder(route.target, note, getHolderBit(source, route.footage), velocity);
+    syncNote(route.target, note);
+}
+
+void CouplerProcessor::clearCoupledNote(MIDIDivision source, const CouplerRoute &route, uint8_t note)
+{
+    removeHolder(route.target, note, getHolderBit(source, route.footage));
+    syncNote(route.target, note);
+}
 
-    status.sourceMask &= ~(1<<source);
+void CouplerProcessor::updateRoutes(MIDIDivision source)
+{
+    uint8_t numRoutes = 0;
 
-    if (status.sourceMask == 0 && !status.pressed && sendMidi) {
-        sendCouplerNoteOff(target, note);
+    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+        MIDIDivision target = COUPLER_DIVISIONS[i];
+        for (int footage = 0; footage < COUPLER_NUM_FOOTAGES; footage++) {
+            if (mCoupler[source].couple[target] & (1 << footage)) {
+                mRoutes[source][numRoutes].target = target;
+                mRoutes[source][numRoutes].footage = footage;
+                numRoutes++;
+            }
+        }
     }
+
+    mNumRoutes[source] = numRoutes;
 }
 
 void CouplerProcessor::updateCouplerMode(MIDIDivision source, MIDIDivision target, CouplerState mode)
 {
     CouplerState oldMode = mCoupler[source].couple[target];
 
-    if (mDebug) {
-        Serial.printf("UpdateCouplerMode(source: %d, target: %d, mode: %d -> %d)\n", source, target, oldMode, mode);
+    mTrace.record(CTT_COUPLER, source, target, (oldMode << 4) | mode);
+
+    if (oldMode == mode) {
+        return;
+    }
+
+    mCoupler[source].couple[target] = mode;
+    updateRoutes(source);
+
+    if (mCouplerMode == CouplerMode::CM_ENABLED) {
+        // Move the holders of all pressed keys for every footage that changed
+        for (int footage = 0; footage < COUPLER_NUM_FOOTAGES; footage++) {
+            int flag = 1 << footage;
+            if ((oldMode & flag) == (mode & flag)) {
+                continue;
+            }
+
+            HolderMask holder = getHolderBit(source, footage);
+            int shift = COUPLER_FOOTAGE_SHIFT[footage];
+            NoteSet notes = keyNotes(source) & COUPLER_SOURCE_RANGE[footage];
+
+            if (mode & flag) {
+                notes.forEach([&](int note) {
+                    addHolder(target, note + shift, holder, getNoteStatus(source, note).velocity);
+                });
+            } else {
+                notes.forEach([&](int note) {
+                    removeHolder(target, note + shift, holder);
+                });
+            }
+        }
+
+        // Send only the resulting difference, notes held by both footages keep sounding
+        syncDivision(target);
+    }
+}
+
+void CouplerProcessor::updateMelodyNote(MelodyMode mode, MIDIDivision source)
+{
+    MIDIDivision target = mMelodyTarget[mode][source];
+    int oldNote = mMelodyNote[mode][source];
+    int note = -1;
+
+    if (target != MIDIDivision::MD_MIDI) {
+        NoteSet keys = keyNotes(source);
+        note = (mode == MM_MELODY) ? keys.highest() : keys.lowest();
+    }
+
+    if (note == oldNote) {
+        return;
+    }
+
+    HolderMask holder = getHolderBit(source, COUPLER_NUM_FOOTAGES + mode);
+
+    // Hand over from the old to the new key; the target only gets a NoteOff or
+    // NoteOn if the note is not also held otherwise.
+    if (oldNote >= 0) {
+        removeHolder(target, oldNote, holder);
+        syncNote(target, oldNote);
     }
+    if (note >= 0) {
+        addHolder(target, note, holder, getNoteStatus(source, note).velocity);
+        syncNote(target, note);
+    }
+
+    mMelodyNote[mode][source] = note;
+}
+
+void CouplerProcessor::recordPlayedNote(MIDIDivision source, uint8_t note, bool noteOn, uint8_t velocity)
+{
+    if (noteOn) {
+        mPressedNotes[source].set(note);
+        getNoteStatus(source, note).velocity = velocity;
+    } else {
+        mPressedNotes[source].clear(note);
+    }
+}
+
+void CouplerProcessor::releaseUnrecordedNote(MIDIPort inPort, MIDIDivision division, const MidiMessage &msg)
+{
+    uint8_t note = msg.data1 & 0x7F;
+
+    if (mHandoverNotes[division].test(note)) {
+        mHandoverNotes[division].clear(note);
+        sendOutputNoteOff(division, note);
+    } else if (mForwardedNotes[division].test(note)) {
+        mForwardedNotes[division].clear(note);
+
+        // The manual may have been transferred since
+        const NoteOutput &output = mForwardedOutputs[division][note];
+        MidiMessage fmsg = msg;
+        fmsg.channel = output.channel;
+        mMIDIRouter.injectMessage(output.port, fmsg);
+    } else if (mCouplerMode != CouplerMode::CM_ENABLED) {
+        mMIDIRouter.injectMessage(inPort, msg);
+    } else {
+        mTrace.record(CTT_SUPPRESSED, division, note, false);
+    }
+}
+
+void CouplerProcessor::begin()
+{
+    // Use the stored piston mapping if there is one
+    mPistonMap.loadEEPROM();
+}
+
+void CouplerProcessor::reset()
+{
+    // Keep the configuration from before the reset for restoreSnapshot()
+    if (mSnapshotChanged) {
+        mActiveSnapshot ^= 1;
+        mSnapshotChanged = false;
+    }
+
+    allCouplerNotesOff();
+
+    resetOutputNRPN();
+
+    Registration oldActive = activeRegistration();
+
+    // initialize coupler status
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        mCoupler[i].enabled = true;
+        mCoupler[i].crescendo = false;
+        mCoupler[i].latched = false;
+        mLatchedNotes[i].reset();
+        for (int j = 0; j < MAX_DIVISION_CHANNEL + 1; j++) {
+            mCoupler[i].couple[j] = CS_OFF;
+        }
+        for (int j = 0; j < NUM_MELODY_MODES; j++) {
+            mMelodyTarget[j][i] = MIDIDivision::MD_MIDI;
+        }
+        updateRoutes((MIDIDivision)i);
+    }
+
+    // Pressed keys of divisions that had unison off are sounding again
+    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+        syncDivision(COUPLER_DIVISIONS[i]);
+    }
+
+    // Stops added by the crescendo are turned off
+    if (mCouplerMode == CouplerMode::CM_ENABLED) {
+        sendActiveStopChanges(oldActive);
+    }
+}
+
+void CouplerProcessor::allCouplerNotesOff()
+{
+    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+        allCouplerNotesOff(COUPLER_DIVISIONS[i]);
+    }
+}
+
+void CouplerProcessor::allCouplerNotesOff(MIDIDivision division)
+{
+    clearHolders(division);
+
+    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+        syncDivision(COUPLER_DIVISIONS[i]);
+    }
+}
+
+void CouplerProcessor::clearHolders(MIDIDivision source)
+{
+    HolderMask holders = getHolderMask(source);
+
+    for (int i = 0; i < NUM_MELODY_MODES; i++) {
+        mMelodyNote[i][source] = -1;
+    }
+
+    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+        MIDIDivision target = COUPLER_DIVISIONS[i];
+        NoteSet coupled = mCoupledNotes[target];
+
+        coupled.forEach([&](int note) {
+            removeHolder(target, note, holders);
+        });
+    }
+}
+
+void CouplerProcessor::addHolders(MIDIDivision source)
+{
+    for (int i = 0; i < mNumRoutes[source]; i++) {
+        const CouplerRoute &route = mRoutes[source][i];
+        HolderMask holder = getHolderBit(source, route.footage);
+        int shift = COUPLER_FOOTAGE_SHIFT[route.footage];
+
+        (keyNotes(source) & COUPLER_SOURCE_RANGE[route.footage]).forEach([&](int note) {
+            addHolder(route.target, note + shift, holder, getNoteStatus(source, note).velocity);
+        });
+    }
+
+    for (int i = 0; i < NUM_MELODY_MODES; i++) {
+        MIDIDivision target = mMelodyTarget[i][source];
+        NoteSet keys = keyNotes(source);
+        int note = (i == MM_MELODY) ? keys.highest() : keys.lowest();
+
+        if (target != MIDIDivision::MD_MIDI && note >= 0) {
+            addHolder(target, note, getHolderBit(source, COUPLER_NUM_FOOTAGES + i), getNoteStatus(source, note).velocity);
+            mMelodyNote[i][source] = note;
+        }
+    }
+}
+
+void CouplerProcessor::allDivisionsNotesOff(bool soundOff)
+{
+    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+        allDivisionNotesOff(COUPLER_DIVISIONS[i], soundOff);
+    }
+}
+
+void CouplerProcessor::allDivisionNotesOff(MIDIDivision division, bool soundOff)
+{
+    // Keys of the division are forgotten, so the notes they couple to other divisions must be released now
+    clearHolders(division);
+
+    mCoupledNotes[division].forEach([&](int note) {
+        getNoteStatus(division, note).sourceMask = 0;
+    });
+    // Played and forwarded notes that are not covered by the AllNotesOff below
+    auto releaseRedirected = [&](const NoteOutput &output, int note) {
+        if (output.port != mInjectPorts[division] || output.channel != mDivisionChannels[division]) {
+            sendNoteOff(output, note);
+        }
+    };
+    (audibleNotes(division) | mHandoverNotes[division]).forEach([&](int note) {
+        releaseRedirected(mSoundingOutputs[division][note], note);
+    });
+    mForwardedNotes[division].forEach([&](int note) {
+        releaseRedirected(mForwardedOutputs[division][note], note);
+    });
+
+    mCoupledNotes[division].reset();
+    mPressedNotes[division].reset();
+    mLatchedNotes[division].reset();
+    mVoiceLimiters[division].reset();
+    mPortVoiceLimiters[mInjectPorts[division]].releaseOwner(division);
+    mSoundingNotes[division].reset();
+    mHandoverNotes[division].reset();
+    mForwardedNotes[division].reset();
+
+    // send AllNotesOff message
+    MidiMessage msg;
+    msg.channel = mDivisionChannels[division];
+    msg.type = midi::MidiType::ControlChange;
+    msg.data1 = soundOff ? midi::MidiControlChangeNumber::AllSoundOff
+                         : midi::MidiControlChangeNumber::AllNotesOff;
+    msg.data2 = 0;
+    msg.length = 3;
+    msg.valid = true;
+
+    mMIDIRouter.injectMessage(mInjectPorts[division], msg);
+
+    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+        if (COUPLER_DIVISIONS[i] != division) {
+            syncDivision(COUPLER_DIVISIONS[i]);
+        }
+    }
+}
+
+void CouplerProcessor::sendPageTurn(ButtonType direction) {
+    if (direction == BT_PREV) {
+        Keyboard.press(KEY_LEFT);
+        Keyboard.release(KEY_LEFT);
+    } else {
+        Keyboard.press(KEY_RIGHT);
+        Keyboard.release(KEY_RIGHT);
+    }
+}
+
+void CouplerProcessor::clearCouplers(MIDIDivision division)
+{
+    allCouplerNotesOff(division);
+
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        mCoupler[division].couple[i] = CS_OFF;
+    }
+    for (int i = 0; i < NUM_MELODY_MODES; i++) {
+        mMelodyTarget[i][division] = MIDIDivision::MD_MIDI;
+    }
+    updateRoutes(division);
+
+    enableDivision(division, true);
+
+    if (mCouplerMode == CouplerMode::CM_MIDI) {
+        sendNRPN(division, NRPN_ClearCouplers, 127);
+    }
+
+    takeSnapshot();
+}
+
+int CouplerProcessor::getCouplerNRPN(MIDIDivision target, int footage)
+{
+    return NRPN_COUPLER_OFFSET + target * 4 + footage;
+}
+
+void CouplerProcessor::sendCouplerNRPN(MIDIDivision division, MIDIDivision target, CouplerState oldMode, CouplerState mode)
+{
+    for (int footage = 0; footage < COUPLER_NUM_FOOTAGES; footage++) {
+        int flag = 1 << footage;
+        if ((oldMode & flag) != (mode & flag)) {
+            sendNRPN(division, getCouplerNRPN(target, footage), (mode & flag) ? 127 : 0);
+        }
+    }
+}
+
+void CouplerProcessor::coupleDivision(MIDIDivision division, MIDIDivision target, CouplerState mode)
+{
+    if (mCouplerMode == CouplerMode::CM_MIDI) {
+        sendCouplerNRPN(division, target, coupled(division, target), mode);
+    }
+
+    updateCouplerMode(division, target, mode);
+
+    takeSnapshot();
+
+    // TODO update Panel
+}
+
+void CouplerProcessor::transposeDivision(MIDIDivision division, CouplerState mode)
+{
+    // The unison of the division itself is its normal output
+    mode = (CouplerState)(mode & ~CS_UNISON);
+
+    if (mCouplerMode == CouplerMode::CM_MIDI) {
+        sendCouplerNRPN(division, division, transposed(division), mode);
+    }
+
+    updateCouplerMode(division, division, mode);
+
+    takeSnapshot();
+
+    // TODO update Panel
+}
+
+void CouplerProcessor::setTranspose(int semitones)
+{
+    if (semitones < -MAX_TRANSPOSE || semitones > MAX_TRANSPOSE || semitones == mTranspose) {
+        return;
+    }
+
+    if (mCouplerMode != CouplerMode::CM_ENABLED) {
+        mTranspose = semitones;
+        takeSnapshot();
+        return;
+    }
+
+    int oldTranspose = mTranspose;
+
+    // Sounding notes are kept at key pitch; only the output pitch changes. Turn off 
+    // notes that do not sound after transposing, then turn on the new notes.
+    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+        MIDIDivision division = COUPLER_DIVISIONS[i];
+        NoteSet newOutput = mSoundingNotes[division].shifted(semitones);
+
+        (mSoundingNotes[division].shifted(oldTranspose) & ~newOutput).forEach([&](int note) {
+            sendCouplerNoteOff(division, note - oldTranspose);
+        });
+    }
+
+    mTranspose = semitones;
+
+    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+        MIDIDivision division = COUPLER_DIVISIONS[i];
+        NoteSet oldOutput = mSoundingNotes[division].shifted(oldTranspose);
+
+        (mSoundingNotes[division].shifted(semitones) & ~oldOutput).forEach([&](int note) {
+            sendCouplerNoteOn(division, note - semitones, getNoteVelocity(division, note - semitones));
+        });
+    }
+
+    takeSnapshot();
+}
+
+void CouplerProcessor::melodyCoupleDivision(MIDIDivision division, MelodyMode mode, MIDIDivision target)
+{
+    if (mMelodyTarget[mode][division] == target) {
+        return;
+    }
+
+    if (mCouplerMode == CouplerMode::CM_MIDI) {
+        sendNRPN(division, mode == MM_MELODY ? NRPN_MelodyCoupler : NRPN_BassCoupler, 
+                 target != MIDIDivision::MD_MIDI ? 127 : 0);
+    }
+
+    // Release the note on the old target first
+    MIDIDivision oldTarget = mMelodyTarget[mode][division];
+    int oldNote = mMelodyNote[mode][division];
+    if (oldNote >= 0) {
+        removeHolder(oldTarget, oldNote, getHolderBit(division, COUPLER_NUM_FOOTAGES + mode));
+        syncNote(oldTarget, oldNote);
+        mMelodyNote[mode][division] = -1;
+    }
+
+    mMelodyTarget[mode][division] = target;
+
+    if (mCouplerMode == CouplerMode::CM_ENABLED) {
+        updateMelodyNote(mode, division);
+    }
+
+    takeSnapshot();
+}
+
+void CouplerProcessor::enableCrescendo(MIDIDivision division, bool crescendo)
+{
+    StopSet oldActive = activeStops(division);
+
+    mCoupler[division].crescendo = crescendo;
+
+    if (mCouplerMode == CouplerMode::CM_ENABLED) {
+        StopSet active = activeStops(division);
+        sendStopChanges(division, oldActive ^ active, active);
+    }
+
+    if (mCouplerMode != CouplerMode::CM_DISABLED) {
+        sendNRPN(division, NRPN_EnableCrescendo, crescendo ? 127 : 0);
+    }
+
+    takeSnapshot();
+}
+
+bool CouplerProcessor::storeCrescendoStage(int stage)
+{
+    Registration oldActive = activeRegistration();
+
+    if (!mCrescendo.storeStage(stage, mRegistration)) {
+        return false;
+    }
+
+    if (mCouplerMode == CouplerMode::CM_ENABLED) {
+        sendActiveStopChanges(oldActive);
+    }
+    return true;
+}
+
+void CouplerProcessor::clearCrescendoStages()
+{
+    Registration oldActive = activeRegistration();
+
+    mCrescendo.reset();
+
+    if (mCouplerMode == CouplerMode::CM_ENABLED) {
+        sendActiveStopChanges(oldActive);
+    }
+}
+
+void CouplerProcessor::latchDivision(MIDIDivision division, bool latch)
+{
+    if (mCouplerMode != CouplerMode::CM_ENABLED || mCoupler[division].latched == latch) {
+        return;
+    }
+
+    mCoupler[division].latched = latch;
+
+    if (latch) {
+        mLatchedNotes[division] = mPressedNotes[division];
+        return;
+    }
+
+    // Keys that are still pressed keep playing
+    NoteSet released = mLatchedNotes[division] & ~mPressedNotes[division];
+    mLatchedNotes[division].reset();
+
+    for (int i = 0; i < mNumRoutes[division]; i++) {
+        const CouplerRoute &route = mRoutes[division][i];
+        HolderMask holder = getHolderBit(division, route.footage);
+        int shift = COUPLER_FOOTAGE_SHIFT[route.footage];
+
+        (released & COUPLER_SOURCE_RANGE[route.footage]).forEach([&](int note) {
+            removeHolder(route.target, note + shift, holder);
+        });
+    }
+
+    for (int i = 0; i < NUM_MELODY_MODES; i++) {
+        if (mMelodyTarget[i][division] != MIDIDivision::MD_MIDI) {
+            updateMelodyNote((MelodyMode)i, division);
+        }
+    }
+
+    // Only notes not held by keys or other couplers are turned off
+    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
+        syncDivision(COUPLER_DIVISIONS[i]);
+    }
+}
+
+void CouplerProcessor::enableDivision(MIDIDivision division, bool output)
+{
+    if (mCoupler[division].enabled == output) {
+        return;
+    }
+
+    mCoupler[division].enabled = output;
+
+    // send note on/off for currently pressed keys that are not coupled
+    if (mCouplerMode == CouplerMode::CM_ENABLED) {
+        syncDivision(division);
+    }
+    if (mCouplerMode == CouplerMode::CM_MIDI) {
+        sendNRPN(division, NRPN_Off, output ? 127 : 0);
+    }
+
+    takeSnapshot();
+}
+
+void CouplerProcessor::takeSnapshot()
+{
+    if (mRestoringSnapshot) {
+        return;
+    }
+
+    CouplerSnapshot &snapshot = mSnapshots[mActiveSnapshot];
+
+    snapshot.enabled = 0;
+    snapshot.crescendo = 0;
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        for (int j = 0; j < MAX_DIVISION_CHANNEL + 1; j++) {
+            snapshot.couple[i][j] = mCoupler[i].couple[j];
+        }
+        for (int j = 0; j < NUM_MELODY_MODES; j++) {
+            snapshot.melodyTarget[j][i] = mMelodyTarget[j][i];
+        }
+        snapshot.enabled   |= mCoupler[i].enabled   ? (1 << i) : 0;
+        snapshot.crescendo |= mCoupler[i].crescendo ? (1 << i) : 0;
+    }
+    snapshot.transpose = mTranspose;
+
+    mSnapshotChanged = true;
+}
+
+void CouplerProcessor::restoreSnapshot()
+{
+    const CouplerSnapshot &snapshot = mSnapshots[mActiveSnapshot ^ 1];
+
+    // Take a single snapshot at the end, not one for every restored coupler
+    mRestoringSnapshot = true;
 
-    if (oldMode == mode) {
-        return;
-    }
+    for (int i = 0; i < COUPLER_NUM_DIVISIONS; i++) {
+        MIDIDivision division = COUPLER_DIVISIONS[i];
 
-    if (mCouplerMode == CouplerMode::CM_ENABLED) {
-        for (uint8_t note = COUPLER_LOWEST_NOTE; note < COUPLER_LOWEST_NOTE + COUPLER_NUM_NOTES; note++) {
-            NoteStatus &status = getNoteStatus(source, note);
+        for (int j = 0; j < COUPLER_NUM_DIVISIONS; j++) {
+            MIDIDivision target = COUPLER_DIVISIONS[j];
+            CouplerState mode = (CouplerState)snapshot.couple[division][target];
 
-            // disable old mode 
-            if (status.pressed && oldMode != CouplerState::CS_OFF) {
-                clearCoupledNote(source, target, getTransposedNote(oldMode, note), true);
+            if (mCoupler[division].couple[target] == mode) {
+                continue;
             }
-
-            //enable new mode
-            if (status.pressed && mode != CouplerState::CS_OFF) {
-                playCoupledNote(source, target, note, getTransposedNote(mode, note), true);
+            if (target == division) {
+                transposeDivision(division, mode);
+            } else {
+                coupleDivision(division, target, mode);
             }
         }
+
+        for (int j = 0; j < NUM_MELODY_MODES; j++) {
+            melodyCoupleDivision(division, (MelodyMode)j, snapshot.melodyTarget[j][division]);
+        }
+
+        enableDivision(division, snapshot.enabled & (1 << division));
+
+        bool crescendo = snapshot.crescendo & (1 << division);
+        if (mCoupler[division].crescendo != crescendo) {
+            enableCrescendo(division, crescendo);
+        }
     }
 
-    mCoupler[source].couple[target] = mode;
+    setTranspose(snapshot.transpose);
+
+    mRestoringSnapshot = false;
+    takeSnapshot();
 }
 
-void CouplerProcessor::recordCoupledNote(MIDIDivision source, MIDIDivision target, 
-                                         const MidiMessage &msg, const MidiMessage &cmsg)
+CouplerState CouplerProcessor::coupled(MIDIDivision division, MIDIDivision target) const
 {
-    if (cmsg.type == midi::MidiType::NoteOn) {
-        playCoupledNote(source, target, msg.data1, cmsg.data1, false);
-    }
-    if (cmsg.type == midi::MidiType::NoteOff) {
-        clearCoupledNote(source, target, cmsg.data1, false);
-    }
+    return mCoupler[division].couple[target];
 }
 
-void CouplerProcessor::recordPlayedNote(MIDIDivision source, const MidiMessage &msg)
+CouplerState CouplerProcessor::transposed(MIDIDivision division) const
 {
-    int note = msg.data1;
-
-    if (note < COUPLER_LOWEST_NOTE || note >= COUPLER_LOWEST_NOTE + COUPLER_NUM_NOTES) {
-        return;
-    }
-
-    NoteStatus &status = getNoteStatus(source, note);
-
-    if (msg.type == midi::MidiType::NoteOn) {
-        status.pressed = true;
-        status.velocity = msg.data2;
-    }
-    if (msg.type == midi::MidiType::NoteOff) {
-        status.pressed = false;
-    }
+    return mCoupler[division].couple[division];
 }
 
-uint8_t CouplerProcessor::getTransposedNote(CouplerState mode, uint8_t note)
+MIDIDivision CouplerProcessor::melodyCoupled(MIDIDivision division, MelodyMode mode) const
 {
-    if (mode == CouplerState::CS_OCTAVE_DOWN) {
-        return note - 12;
-    }
-    else if (mode == CouplerState::CS_OCTAVE_UP) {
-        return note + 12;
-    }
-    else {
-        return note;
-    }
+    return mMelodyTarget[mode][division];
 }
 
-void CouplerProcessor::begin()
+bool CouplerProcessor::crescendo(MIDIDivision division) const
 {
+    return mCoupler[division].crescendo;
 }
 
-void CouplerProcessor::reset()
+bool CouplerProcessor::latched(MIDIDivision division) const
 {
-    allCouplerNotesOff();
+    return mCoupler[division].latched;
+}
 
-    // initialize coupler status
-    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
-        mCoupler[i].enabled = true;
-        mCoupler[i].crescendo = false;
-        for (int j = 0; j < MAX_DIVISION_CHANNEL + 1; j++) {
-            mCoupler[i].couple[j] = CS_OFF;
-        }
-    }
+bool CouplerProcessor::enabled(MIDIDivision division) const
+{
+    return mCoupler[division].enabled;
 }
 
-void CouplerProcessor::allCouplerNotesOff()
+bool CouplerProcessor::pistonActive(const PistonCommand &cmd) const
 {
-    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
-        allCouplerNotesOff(COUPLER_DIVISIONS[i]);
+    switch (cmd.type) {
+        case PCT_COUPLER:
+            return coupled(cmd.division, cmd.param.division) != CS_OFF;
+        case PCT_TRANSPOSE:
+            return transposed(cmd.division) != CS_OFF;
+        case PCT_OFF:
+            return !enabled(cmd.division);
+        case PCT_MELODY:
+            return melodyCoupled(cmd.division, MM_MELODY) == cmd.param.division;
+        case PCT_BASS:
+            return melodyCoupled(cmd.division, MM_BASS) == cmd.param.division;
+        case PCT_LATCH:
+            return latched(cmd.division);
+        case PCT_CRESCENDO:
+            return crescendo(cmd.division);
+        case PCT_COMBINATION:
+            return mSelectedCombination[cmd.division] == cmd.param.value;
+        case PCT_SET:
+            return mSettingCombination;
+        case PCT_HOLD:
+            return mHoldingCombination;
+        default:
+            return false;
     }
 }
 
-void CouplerProcessor::allCouplerNotesOff(MIDIDivision division)
+uint32_t CouplerProcessor::pistonLEDs(MIDIDivision division) const
 {
-    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
-        MIDIDivision target = COUPLER_DIVISIONS[i];
-        for (int note = COUPLER_LOWEST_NOTE; note < COUPLER_LOWEST_NOTE+COUPLER_NUM_NOTES; note++) {
-            clearCoupledNote(division, target, note, mCouplerMode == CouplerMode::CM_ENABLED);
+    uint32_t leds = 0;
+
+    for (int button = 0; button < MAX_PISTONS; button++) {
+        if (pistonActive(mPistonMap.command(division, button))) {
+            leds |= 1UL << button;
         }
     }
+    return leds;
 }
 
-void CouplerProcessor::allDivisionsNotesOff(bool soundOff)
+void CouplerProcessor::sendStopChanges(MIDIDivision division, const StopSet &changed, const StopSet &stops)
 {
-    for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
-        allDivisionNotesOff(COUPLER_DIVISIONS[i], soundOff);
+    auto sendStop = [&](int stop) {
+        sendNRPN(division, NRPN_STOPS_OFFSET + stop, stops.test(stop) ? 127 : 0);
+    };
+
+    // Stops in the NRPN MSB page that is currently selected on the output
+    StopSet selectedPage;
+    if (mOutputNRPN[division] >= 0) {
+        int first = (mOutputNRPN[division] & ~0x7F) - NRPN_STOPS_OFFSET;
+        selectedPage = StopSet::range(first, first + 128);
     }
+
+    (changed & selectedPage).forEach(sendStop);
+    (changed & ~selectedPage).forEach(sendStop);
 }
 
-void CouplerProcessor::allDivisionNotesOff(MIDIDivision division, bool soundOff)
+void CouplerProcessor::recallStops(MIDIDivision division, const StopSet &stops)
 {
-    for (int note = COUPLER_LOWEST_NOTE; note < COUPLER_LOWEST_NOTE+COUPLER_NUM_NOTES; note++) {
-        NoteStatus &status = getNoteStatus(division, note);
-
-        status.sourceMask = 0;
-        status.pressed = false;
-    }
-
-    // send AllNotesOff message
-    MidiMessage msg;
-    msg.channel = mDivisionChannels[division];
-    msg.type = midi::MidiType::ControlChange;
-    msg.data1 = soundOff ? midi::MidiControlChangeNumber::AllSoundOff
-                         : midi::MidiControlChangeNumber::AllNotesOff;
-    msg.data2 = 0;
-    msg.length = 3;
-    msg.valid = true;
+    StopSet oldActive = activeStops(division);
 
-    mMIDIRouter.injectMessage(mInjectPorts[division], msg);
+    mRegistration.stops[division] = stops;
 
+    StopSet active = activeStops(division);
+    sendStopChanges(division, oldActive ^ active, active);
 }
 
-void CouplerProcessor::sendPageTurn(ButtonType direction) {
-    if (direction == BT_PREV) {
-        Keyboard.press(KEY_LEFT);
-        Keyboard.release(KEY_LEFT);
-    } else {
-        Keyboard.press(KEY_RIGHT);
-        Keyboard.release(KEY_RIGHT);
-    }
+StopSet CouplerProcessor::crescendoStops(MIDIDivision division) const
+{
+    return mCoupler[division].crescendo ? mCrescendo.stops(division) : StopSet();
 }
 
-void CouplerProcessor::clearCouplers(MIDIDivision division)
+StopSet CouplerProcessor::activeStops(MIDIDivision division) const
 {
-    allCouplerNotesOff(division);
+    return mRegistration.stops[division] | crescendoStops(division);
+}
 
+Registration CouplerProcessor::activeRegistration() const
+{
+    Registration active;
     for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
-        mCoupler[division].couple[i] = CS_OFF;
-    }
-
-    enableDivision(division, true);
-
-    if (mCouplerMode == CouplerMode::CM_MIDI) {
-        sendNRPN(division, NRPN_ClearCouplers, 127);
+        active.stops[i] = activeStops((MIDIDivision)i);
     }
+    return active;
 }
 
-int CouplerProcessor::getCouplerNRPN(MIDIDivision target, CouplerState mode)
+void CouplerProcessor::sendActiveStopChanges(const Registration &oldActive)
 {
-    return NRPN_COUPLER_OFFSET + target * 4 + mode - 1;
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        StopSet active = activeStops((MIDIDivision)i);
+        sendStopChanges((MIDIDivision)i, oldActive.stops[i] ^ active, active);
+    }
 }
 
-void CouplerProcessor::coupleDivision(MIDIDivision division, MIDIDivision target, CouplerState mode)
+void CouplerProcessor::recallSequencerStep(int from, int to)
 {
-    if (mCouplerMode == CouplerMode::CM_MIDI) {
-        // TODO send different NRPM for transposed couplers?
-        if (coupled(division, target) != CouplerState::CS_OFF) {
-            // Turn off old coupler mode
-            sendNRPN(division, getCouplerNRPN(target, coupled(division, target)), 0);
+    const Registration &target = mSequencer.step(to);
+
+    if (from >= 0 && mRegistration == mSequencer.step(from)) {
+        // Stops are still at the previous step, send the precomputed changes
+        const Registration &delta = mSequencer.delta(from < to ? from : to);
+        for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+            MIDIDivision division = (MIDIDivision)i;
+            mRegistration.stops[i] ^= delta.stops[i];
+            // Stops held by the crescendo do not change
+            sendStopChanges(division, delta.stops[i] & ~crescendoStops(division), activeStops(division));
         }
-        if (mode != CouplerState::CS_OFF) {
-            // Turn on new coupler mode
-            sendNRPN(division, getCouplerNRPN(target, mode), 127);
+    } else {
+        for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+            recallStops((MIDIDivision)i, target.stops[i]);
         }
     }
 
-    updateCouplerMode(division, target, mode);
-
-    // TODO update LED output, update Panel
+    mSequencer.setPosition(to);
 }
 
-void CouplerProcessor::transposeDivision(MIDIDivision division, CouplerState mode)
+void CouplerProcessor::setStop(MIDIDivision division, int stop, bool enabled)
 {
-    if (mCouplerMode == CouplerMode::CM_MIDI) {
-        // TODO send different NRPM for transposed couplers?
-        if (transposed(division) != CouplerState::CS_OFF) {
-            // Turn off old coupler mode
-            sendNRPN(division, getCouplerNRPN(division, transposed(division)), 0);
-        }
-        if (mode != CouplerState::CS_OFF) {
-            // Turn on new coupler mode
-            sendNRPN(division, getCouplerNRPN(division, mode), 127);
-        }
+    if (stop < 0 || stop >= MAX_STOPS || stopEnabled(division, stop) == enabled) {
+        return;
     }
 
-    updateCouplerMode(division, division, mode);
+    StopSet stops = mRegistration.stops[division];
+    if (enabled) {
+        stops.set(stop);
+    } else {
+        stops.clear(stop);
+    }
 
-    // TODO update LED output, update Panel
+    if (mCouplerMode != CouplerMode::CM_DISABLED) {
+        recallStops(division, stops);
+    } else {
+        mRegistration.stops[division] = stops;
+    }
 }
 
-void CouplerProcessor::enableCrescendo(MIDIDivision division, bool crescendo)
+bool CouplerProcessor::stopEnabled(MIDIDivision division, int stop) const
 {
-    mCoupler[division].crescendo = crescendo;
-
-    if (mCouplerMode != CouplerMode::CM_DISABLED) {
-        sendNRPN(division, NRPN_EnableCrescendo, crescendo ? 127 : 0);
-    }
+    return mRegistration.stops[division].test(stop);
 }
 
-void CouplerProcessor::enableDivision(MIDIDivision division, bool output)
+void CouplerProcessor::selectCombination(MIDIDivision division, int combination)
 {
-    if (mCoupler[division].enabled == output) {
+    if (mCouplerMode == CouplerMode::CM_MIDI) {
+        sendNRPN(division, combination, 127);
+        mSelectedCombination[division] = combination;
         return;
     }
 
-    mCoupler[division].enabled = output;
-
-    // send note off for curently playing notes
-    if (mCouplerMode == CouplerMode::CM_ENABLED) {
-        for (int note = COUPLER_LOWEST_NOTE; note < COUPLER_LOWEST_NOTE+COUPLER_NUM_NOTES; note++) {
-
-            NoteStatus &status = getNoteStatus(division, note);
+    if (mCouplerMode != CouplerMode::CM_ENABLED || !CombinationMemory::validCombination(combination)) {
+        return;
+    }
 
-            if (!output && status.pressed && status.sourceMask == 0) {
-                sendCouplerNoteOff(division, note);
-            }
-            if (output && status.pressed && status.sourceMask == 0) {
-                sendCouplerNoteOn(division, note, status.velocity);
-            }
+    if (mSettingCombination) {
+        if (division == MIDIDivision::MD_Control) {
+            mCombinations.storeGeneral(combination, mRegistration);
+        } else {
+            mCombinations.storeDivisional(division, combination, mRegistration.stops[division]);
         }
+        return;
     }
-    if (mCouplerMode == CouplerMode::CM_MIDI) {
-        sendNRPN(division, NRPN_Off, output ? 127 : 0);
-    }
-}
-
-CouplerState CouplerProcessor::coupled(MIDIDivision division, MIDIDivision target) const
-{
-    return mCoupler[division].couple[target];
-}
 
-CouplerState CouplerProcessor::transposed(MIDIDivision division) const
-{
-    return mCoupler[division].couple[division];
-}
+    if (mHoldingCombination) {
+        return;
+    }
 
-bool CouplerProcessor::crescendo(MIDIDivision division) const
-{
-    return mCoupler[division].crescendo;
+    if (division == MIDIDivision::MD_Control) {
+        const Registration &general = mCombinations.general(combination);
+        for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+            recallStops((MIDIDivision)i, general.stops[i]);
+            mSelectedCombination[i] = 0;
+        }
+    } else {
+        recallStops(division, mCombinations.divisional(division, combination));
+        // The registration no longer matches the general
+        mSelectedCombination[MIDIDivision::MD_Control] = 0;
+    }
+    mSelectedCombination[division] = combination;
 }
 
-bool CouplerProcessor::enabled(MIDIDivision division) const
+void CouplerProcessor::clearCombination(MIDIDivision division)
 {
-    return mCoupler[division].enabled;
-}
+    if (division == MIDIDivision::MD_Control) {
+        for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+            mSelectedCombination[i] = 0;
+        }
+    } else {
+        mSelectedCombination[division] = 0;
+    }
 
-void CouplerProcessor::selectCombination(MIDIDivision division, int combination)
-{
-    if (mCouplerMode != CouplerMode::CM_DISABLED) {
-        sendNRPN(division, combination, 127);
+    if (mCouplerMode == CouplerMode::CM_ENABLED) {
+        if (division == MIDIDivision::MD_Control) {
+            for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+                recallStops((MIDIDivision)i, StopSet());
+            }
+        } else {
+            recallStops(division, StopSet());
+        }
+        return;
     }
-}
 
-void CouplerProcessor::clearCombination(MIDIDivision division)
-{
     if (mCouplerMode != CouplerMode::CM_DISABLED) {
         sendNRPN(division, NRPN_Clear, 127);
     }
@@ -594,9 +1545,30 @@ void CouplerProcessor::holdCombination(bool holding)
 
 void CouplerProcessor::selectSequencer(ButtonType button)
 {
-    if (mCouplerMode != CouplerMode::CM_DISABLED) {
+    if (mCouplerMode == CouplerMode::CM_MIDI) {
         sendNRPN(MIDIDivision::MD_Control, button == BT_PREV ? NRPN_SequencerPrev : NRPN_SequencerNext, 127);
+        return;
+    }
+
+    if (mCouplerMode != CouplerMode::CM_ENABLED) {
+        return;
+    }
+
+    int from = mSequencer.position();
+    int to = (button == BT_PREV) ? from - 1 : from + 1;
+
+    if (mSettingCombination) {
+        if (mSequencer.storeStep(to, mRegistration)) {
+            mSequencer.setPosition(to);
+        }
+        return;
     }
+
+    if (mHoldingCombination || to < 0 || to >= mSequencer.numSteps()) {
+        return;
+    }
+
+    recallSequencerStep(from, to);
 }
 
 void CouplerProcessor::processCrescendoChange(uint16_t crescendo)
@@ -616,6 +1588,19 @@ void CouplerProcessor::processCrescendoChange(uint16_t crescendo)
                               midi::MidiControlChangeNumber::ExpressionController, midiValue);
         }
         mPedalCrescendo = midiValue;
+
+        // Send stop changes only when the crescendo stage changes
+        int oldStage = mCrescendo.stage();
+        if (mCrescendo.update(midiValue) && mCouplerMode == CouplerMode::CM_ENABLED) {
+            for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+                MIDIDivision division = (MIDIDivision)i;
+                if (!mCoupler[i].crescendo) {
+                    continue;
+                }
+                StopSet changed = mCrescendo.stops(oldStage, division) ^ mCrescendo.stops(division);
+                sendStopChanges(division, changed & ~mRegistration.stops[i], activeStops(division));
+            }
+        }
     }
 }
 
@@ -660,17 +1645,19 @@ void CouplerProcessor::processPistonPress(MIDIDivision division, uint8_t button,
         return;
     }
 
-    PistonCommand &cmd = mPistonCommands[division][button];
+    const PistonCommand &cmd = mPistonMap.command(division, button);
 
     switch (cmd.type) {
         case PCT_COUPLER:
             if (longPress) {
-                // couple transposed
-                coupleDivision(cmd.division, cmd.param.division, CS_OCTAVE_UP);
+                // Step through footage combinations
+                coupleDivision(cmd.division, cmd.param.division, 
+                               nextCouplerState(coupled(cmd.division, cmd.param.division), COUPLER_FOOTAGE_CYCLE, 
+                                                sizeof(COUPLER_FOOTAGE_CYCLE) / sizeof(CouplerState)));
             } else {
                 // Toggle coupler status
                 if (coupled(cmd.division, cmd.param.division) == CS_OFF) {
-                    coupleDivision(cmd.division, cmd.param.division, CS_COUPLE);
+                    coupleDivision(cmd.division, cmd.param.division, CS_UNISON);
                 } else {
                     coupleDivision(cmd.division, cmd.param.division, CS_OFF);
                 }
@@ -682,16 +1669,32 @@ void CouplerProcessor::processPistonPress(MIDIDivision division, uint8_t button,
                     // Disable transpose
                     transposeDivision(cmd.division, CS_OFF);
                 } else {
-                    if (transposed(cmd.division) == CS_OFF) {
-                        transposeDivision(cmd.division, CS_OCTAVE_UP);
-                    } else if (transposed(cmd.division) == CS_OCTAVE_UP) {
-                        transposeDivision(cmd.division, CS_OCTAVE_DOWN);
-                    } else if (transposed(cmd.division) == CS_OCTAVE_DOWN) {
-                        transposeDivision(cmd.division, CS_OFF);
-                    }                    
+                    transposeDivision(cmd.division, 
+                                      nextCouplerState(transposed(cmd.division), TRANSPOSE_CYCLE,
+                                                       sizeof(TRANSPOSE_CYCLE) / sizeof(CouplerState)));
                 }
             }
             break;
+        case PCT_MELODY:
+        case PCT_BASS: {
+            MelodyMode mode = (cmd.type == PCT_MELODY) ? MM_MELODY : MM_BASS;
+            // Toggle coupler status
+            if (melodyCoupled(cmd.division, mode) == cmd.param.division) {
+                melodyCoupleDivision(cmd.division, mode, MIDIDivision::MD_MIDI);
+            } else {
+                melodyCoupleDivision(cmd.division, mode, cmd.param.division);
+            }
+            break;
+        }
+        case PCT_LATCH:
+            latchDivision(cmd.division, !latched(cmd.division));
+            break;
+        case PCT_TRANSFER:
+            transferDivisions(cmd.division, cmd.param.division);
+            break;
+        case PCT_RESTORE:
+            restoreSnapshot();
+            break;
         case PCT_OFF:
             if (longPress) {
                 clearCouplers(cmd.division);
@@ -740,7 +1743,8 @@ void CouplerProcessor::processPistonPress(MIDIDivision division, uint8_t button,
 
 void CouplerProcessor::sendCouplerMessage(MIDIDivision division, MIDIDivision target, const MidiMessage &msg)
 {
-    if (mCoupler[division].couple[target] == CS_OFF) {
+    // Transposing a division does not duplicate its other messages
+    if (target == division || mCoupler[division].couple[target] == CS_OFF) {
         return;
     }
 
@@ -748,40 +1752,164 @@ void CouplerProcessor::sendCouplerMessage(MIDIDivision division, MIDIDivision ta
     MidiMessage cmsg = msg;
     cmsg.channel = mDivisionChannels[target];
 
-    // Transpose note messages for the target division
-    if ((cmsg.type == midi::MidiType::NoteOn || cmsg.type == midi::MidiType::NoteOff)) {
-        cmsg.data1 = getTransposedNote(mCoupler[division].couple[target], cmsg.data1);
+    // Coupled parameter selects change the selected parameter of the target channel
+    bool parameterSelect = msg.data1 >= midi::MidiControlChangeNumber::NRPNLSB && 
+                           msg.data1 <= midi::MidiControlChangeNumber::RPNMSB;
+    if (msg.type == midi::MidiType::ControlChange && parameterSelect) {
+        mOutputNRPN[target] = -1;
     }
 
-    // Record the coupled note status
-    recordCoupledNote(division, target, msg, cmsg);
-
     // Inject coupler midi message into the router (using the same MIDI port)    
     mMIDIRouter.injectMessage(mInjectPorts[target], cmsg);
 }
 
+void CouplerProcessor::routeDivisionNote(MIDIPort inPort, MIDIDivision division, const MidiMessage &msg)
+{
+    uint8_t note = msg.data1 & 0x7F;
+    bool noteOn = msg.type == midi::MidiType::NoteOn && msg.data2 > 0;
+
+    if (!noteOn && !mPressedNotes[division].test(note)) {
+        // The key was pressed before the coupler was enabled; it holds no coupled notes
+        releaseUnrecordedNote(inPort, division, msg);
+        return;
+    }
+
+    // Record the input note state
+    recordPlayedNote(division, note, noteOn, msg.data2);
+
+    // Forward the original message only if it changes the sounding state of the note, i.e.
+    // not if the division unison is off, or if the note is also held by a coupler. It is sent
+    // from the input port like the other messages of the keyboard; the NoteOff of the note
+    // goes to the same output, also if it is sent by a coupler.
+    bool held = isHeld(division, note);
+    if (held != mSoundingNotes[division].test(note)) {
+        if (held) {
+            mSoundingNotes[division].set(note);
+            sendCouplerNoteOn(division, note, msg.data2, { inPort, msg.channel });
+        } else {
+            mSoundingNotes[division].clear(note);
+            sendCouplerNoteOff(division, note);
+        }
+    } else {
+        mTrace.record(CTT_SUPPRESSED, division, note, held);
+    }
+
+    // Only the highest or lowest key can change the melody and bass coupler notes
+    for (int i = 0; i < NUM_MELODY_MODES; i++) {
+        if (mMelodyTarget[i][division] != MIDIDivision::MD_MIDI) {
+            updateMelodyNote((MelodyMode)i, division);
+        }
+    }
+
+    // Latched keys keep their coupled notes when released
+    if (!noteOn && mLatchedNotes[division].test(note)) {
+        return;
+    }
+
+    // Play or release the note on all coupled divisions and footages
+    for (int i = 0; i < mNumRoutes[division]; i++) {
+        const CouplerRoute &route = mRoutes[division][i];
+
+        if (!COUPLER_SOURCE_RANGE[route.footage].test(note)) {
+            continue;
+        }
+
+        uint8_t coupledNote = note + COUPLER_FOOTAGE_SHIFT[route.footage];
+        if (noteOn) {
+            playCoupledNote(division, route, coupledNote, msg.data2);
+        } else {
+            clearCoupledNote(division, route, coupledNote);
+        }
+    }
+}
+
+void CouplerProcessor::recordInputControlChange(MIDIDivision division, const MidiMessage &msg)
+{
+    // Parameter selects forwarded from the input also change the selected output parameter
+    switch (msg.data1) {
+        case midi::MidiControlChangeNumber::NRPNMSB:
+            mInputNRPN[division] = (msg.data2 & 0x7F) << 7;
+            mOutputNRPN[division] = -1;
+            break;
+        case midi::MidiControlChangeNumber::NRPNLSB:
+            if (mInputNRPN[division] >= 0) {
+                mInputNRPN[division] |= msg.data2 & 0x7F;
+            }
+            mOutputNRPN[division] = -1;
+            break;
+        case midi::MidiControlChangeNumber::RPNMSB:
+        case midi::MidiControlChangeNumber::RPNLSB:
+            mInputNRPN[division] = -1;
+            mOutputNRPN[division] = -1;
+            break;
+        case midi::MidiControlChangeNumber::DataEntryMSB: {
+            int stop = mInputNRPN[division] - NRPN_STOPS_OFFSET;
+            if (stop >= 0 && stop < MAX_STOPS) {
+                if (msg.data2 >= 64) {
+                    mRegistration.stops[division].set(stop);
+                } else {
+                    mRegistration.stops[division].clear(stop);
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
 void CouplerProcessor::routeDivisionInput(MIDIPort inPort, const MidiMessage &msg)
 {
-    MIDIDivision division = getDivision(inPort, msg);
+    ProfileScope scope(ProfileSection::PS_COUPLER);
+
+    const DivisionMapping &mapping = getDivision(inPort, msg);
+
+    if (mapping.transferred) {
+        // Messages of a transferred manual are sent on the channel of its new division
+        MidiMessage tmsg = msg;
+        tmsg.channel = mDivisionChannels[mapping.division];
+        routeDivisionMessage(inPort, mapping.division, tmsg);
+    } else {
+        routeDivisionMessage(inPort, mapping.division, msg);
+    }
+}
+
+void CouplerProcessor::routeDivisionMessage(MIDIPort inPort, MIDIDivision division, const MidiMessage &msg)
+{
+    // Keep track of stops changed by external software or stop controllers
+    if (division != MIDIDivision::MD_MIDI && msg.type == midi::MidiType::ControlChange) {
+        recordInputControlChange(division, msg);
+    }
 
     // Forward any non-division inputs directly to output routing
     if (mCouplerMode != CouplerMode::CM_ENABLED || division == MIDIDivision::MD_MIDI) {
-        mMIDIRouter.injectMessage(inPort, msg);
+        bool noteOff = msg.type == midi::MidiType::NoteOff || (msg.type == midi::MidiType::NoteOn && msg.data2 == 0);
+        if (division != MIDIDivision::MD_MIDI && noteOff) {
+            releaseUnrecordedNote(inPort, division, msg);
+        } else if (division != MIDIDivision::MD_MIDI && msg.type == midi::MidiType::NoteOn) {
+            uint8_t note = msg.data1 & 0x7F;
+            mForwardedNotes[division].set(note);
+            mForwardedOutputs[division][note] = { inPort, msg.channel };
+            mMIDIRouter.injectMessage(inPort, applyVelocityCurve(division, msg));
+        } else {
+            mMIDIRouter.injectMessage(inPort, msg);
+        }
         return;
     }
 
-    // Record the input note state
-    recordPlayedNote(division, msg);
+    if (msg.type == midi::MidiType::NoteOn || msg.type == midi::MidiType::NoteOff) {
+        routeDivisionNote(inPort, division, msg);
+        return;
+    }
 
-    // Handle coupler states: create, transpose and inject messages for coupled divisions
+    // Forward other channel messages to all coupled divisions
     for (int i = 0; i < COUPLER_NUM_SOUND_DIVISIONS; i++) {
         MIDIDivision target = COUPLER_DIVISIONS[i];
         sendCouplerMessage(division, target, msg);    
     }
 
-    // Only inject original message if division is not OFF (only for Note messages)
+    // Only inject original message if division is not OFF
     if (mCoupler[division].enabled) {
         mMIDIRouter.injectMessage(inPort, msg);
     }
 }
-
@@ -17,7 +17,15 @@
 
 #include <common_config.h>
 
+#include "BitSet.h"
+#include "CombinationMemory.h"
+#include "CouplerTrace.h"
+#include "CrescendoEngine.h"
 #include "MIDIRouter.h"
+#include "PistonMap.h"
+#include "RegistrationSequencer.h"
+#include "VelocityCurve.h"
+#include "VoiceLimiter.h"
 
 enum CouplerMode {
     CM_DISABLED = 0x00,
@@ -25,64 +33,101 @@ enum CouplerMode {
     CM_ENABLED = 0x02
 };
 
+/**
+ * Coupler state, combination of footage flags relative to the coupled division:
+ * unison (8'), super (4', octave up) and sub (16', octave down).
+ * The bit number of a flag is the footage index.
+ */
 enum CouplerState : int {
-    CS_OFF = 0,
-    CS_COUPLE = 1,
-    CS_OCTAVE_UP = 2,
-    CS_OCTAVE_DOWN = 3
+    CS_OFF    = 0x00,
+    CS_UNISON = 0x01,
+    CS_SUPER  = 0x02,
+    CS_SUB    = 0x04
 };
 
-enum ButtonType : int {
-    BT_NONE = 0,
-    BT_NEXT = 4,
-    BT_PREV = 5,
-    BT_TOGGLE = 6,
-    BT_ALL = 7
-};
+constexpr CouplerState operator|(CouplerState a, CouplerState b) { return (CouplerState)((int)a | (int)b); }
 
-union PistonParameter {
-    int          value;
-    MIDIDivision division;
-    ButtonType   button;
-};
+// Number of footage flags in a CouplerState
+static const int COUPLER_NUM_FOOTAGES = 3;
 
-enum PistonCommandType {
-    PCT_NONE,         // Not a valid input or no action defined
-    PCT_COUPLER,      // coupler piston; Param.division: division to couple to
-    PCT_TRANSPOSE,    // transpose piston; Param.type: TOGGLE
-    PCT_OFF,          // turn division off
-    PCT_COMBINATION,  // select preset; Param.value: number of preset
-    PCT_CLEAR,        // clear combination
-    PCT_CRESCENDO,    // crescendo coupler
-    PCT_PAGE,         // Page turn; Param.type: PREV, NEXT
-    PCT_SEQUENCE,     // Sequencer; Param.type: PREV, NEXT
-    PCT_SET,          // Set combination
-    PCT_HOLD,         // Hold current combination
-    PCT_SOUNDOFF      // Send AllSoundOff; Param.value: ALL = all divisions, else param.division
+/**
+ * Single-note couplers: play only the highest (melody) or lowest (bass) 
+ * pressed key of a division on a target division.
+ */
+enum MelodyMode : int {
+    MM_MELODY = 0,
+    MM_BASS   = 1
 };
 
-struct PistonCommand {
-    MIDIDivision        division;
-    PistonCommandType   type;
-    PistonParameter     param;
-};
+static const int NUM_MELODY_MODES = 2;
+
+// Coupler holders of a source division: one per footage, one per melody mode
+static const int COUPLER_HOLDERS_PER_DIVISION = COUPLER_NUM_FOOTAGES + NUM_MELODY_MODES;
+
+// Bitmask of coupler holders of a note, see COUPLER_HOLDERS_PER_DIVISION
+typedef uint64_t HolderMask;
 
 struct CouplerStatus {
     bool enabled;
     bool crescendo;
-    // Sets the coupler mode: PP_NONE (off), PP_COUPLE (coupled), PP_OCTAVE_UP, PP_OCTAVE_DOWN
+    bool latched;
+    // Footages coupled to each target division; couple[self] is the transposition of the division
     CouplerState couple[MAX_DIVISION_CHANNEL+1];
 };
 
 struct NoteStatus {
-    // This is a bitmask of source divisions playing this note
-    uint16_t sourceMask;
-    // true if the note is played by the division manual
-    bool     pressed;
-    // Velocity of the original note
+    // Bitmask of coupler holders playing this note, one bit per source division and holder
+    HolderMask sourceMask;
+    // Velocity of the key pressed on the division manual, before the velocity curve
     uint8_t  velocity;
+    // Velocity of the coupled note, taken from the first holder, before the velocity curve
+    uint8_t  coupledVelocity;
 };
 
+/**
+ * Coupler configuration of all divisions, without played notes.
+ */
+struct CouplerSnapshot {
+    // CouplerState of each source division to each target; couple[d][d] is the transposition of d
+    uint8_t      couple[MAX_DIVISION_CHANNEL+1][MAX_DIVISION_CHANNEL+1];
+    MIDIDivision melodyTarget[NUM_MELODY_MODES][MAX_DIVISION_CHANNEL+1];
+    // One bit per division
+    uint8_t      enabled;
+    uint8_t      crescendo;
+    int8_t       transpose;
+};
+
+/**
+ * Precomputed coupler fan-out entry of a source division.
+ */
+struct CouplerRoute {
+    MIDIDivision target;
+    // Footage index, selects the transposition and the holder bit
+    uint8_t      footage;
+};
+
+/**
+ * Division played by a (port, channel) input.
+ */
+struct DivisionMapping {
+    MIDIDivision division;
+    // True if the input is transferred to another division than its own
+    bool         transferred;
+};
+
+/**
+ * Port and channel a note was sent from.
+ */
+struct NoteOutput {
+    MIDIPort port;
+    uint8_t  channel;
+};
+
+static const int COUPLER_MAX_ROUTES = (MAX_DIVISION_CHANNEL + 1) * COUPLER_NUM_FOOTAGES;
+
+// Maximum global transposition in semitones, up or down
+static const int MAX_TRANSPOSE = 12;
+
 static const int COUPLER_LOWEST_NOTE = 16;
 // 77key keyboard plus transposed octaves
 static const int COUPLER_NUM_NOTES = 77 + 2*12;
@@ -97,7 +142,9 @@ enum NRPNEvent : int {
     NRPN_Off             = 105,
     NRPN_ClearCouplers   = 106,
     NRPN_SequencerPrev   = 107,
-    NRPN_SequencerNext   = 108
+    NRPN_SequencerNext   = 108,
+    NRPN_MelodyCoupler   = 109,
+    NRPN_BassCoupler     = 110
 };
 
 static const int NRPN_COUPLER_OFFSET = 200;
@@ -108,23 +155,103 @@ class CouplerProcessor
     private:
         MIDIRouter &mMIDIRouter;
 
-        PistonCommand mPistonCommands[MAX_DIVISION_CHANNEL + 1][MAX_PISTONS];
+        PistonMap mPistonMap;
 
         MIDIDivision mChannelDivisions[NUM_MIDI_CHANNELS];
 
+        // Division played by each manual (the division of its input channel), identity if not transferred
+        MIDIDivision mTransfer[MAX_DIVISION_CHANNEL + 1];
+
+        // Double buffered (port, channel) -> division lookup; a new table is built in the
+        // inactive buffer and activated with a single store.
+        DivisionMapping mDivisionTables[2][NUM_MIDI_PORTS][NUM_MIDI_CHANNELS];
+        volatile uint8_t mActiveDivisionTable = 0;
+
         midi::Channel mDivisionChannels[MAX_DIVISION_CHANNEL + 1];
 
         MIDIPort mInjectPorts[MAX_DIVISION_CHANNEL + 1];
 
         CouplerStatus mCoupler[MAX_DIVISION_CHANNEL + 1];
 
-        NoteStatus mPressedNotes[MAX_DIVISION_CHANNEL+1][COUPLER_NUM_NOTES];
+        // Double buffered coupler configuration: the active snapshot follows every change, the
+        // other one keeps the configuration from before the last reset. A reset switches the
+        // buffers if the active snapshot changed since the previous reset.
+        CouplerSnapshot mSnapshots[2];
+        uint8_t mActiveSnapshot = 0;
+        bool mSnapshotChanged = false;
+        bool mRestoringSnapshot = false;
+
+        NoteStatus mNoteStatus[MAX_DIVISION_CHANNEL+1][NUM_MIDI_NOTES];
+
+        // Velocity curve of each division output, applied when a NoteOn is sent
+        VelocityTable mVelocityCurves[MAX_DIVISION_CHANNEL+1];
+
+        // Keys currently pressed on the division manual
+        NoteSet mPressedNotes[MAX_DIVISION_CHANNEL+1];
+
+        // Keys latched by the division hold, they keep playing after release until unlatched
+        NoteSet mLatchedNotes[MAX_DIVISION_CHANNEL+1];
+
+        // Notes of the division with at least one coupler holder
+        NoteSet mCoupledNotes[MAX_DIVISION_CHANNEL+1];
+
+        // Notes for which a NoteOn has been sent on the division output
+        NoteSet mSoundingNotes[MAX_DIVISION_CHANNEL+1];
+
+        // Output of the NoteOn of each sounding note, at output pitch. Played notes are sent
+        // from their input port like the other messages of the keyboard, coupled notes from
+        // the division inject port.
+        NoteOutput mSoundingOutputs[MAX_DIVISION_CHANNEL+1][NUM_MIDI_NOTES];
+
+        // Keys that were sounding on the division output when the coupler was switched off;
+        // their NoteOff is sent on the division output as well.
+        NoteSet mHandoverNotes[MAX_DIVISION_CHANNEL+1];
+
+        // Keys whose NoteOn was forwarded as-is while the coupler was not enabled, and
+        // the output it was sent to
+        NoteSet mForwardedNotes[MAX_DIVISION_CHANNEL+1];
+        NoteOutput mForwardedOutputs[MAX_DIVISION_CHANNEL+1][NUM_MIDI_NOTES];
+
+        // Polyphony limit of each division output, at output pitch
+        VoiceLimiter mVoiceLimiters[MAX_DIVISION_CHANNEL+1];
+
+        // Polyphony limit of each inject port, shared by all divisions sending to the port.
+        // Voices are owned by their division, at output pitch.
+        VoiceLimiter mPortVoiceLimiters[NUM_MIDI_PORTS];
+
+        // Coupler fan-out per source division, rebuilt when a coupler changes
+        CouplerRoute mRoutes[MAX_DIVISION_CHANNEL+1][COUPLER_MAX_ROUTES];
+        uint8_t      mNumRoutes[MAX_DIVISION_CHANNEL+1];
+
+        // Target division of the melody and bass coupler per source division, MD_MIDI if off
+        MIDIDivision mMelodyTarget[NUM_MELODY_MODES][MAX_DIVISION_CHANNEL+1];
+
+        // Key currently played by the melody and bass coupler per source division, -1 if none
+        int8_t       mMelodyNote[NUM_MELODY_MODES][MAX_DIVISION_CHANNEL+1];
+
+        // Current stop state of all divisions, without stops added by the crescendo
+        Registration mRegistration;
+
+        CrescendoEngine mCrescendo;
+
+        CombinationMemory mCombinations;
+
+        RegistrationSequencer mSequencer;
+
+        // NRPN parameter number selected on the input of each division, -1 if none
+        int mInputNRPN[MAX_DIVISION_CHANNEL+1];
+
+        // NRPN parameter number last selected on the output channel of each division, -1 if unknown
+        int mOutputNRPN[MAX_DIVISION_CHANNEL+1];
+
+        // Global transposition in semitones, applied to all notes sent on sound divisions
+        int mTranspose = 0;
 
         uint16_t mPedalCrescendo = 0;
         uint16_t mPedalSwell = 0;
         uint16_t mPedalChoir = 0;
 
-        bool mDebug = false;
+        CouplerTrace mTrace;
 
         /**
          * Mode of the coupler processor:
@@ -144,29 +271,91 @@ class CouplerProcessor
          */
         bool mHoldingCombination = false;
 
+        // Last recalled combination per division, 0 if none; MD_Control holds the general
+        uint8_t mSelectedCombination[MAX_DIVISION_CHANNEL + 1];
+
         /**
          * Get the division for a MIDI message.
          * \param inPort where the message is received from.
          * \param msg the MIDI message.
          */
-        MIDIDivision getDivision(MIDIPort inPort, const MidiMessage &msg);
+        const DivisionMapping &getDivision(MIDIPort inPort, const MidiMessage &msg);
+
+        /**
+         * Build the (port, channel) lookup table from channel divisions and transfers and activate it.
+         */
+        void updateDivisionTable();
+
+        /**
+         * Remove all coupler holders of a source division, without sending MIDI messages.
+         */
+        void clearHolders(MIDIDivision source);
+
+        /**
+         * Add coupler holders for all pressed keys of a source division, without sending MIDI messages.
+         */
+        void addHolders(MIDIDivision source);
+
+        NoteStatus &getNoteStatus(MIDIDivision division, uint8_t note);
 
-        NoteStatus &getNoteStatus(MIDIDivision division, int note);
+        bool isHeld(MIDIDivision division, uint8_t note) const;
+
+        uint8_t getNoteVelocity(MIDIDivision division, uint8_t note);
 
         /**
-         * Send MIDI note on message on a given division.
+         * Get a NoteOn message with the velocity mapped by the velocity curve of the division.
+         */
+        MidiMessage applyVelocityCurve(MIDIDivision division, const MidiMessage &msg) const;
+
+        /**
+         * Send MIDI note on message on a given division, applying the division velocity curve
+         * and the global transposition. Notes transposed out of range are not sent.
          * 
          * MIDI message is sent regardless of CouplerMode.
          */
         void sendCouplerNoteOn(MIDIDivision division, int note, uint8_t velocity);
 
         /**
-         * Send MIDI note off message on a given division.
+         * Send MIDI note on message on a given division from the given output port and channel.
+         */
+        void sendCouplerNoteOn(MIDIDivision division, int note, uint8_t velocity, const NoteOutput &output);
+
+        /**
+         * Send MIDI note off message on a given division, applying the global transposition.
+         * No message is sent if the voice of the note has been stolen.
          * 
          * MIDI message is sent regardless of CouplerMode.
          */
         void sendCouplerNoteOff(MIDIDivision division, int note);
 
+        /**
+         * Send MIDI note off message for an output note, without transposition, to the output
+         * its NoteOn was sent to.
+         */
+        void sendOutputNoteOff(MIDIDivision division, uint8_t note);
+
+        /**
+         * Send MIDI note off message from the given output port and channel.
+         */
+        void sendNoteOff(const NoteOutput &output, uint8_t note);
+
+        /**
+         * Get the output notes of the division that are sounding, i.e. not stolen.
+         */
+        NoteSet audibleNotes(MIDIDivision division) const;
+
+        /**
+         * Allocate an output voice for a note on the division and its port, send a NoteOff for
+         * the notes whose voices are stolen.
+         */
+        void allocateVoice(MIDIDivision division, uint8_t note);
+
+        /**
+         * Allocate a voice for a note on the port of the division, send a NoteOff for the note
+         * whose voice is stolen, which may belong to another division on the same port.
+         */
+        void allocatePortVoice(MIDIDivision division, uint8_t note);
+
         /**
          * Send MIDI CC message on a given division.
          * 
@@ -176,24 +365,57 @@ class CouplerProcessor
 
         /**
          * Send MIDI Non-Registered Parameter Number message on a given division.
+         * The parameter select MSB and LSB are only sent if they differ from the
+         * parameter selected by the previous NRPN on the division channel.
          * 
          * MIDI message is sent regardless of CouplerMode.
          */
         void sendNRPN(MIDIDivision division, int parameterNumber, uint8_t value);
 
         /**
-         * Play a note on a division.
-         * 
-         * \param sendMidi if true, send a NoteOn if this note is not yet played.
+         * Forget the selected output NRPN parameters, so that the next NRPN sends a full parameter select.
          */
-        void playCoupledNote(MIDIDivision source, MIDIDivision target, int sourceNote, int note, bool sendMidi);
+        void resetOutputNRPN();
 
         /**
-         * Stop playing a note on a division.
-         * 
-         * \param sendMidi if true, send a NoteOff if this note is not played from any division anymore.
+         * Send NoteOn or NoteOff for a note if its held state differs from its sounding state.
+         */
+        void syncNote(MIDIDivision division, uint8_t note);
+
+        /**
+         * Send NoteOn and NoteOff messages for all notes whose held state differs from the sounding state.
+         */
+        void syncDivision(MIDIDivision division);
+
+        /**
+         * Add a coupler holder to a note, without sending MIDI messages.
+         */
+        void addHolder(MIDIDivision target, uint8_t note, HolderMask holder, uint8_t velocity);
+
+        /**
+         * Remove coupler holders from a note, without sending MIDI messages.
+         */
+        void removeHolder(MIDIDivision target, uint8_t note, HolderMask holder);
+
+        /**
+         * Play a coupled note on a division, send a NoteOn if this note is not yet sounding.
+         */
+        void playCoupledNote(MIDIDivision source, const CouplerRoute &route, uint8_t note, uint8_t velocity);
+
+        /**
+         * Stop playing a coupled note on a division, send a NoteOff if this note is not held anymore.
+         */
+        void clearCoupledNote(MIDIDivision source, const CouplerRoute &route, uint8_t note);
+
+        /**
+         * Rebuild the coupler fan-out table of a source division.
+         */
+        void updateRoutes(MIDIDivision source);
+
+        /**
+         * Hand the melody or bass coupler of a division over to its new highest or lowest key.
          */
-        void clearCoupledNote(MIDIDivision source, MIDIDivision target, int note, bool sendMidi);
+        void updateMelodyNote(MelodyMode mode, MIDIDivision source);
 
         /** 
          * Change the state of a coupler.
@@ -203,21 +425,79 @@ class CouplerProcessor
         void updateCouplerMode(MIDIDivision source, MIDIDivision target, CouplerState mode);
 
         /**
-         * Record the state of a coupled Note On/off message.
+         * Send NRPN on/off messages for all footages that differ between two coupler states.
          */
-        void recordCoupledNote(MIDIDivision source, MIDIDivision target, const MidiMessage &msg, const MidiMessage &cmsg);
+        void sendCouplerNRPN(MIDIDivision division, MIDIDivision target, CouplerState oldMode, CouplerState mode);
 
         /**
-         * Update NoteStatus for a received input MIDI message.
+         * Update the pressed key state for a received input Note message.
          */
-        void recordPlayedNote(MIDIDivision source, const MidiMessage &msg);
+        void recordPlayedNote(MIDIDivision source, uint8_t note, bool noteOn, uint8_t velocity);
 
-        uint8_t getTransposedNote(CouplerState mode, uint8_t note);
+        /**
+         * Send the NoteOff of a key that was pressed while the coupler was not enabled,
+         * on the output its NoteOn was sent to. NoteOffs of other keys are forwarded as-is
+         * if the coupler is not enabled, and dropped otherwise.
+         */
+        void releaseUnrecordedNote(MIDIPort inPort, MIDIDivision division, const MidiMessage &msg);
 
-        int getCouplerNRPN(MIDIDivision target, CouplerState mode);
+        /**
+         * Process a Note message played on a division manual: 
+         * forward the original message and play all coupled notes.
+         */
+        void routeDivisionNote(MIDIPort inPort, MIDIDivision division, const MidiMessage &msg);
 
         /**
-         * Create MIDI messages for coupled notes for a target division for a received division manual message.
+         * Process a MIDI message received for a division, after division lookup.
+         */
+        void routeDivisionMessage(MIDIPort inPort, MIDIDivision division, const MidiMessage &msg);
+
+        int getCouplerNRPN(MIDIDivision target, int footage);
+
+        /**
+         * Send stop NRPNs for a set of changed stops of a division.
+         * Stops sharing the currently selected NRPN MSB are sent first, so that every
+         * parameter select MSB is sent at most once.
+         * 
+         * \param changed the stops to send.
+         * \param stops the new stop state.
+         */
+        void sendStopChanges(MIDIDivision division, const StopSet &changed, const StopSet &stops);
+
+        /**
+         * Set the stops of a division, send stop NRPNs only for stops that change.
+         */
+        void recallStops(MIDIDivision division, const StopSet &stops);
+
+        /**
+         * Get the stops added to a division by the crescendo.
+         */
+        StopSet crescendoStops(MIDIDivision division) const;
+
+        /**
+         * Get the sounding stops of a division, i.e., the registration plus crescendo stops.
+         */
+        StopSet activeStops(MIDIDivision division) const;
+
+        /**
+         * Send stop NRPNs for all stops that changed from a previous set of active stops.
+         */
+        void sendActiveStopChanges(const Registration &oldActive);
+
+        Registration activeRegistration() const;
+
+        /**
+         * Move the sequencer from one step to an adjacent step and send the stop changes.
+         */
+        void recallSequencerStep(int from, int to);
+
+        /**
+         * Track NRPN selects and stop changes received on a division input.
+         */
+        void recordInputControlChange(MIDIDivision division, const MidiMessage &msg);
+
+        /**
+         * Forward a received division manual message (other than notes) to a coupled target division.
          * 
          * \param division the source division of the MIDI message.
          * \param target the target division to check the coupler and send any coupled message for.
@@ -225,18 +505,71 @@ class CouplerProcessor
          */
         void sendCouplerMessage(MIDIDivision division, MIDIDivision target, const MidiMessage &msg);
 
+        /**
+         * Store the current coupler configuration in the active snapshot.
+         */
+        void takeSnapshot();
+
     public:
         explicit CouplerProcessor(MIDIRouter &router);
 
         void setDivisionChannel(MIDIDivision division, uint8_t channel);
 
+        /**
+         * Swap the divisions played by two manuals. Held keys keep sounding on the new division.
+         * Calling it again with the same divisions swaps them back.
+         */
+        void transferDivisions(MIDIDivision a, MIDIDivision b);
+
+        /**
+         * Get the division played by the manual of a division.
+         */
+        MIDIDivision transferred(MIDIDivision division) const { return mTransfer[division]; }
+
 
         void setCouplerMode(CouplerMode mode);
 
+        /**
+         * Set the velocity curve of a division to a standard curve.
+         */
+        void setVelocityCurve(MIDIDivision division, VelocityCurve curve);
+
+        /**
+         * Set a user velocity curve for a division.
+         */
+        void setVelocityCurve(MIDIDivision division, const VelocityTable &curve);
+
+        /**
+         * Limit the number of notes sounding on a division output. If the limit is reached,
+         * a voice is stolen according to the steal policy.
+         * 
+         * \param maxVoices 1..MAX_VOICES, or 0 for no limit.
+         */
+        void setPolyphony(MIDIDivision division, uint8_t maxVoices, StealPolicy policy);
+
+        const VoiceLimiter &voiceLimiter(MIDIDivision division) const { return mVoiceLimiters[division]; }
+
+        /**
+         * Limit the number of notes sounding on the inject port of a division, together with all
+         * other divisions sending to the same port. The division limit applies as well.
+         * 
+         * \param maxVoices 1..MAX_VOICES, or 0 for no limit.
+         */
+        void setPortPolyphony(MIDIDivision division, uint8_t maxVoices, StealPolicy policy);
+
+        const VoiceLimiter &portVoiceLimiter(MIDIDivision division) const { return mPortVoiceLimiters[mInjectPorts[division]]; }
+
+        MIDIPort injectPort(MIDIDivision division) const { return mInjectPorts[division]; }
+
         CouplerMode couplerMode() const { return mCouplerMode; }
 
 
-        void setDebug(bool debug) { mDebug = debug; }
+        /**
+         * Enable or disable recording of coupler trace events.
+         */
+        void setDebug(bool debug) { mTrace.enable(debug); }
+
+        CouplerTrace &trace() { return mTrace; }
 
         /**
          * Reset coupler states and turn all notes off.
@@ -269,37 +602,121 @@ class CouplerProcessor
          */
         void sendPageTurn(ButtonType direction);
 
+        /**
+         * Get the coupler configuration from before the last reset.
+         */
+        const CouplerSnapshot &snapshot() const { return mSnapshots[mActiveSnapshot ^ 1]; }
+
+        /**
+         * Restore the coupler configuration from before the last reset. Only couplers and 
+         * settings that differ from the snapshot are changed and sent.
+         */
+        void restoreSnapshot();
+
         /**
          * Clear all couplers for a division.
          */
         void clearCouplers(MIDIDivision division);
 
         /**
-         * \param mode Can be one of PP_NONE (off), PP_COUPLE, PP_OCTAVE_UP, PP_OCTAVE_DOWN.
+         * \param mode Any combination of CS_UNISON, CS_SUPER and CS_SUB, or CS_OFF.
          */
         void coupleDivision(MIDIDivision division, MIDIDivision target, CouplerState mode);
 
         /**
-         * \param param Can be one of PP_NONE (off), PP_OCTAVE_UP, PP_OCTAVE_DOWN.
+         * \param mode Any combination of CS_SUPER and CS_SUB, or CS_OFF.
+         *             The unison of a division is controlled by enableDivision().
          */
         void transposeDivision(MIDIDivision division, CouplerState mode);
 
+        /**
+         * Transpose all sound divisions. Sounding notes are moved to the new pitch, only 
+         * notes that do not sound in both transpositions are turned off or on.
+         * 
+         * \param semitones -MAX_TRANSPOSE..MAX_TRANSPOSE
+         */
+        void setTranspose(int semitones);
+
+        int transpose() const { return mTranspose; }
+
+        /**
+         * \param target Division to play the highest (MM_MELODY) or lowest (MM_BASS) key on, MD_MIDI to turn off.
+         */
+        void melodyCoupleDivision(MIDIDivision division, MelodyMode mode, MIDIDivision target);
+
+        /**
+         * Enable or disable adding the crescendo stage stops to a division.
+         */
         void enableCrescendo(MIDIDivision division, bool crescendo);
 
         /**
+         * Latch the currently pressed keys of a division, or release all latched keys
+         * that are not pressed anymore.
+         */
+        void latchDivision(MIDIDivision division, bool latch);
+
+        /**
+         * Store the current registration as crescendo stage.
+         * 
+         * \param stage 1..numStages+1 to change or append a stage.
+         */
+        bool storeCrescendoStage(int stage);
+
+        /**
+         * Remove all crescendo stages.
+         */
+        void clearCrescendoStages();
+
+        const CrescendoEngine &crescendoEngine() const { return mCrescendo; }
+
+        /**
+         * Set the unison of a division on or off.
+         * 
          * \param output Enable or disable normal output of division (not including transposed or couplers).
          */
         void enableDivision(MIDIDivision, bool output);
 
 
+        /**
+         * Get all keys of a division that are played: pressed or latched keys.
+         */
+        NoteSet keyNotes(MIDIDivision division) const;
+
+        /**
+         * Get all notes that should sound on a division: coupled notes and,
+         * unless the division unison is off, pressed or latched keys.
+         */
+        NoteSet heldNotes(MIDIDivision division) const;
+
         CouplerState coupled(MIDIDivision division, MIDIDivision target) const;
 
         CouplerState transposed(MIDIDivision division) const;
 
+        MIDIDivision melodyCoupled(MIDIDivision division, MelodyMode mode) const;
+
         bool crescendo(MIDIDivision division) const;
 
+        bool latched(MIDIDivision division) const;
+
         bool enabled(MIDIDivision division) const;
+
+        /**
+         * Check if the state switched by a piston command is on, i.e. if its LED should be lit.
+         */
+        bool pistonActive(const PistonCommand &cmd) const;
+
+        /**
+         * Get the LED state of all pistons of a division, one bit per button.
+         */
+        uint32_t pistonLEDs(MIDIDivision division) const;
         
+        /**
+         * Recall a combination, or store the current stops to it if setting combinations is enabled.
+         * Combinations of MD_Control are generals, all others are divisionals.
+         * 
+         * With CM_ENABLED the combination action is local and only stop changes are sent,
+         * with CM_MIDI the combination is sent as NRPN to external software.
+         */
         void selectCombination(MIDIDivision division, int combination);
 
         void clearCombination(MIDIDivision division);
@@ -311,11 +728,38 @@ class CouplerProcessor
 
         void setCombination(bool enable);
 
+        /**
+         * Turn a stop on or off and send the stop NRPN if it changes.
+         * 
+         * \param stop stop number of the division, 0..MAX_STOPS-1.
+         */
+        void setStop(MIDIDivision division, int stop, bool enabled);
+
+        bool stopEnabled(MIDIDivision division, int stop) const;
+
+        /**
+         * Get the current registration, without the stops added by the crescendo.
+         */
+        const Registration &registration() const { return mRegistration; }
+
+        CombinationMemory &combinations() { return mCombinations; }
+
         void holdCombination(bool enable);
 
 
+        /**
+         * Move the sequencer to the next or previous step.
+         * 
+         * With CM_ENABLED the steps are recalled locally; if setting combinations is enabled, 
+         * the current stops are stored to the selected step instead. With CM_MIDI the
+         * sequencer command is sent as NRPN to external software.
+         */
         void selectSequencer(ButtonType button);
 
+        RegistrationSequencer &sequencer() { return mSequencer; }
+
+
+        PistonMap &pistonMap() { return mPistonMap; }
 
         void processPistonPress(MIDIDivision division, uint8_t button, bool longPress);
 
@@ -0,0 +1,64 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Coupler trace ring buffer implementation
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "CouplerTrace.h"
+
+#include <Arduino.h>
+
+#include <inttypes.h>
+
+void CouplerTrace::write(CouplerTraceType type, uint8_t division, uint8_t note, uint8_t value)
+{
+    uint32_t head = mHead;
+    CouplerTraceEvent &event = mEvents[head & (COUPLER_TRACE_SIZE - 1)];
+
+    event.time = micros();
+    event.type = type;
+    event.division = division;
+    event.note = note;
+    event.value = value;
+
+    // Publish the event only after it is written
+    __sync_synchronize();
+    mHead = head + 1;
+}
+
+bool CouplerTrace::read(CouplerTraceEvent &event)
+{
+    uint32_t head = mHead;
+
+    if (head - mTail > COUPLER_TRACE_SIZE) {
+        // Skip events that have been overwritten
+        mLost += head - mTail - COUPLER_TRACE_SIZE;
+        mTail = head - COUPLER_TRACE_SIZE;
+    }
+    if (mTail == head) {
+        return false;
+    }
+
+    event = mEvents[mTail & (COUPLER_TRACE_SIZE - 1)];
+
+    // The writer may have overwritten the event while it was copied
+    __sync_synchronize();
+    if (mHead - mTail > COUPLER_TRACE_SIZE) {
+        mLost++;
+        mTail++;
+        return read(event);
+    }
+
+    mTail++;
+    return true;
+}
+
+void CouplerTrace::clear()
+{
+    mTail = mHead;
+    mLost = 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Binary trace of coupler events.
+ * Events are written into a ring buffer by the coupler and read by the command line
+ * without locks; when the buffer is full, the oldest events are overwritten.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+enum CouplerTraceType : uint8_t {
+    CTT_COUPLER       = 0,  // coupler changed; note: target division, value: old state << 4 | new state
+    CTT_NOTE_ON       = 1,  // coupler NoteOn sent; note: output note, value: velocity
+    CTT_NOTE_OFF      = 2,  // coupler NoteOff sent; note: output note
+    CTT_SUPPRESSED    = 3,  // key note already in the requested state, nothing sent; value: 1 for on, 0 for off
+    CTT_HOLDER_ADD    = 4,  // holder added to the source mask of a key note; value: holder bit
+    CTT_HOLDER_REMOVE = 5   // holder removed from the source mask of a key note; value: holder bit
+};
+
+/**
+ * Trace record, eight bytes. This is also the binary format of the raw trace dump.
+ */
+struct CouplerTraceEvent {
+    // Time of the event in microseconds
+    uint32_t time;
+    CouplerTraceType type;
+    uint8_t division;
+    uint8_t note;
+    uint8_t value;
+};
+
+// Number of events in the ring buffer, must be a power of two
+static const uint32_t COUPLER_TRACE_SIZE = 512;
+
+class CouplerTrace
+{
+    private:
+        CouplerTraceEvent mEvents[COUPLER_TRACE_SIZE];
+
+        // Free running write and read counters, the buffer index is the counter modulo the size
+        volatile uint32_t mHead = 0;
+        uint32_t mTail = 0;
+
+        uint32_t mLost = 0;
+
+        bool mEnabled = false;
+
+        void write(CouplerTraceType type, uint8_t division, uint8_t note, uint8_t value);
+
+    public:
+        CouplerTrace() {}
+
+        void enable(bool enabled) { mEnabled = enabled; }
+
+        bool enabled() const { return mEnabled; }
+
+        /**
+         * Record an event if tracing is enabled.
+         */
+        void record(CouplerTraceType type, uint8_t division, uint8_t note, uint8_t value = 0) {
+            if (mEnabled) {
+                write(type, division, note, value);
+            }
+        }
+
+        /**
+         * Read the oldest unread event.
+         *
+         * \return false if there are no unread events.
+         */
+        bool read(CouplerTraceEvent &event);
+
+        /**
+         * Discard all unread events.
+         */
+        void clear();
+
+        /**
+         * Number of events that were overwritten before they were read.
+         */
+        uint32_t lost() const { return mLost; }
+};
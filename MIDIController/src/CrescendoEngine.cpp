@@ -0,0 +1,77 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Crescendo pedal stage table implementation
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "CrescendoEngine.h"
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+static const StopSet NO_STOPS;
+
+CrescendoEngine::CrescendoEngine()
+{
+    reset();
+}
+
+void CrescendoEngine::reset()
+{
+    mNumStages = 0;
+    mStage = 0;
+}
+
+int CrescendoEngine::getStage(int value) const
+{
+    if (value < 0) {
+        value = 0;
+    }
+    if (value > 127) {
+        value = 127;
+    }
+    // Split the pedal range evenly into stage 0 and all configured stages
+    return value * (mNumStages + 1) / 128;
+}
+
+const StopSet &CrescendoEngine::stops(int stage, MIDIDivision division) const
+{
+    if (stage <= 0 || stage > mNumStages) {
+        return NO_STOPS;
+    }
+    return mStages[stage - 1].stops[division];
+}
+
+bool CrescendoEngine::storeStage(int stage, const Registration &registration)
+{
+    if (stage < 1 || stage > mNumStages + 1 || stage > MAX_CRESCENDO_STAGES) {
+        return false;
+    }
+
+    mStages[stage - 1] = registration;
+    if (stage > mNumStages) {
+        mNumStages = stage;
+    }
+
+    return true;
+}
+
+bool CrescendoEngine::update(uint8_t value)
+{
+    // Only move to a new stage if the pedal is past the stage boundary by the hysteresis
+    int stage = getStage(value - CRESCENDO_HYSTERESIS);
+    if (stage <= mStage) {
+        stage = getStage(value + CRESCENDO_HYSTERESIS);
+        if (stage >= mStage) {
+            return false;
+        }
+    }
+
+    mStage = stage;
+    return true;
+}
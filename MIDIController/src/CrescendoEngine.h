@@ -0,0 +1,80 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Crescendo pedal stage table.
+ * Maps the crescendo pedal position to a stage with hysteresis; each stage is a set
+ * of stops that is added to the current registration.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+#include "CombinationMemory.h"
+
+static const int MAX_CRESCENDO_STAGES = 32;
+
+// Pedal movement (0..127 scale) beyond a stage boundary needed to change the stage
+static const int CRESCENDO_HYSTERESIS = 2;
+
+class CrescendoEngine
+{
+    private:
+        // mStages[i] are the stops of stage i+1; stage 0 adds no stops
+        Registration mStages[MAX_CRESCENDO_STAGES];
+
+        int mNumStages = 0;
+
+        int mStage = 0;
+
+        int getStage(int value) const;
+
+    public:
+        CrescendoEngine();
+
+        /**
+         * Remove all stages.
+         */
+        void reset();
+
+        int numStages() const { return mNumStages; }
+
+        /**
+         * Get the current stage, 0 if the crescendo adds no stops.
+         */
+        int stage() const { return mStage; }
+
+        /**
+         * Get the stops of a division added by a stage.
+         * 
+         * \param stage 0..numStages().
+         */
+        const StopSet &stops(int stage, MIDIDivision division) const;
+
+        /**
+         * Get the stops of a division added by the current stage.
+         */
+        const StopSet &stops(MIDIDivision division) const { return stops(mStage, division); }
+
+        /**
+         * Store the stops of a stage.
+         * 
+         * \param stage 1..numStages()+1, to change or append a stage.
+         * \return false if the stage is out of range.
+         */
+        bool storeStage(int stage, const Registration &registration);
+
+        /**
+         * Update the current stage from the crescendo pedal position.
+         * 
+         * \param value pedal position, 0..127.
+         * \return true if the stage changed.
+         */
+        bool update(uint8_t value);
+};
@@ -0,0 +1,317 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * I2C transaction queue implementation
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "I2CBus.h"
+
+#include <Arduino.h>
+
+#include <inttypes.h>
+
+I2CTransaction *I2CBus::enqueue(Controller controller, uint8_t muxPort, bool read, uint8_t length,
+                                I2CCompletionCallback callback, void *context)
+{
+    if (mCount == I2C_QUEUE_SIZE || length > MAX_I2C_DATA) {
+        return nullptr;
+    }
+
+    I2CTransaction &transaction = mQueue[(mHead + mCount) % I2C_QUEUE_SIZE];
+    mCount++;
+
+    transaction.controller = controller;
+    transaction.muxPort = muxPort;
+    transaction.read = read;
+    transaction.length = length;
+    transaction.countOffset = I2C_NO_COUNT;
+    transaction.status = I2CStatus::IS_OK;
+    transaction.retries = 0;
+    transaction.callback = callback;
+    transaction.context = context;
+
+    return &transaction;
+}
+
+bool I2CBus::write(Controller controller, uint8_t muxPort, uint8_t command, const uint8_t *data, uint8_t length,
+                   I2CCompletionCallback callback, void *context)
+{
+    I2CTransaction *transaction = enqueue(controller, muxPort, false, length + 1, callback, context);
+    if (!transaction) {
+        return false;
+    }
+
+    transaction->data[0] = command;
+    for (int i = 0; i < length; i++) {
+        transaction->data[i + 1] = data[i];
+    }
+    return true;
+}
+
+bool I2CBus::read(Controller controller, uint8_t muxPort, uint8_t length,
+                  I2CCompletionCallback callback, void *context, uint8_t countOffset)
+{
+    I2CTransaction *transaction = enqueue(controller, muxPort, true, length, callback, context);
+    if (!transaction) {
+        return false;
+    }
+
+    transaction->countOffset = countOffset;
+    return true;
+}
+
+bool I2CBus::isQueued(Controller controller, bool read) const
+{
+    for (int i = 0; i < mCount; i++) {
+        const I2CTransaction &transaction = mQueue[(mHead + i) % I2C_QUEUE_SIZE];
+        if (transaction.controller == controller && transaction.read == read) {
+            return true;
+        }
+    }
+    return false;
+}
+
+I2CDeviceStats *I2CBus::deviceStats(uint8_t address, uint8_t muxPort)
+{
+    for (int i = 0; i < mNumDevices; i++) {
+        if (mDeviceStats[i].address == address && mDeviceStats[i].muxPort == muxPort) {
+            return &mDeviceStats[i];
+        }
+    }
+    if (mNumDevices == MAX_I2C_DEVICES) {
+        return nullptr;
+    }
+
+    I2CDeviceStats &stats = mDeviceStats[mNumDevices++];
+    stats = {};
+    stats.address = address;
+    stats.muxPort = muxPort;
+    return &stats;
+}
+
+void I2CBus::recordTransfer(uint8_t address, uint8_t muxPort, uint8_t bytesWritten, uint8_t bytesRead,
+                            I2CStatus status, uint32_t duration)
+{
+    I2CDeviceStats *stats = deviceStats(address, muxPort);
+    if (!stats) {
+        return;
+    }
+
+    stats->transfers++;
+    stats->bytesWritten += bytesWritten;
+    stats->bytesRead += bytesRead;
+
+    switch (status) {
+        case I2CStatus::IS_OK:
+            break;
+        case I2CStatus::IS_NACK:
+            stats->nacks++;
+            break;
+        case I2CStatus::IS_TIMEOUT:
+            stats->timeouts++;
+            break;
+        default:
+            stats->errors++;
+            break;
+    }
+
+    uint8_t bucket = 0;
+    for (uint32_t limit = 128; duration >= limit && bucket < I2C_DURATION_BUCKETS - 1; limit <<= 1) {
+        bucket++;
+    }
+    stats->durations[bucket]++;
+}
+
+void I2CBus::resetStats()
+{
+    mStats = {};
+    mNumDevices = 0;
+}
+
+void I2CBus::setFastMode(uint8_t muxPort, bool fast)
+{
+    if (muxPort >= NUM_MUX_PORTS) {
+        return;
+    }
+    if (fast) {
+        mFastPorts |= (1 << muxPort);
+    } else {
+        mFastPorts &= ~(1 << muxPort);
+    }
+}
+
+void I2CBus::setClock(uint8_t muxPort)
+{
+    uint32_t clock = portClock(muxPort);
+
+    if (I2CPort.clock() != clock) {
+        I2CPort.setClock(clock);
+        mStats.clockChanges++;
+    }
+}
+
+void I2CBus::selectNextTransaction()
+{
+    if (mMuxPort == I2C_NO_MUX_PORT || mBatchLength >= MAX_MUX_BATCH) {
+        // Run the oldest transaction so that other ports do not starve
+        return;
+    }
+
+    for (int i = 0; i < mCount; i++) {
+        uint8_t muxPort = mQueue[(mHead + i) % I2C_QUEUE_SIZE].muxPort;
+        if (muxPort != mMuxPort && muxPort != I2C_NO_MUX_PORT) {
+            continue;
+        }
+        if (i == 0) {
+            return;
+        }
+
+        // Move the transaction to the head, keeping the order of the others
+        I2CTransaction transaction = mQueue[(mHead + i) % I2C_QUEUE_SIZE];
+        for (int j = i; j > 0; j--) {
+            mQueue[(mHead + j) % I2C_QUEUE_SIZE] = mQueue[(mHead + j - 1) % I2C_QUEUE_SIZE];
+        }
+        mQueue[mHead] = transaction;
+
+        mStats.reordered++;
+        return;
+    }
+}
+
+void I2CBus::startTransaction()
+{
+    selectNextTransaction();
+
+    const I2CTransaction &transaction = mQueue[mHead];
+
+    mStats.transactions++;
+
+    // The multiplexer select runs with the clock of the selected port
+    setClock(transaction.muxPort);
+
+    if (transaction.muxPort == I2C_NO_MUX_PORT || transaction.muxPort == mMuxPort) {
+        if (transaction.muxPort != I2C_NO_MUX_PORT) {
+            mStats.muxSelectsSaved++;
+        }
+        mBatchLength++;
+        startTransfer();
+        return;
+    }
+
+    mStats.muxSelects++;
+    mBatchLength = 0;
+    mMuxPort = I2C_NO_MUX_PORT;
+
+    mMuxSelect = 1 << transaction.muxPort;
+    mPhase = BP_SELECT;
+    mStartTime = micros();
+    I2CPort.startWrite(I2C_MUX_ADDRESS, &mMuxSelect, 1);
+}
+
+void I2CBus::startTransfer()
+{
+    I2CTransaction &transaction = mQueue[mHead];
+
+    mPhase = BP_TRANSFER;
+    mStartTime = micros();
+    if (transaction.read) {
+        I2CPort.startRead(transaction.controller, transaction.data, transaction.length, transaction.countOffset);
+    } else {
+        I2CPort.startWrite(transaction.controller, transaction.data, transaction.length);
+    }
+}
+
+void I2CBus::completeTransaction(I2CStatus status)
+{
+    I2CTransaction &transaction = mQueue[mHead];
+
+    transaction.status = status;
+    if (transaction.read) {
+        transaction.length = I2CPort.received();
+    }
+    mPhase = BP_IDLE;
+
+    // The transaction is removed after the callback, so that transactions queued
+    // by the callback cannot overwrite it.
+    if (transaction.callback) {
+        transaction.callback(transaction.context, transaction);
+    }
+
+    mHead = (mHead + 1) % I2C_QUEUE_SIZE;
+    mCount--;
+}
+
+void I2CBus::begin()
+{
+    I2CPort.begin(I2C_STANDARD_CLOCK);
+}
+
+void I2CBus::loop()
+{
+    if (mPhase != BP_IDLE) {
+        if (I2CPort.busy()) {
+            if (micros() - mStartTime <= I2C_TRANSFER_TIMEOUT_US) {
+                return;
+            }
+            I2CPort.abort();
+        }
+
+        I2CTransaction &transaction = mQueue[mHead];
+        I2CStatus status = I2CPort.status();
+        uint32_t duration = micros() - mStartTime;
+
+        if (mPhase == BP_SELECT) {
+            recordTransfer(I2C_MUX_ADDRESS, I2C_NO_MUX_PORT, 1, 0, status, duration);
+
+            if (status == I2CStatus::IS_OK) {
+                mMuxPort = transaction.muxPort;
+                startTransfer();
+                return;
+            }
+        } else if (transaction.read) {
+            recordTransfer(transaction.controller, transaction.muxPort, 0, I2CPort.received(), status, duration);
+        } else {
+            recordTransfer(transaction.controller, transaction.muxPort, transaction.length, 0, status, duration);
+        }
+
+        if (status != I2CStatus::IS_OK) {
+            // Select the port again, in case the multiplexer has been reset
+            mMuxPort = I2C_NO_MUX_PORT;
+
+            if (fastMode(transaction.muxPort)) {
+                // Repeat the transfer with the standard clock
+                setFastMode(transaction.muxPort, false);
+                mStats.clockFallbacks++;
+            }
+
+            // The encoders remove the events of a status reply once they are addressed, so a
+            // repeated read would return the next events. Reads are only repeated if the address
+            // was not acknowledged; otherwise the IRQ line of the controller triggers a new read.
+            bool repeatable = mPhase == BP_SELECT || !transaction.read ||
+                              (status == I2CStatus::IS_NACK && I2CPort.received() == 0);
+
+            if (repeatable && transaction.retries < I2C_MAX_RETRIES) {
+                transaction.retries++;
+                mStats.retries++;
+
+                I2CDeviceStats *stats = deviceStats(transaction.controller, transaction.muxPort);
+                if (stats) {
+                    stats->retries++;
+                }
+
+                startTransaction();
+                return;
+            }
+        }
+
+        completeTransaction(status);
+    }
+
+    if (mCount > 0) {
+        startTransaction();
+    }
+}
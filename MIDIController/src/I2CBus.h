@@ -0,0 +1,219 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Queue of I2C transactions to the controllers behind the TCA9548 multiplexer.
+ * Transactions run in the background on the I2CMaster; loop() selects the multiplexer
+ * port, starts the next transaction and calls the completion callbacks.
+ * The selected multiplexer port is cached, and queued transactions for the selected port
+ * run before transactions that need a port switch.
+ * Each multiplexer port runs with its own clock: ports switched to fast mode fall back
+ * to the standard clock when a transfer on them fails.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+#include "I2CMaster.h"
+
+// Maximum number of bytes written or read by a transaction
+static const uint8_t MAX_I2C_DATA = 16;
+
+// Number of transactions in the queue
+static const uint8_t I2C_QUEUE_SIZE = 32;
+
+// Multiplexer port for devices that are not behind the multiplexer
+static const uint8_t I2C_NO_MUX_PORT = 0xFF;
+
+static const uint8_t NUM_MUX_PORTS = 8;
+
+// Maximum number of transactions that run on the selected multiplexer port
+// while older transactions for other ports are waiting
+static const uint8_t MAX_MUX_BATCH = 8;
+
+// Number of times a failed transaction is repeated before it completes with an error.
+// Reads are only repeated if the device did not acknowledge its address.
+static const uint8_t I2C_MAX_RETRIES = 2;
+
+// I2C address of the TCA9548 multiplexer
+static const uint8_t I2C_MUX_ADDRESS = 0x70;
+
+// Maximum number of devices with statistics, including the multiplexer
+static const uint8_t MAX_I2C_DEVICES = 12;
+
+// Transfer duration histogram buckets: <128us, <256us, ... <8192us, >=8192us
+static const uint8_t I2C_DURATION_BUCKETS = 8;
+
+struct I2CTransaction;
+
+using I2CCompletionCallback = void(*)(void *context, const I2CTransaction &transaction);
+
+struct I2CTransaction {
+    Controller  controller;
+    uint8_t     muxPort;
+    bool        read;
+    // Number of bytes to write or read; after a read the number of bytes received
+    uint8_t     length;
+    // Offset of the count byte of a counted read, or I2C_NO_COUNT
+    uint8_t     countOffset;
+    uint8_t     data[MAX_I2C_DATA];
+    I2CStatus   status;
+    uint8_t     retries;
+
+    I2CCompletionCallback callback;
+    void       *context;
+};
+
+struct I2CBusStats {
+    uint32_t transactions;
+    // Multiplexer port switches
+    uint32_t muxSelects;
+    // Transactions that used the selected multiplexer port without a switch
+    uint32_t muxSelectsSaved;
+    // Transactions that were moved ahead of older transactions for other ports
+    uint32_t reordered;
+    // Failed transactions that were repeated
+    uint32_t retries;
+    // Changes of the SCL clock between ports
+    uint32_t clockChanges;
+    // Ports switched back to the standard clock after a failed transfer
+    uint32_t clockFallbacks;
+};
+
+/**
+ * Transfer statistics of a device on a multiplexer port.
+ */
+struct I2CDeviceStats {
+    uint8_t  address;
+    uint8_t  muxPort;
+    uint32_t transfers;
+    uint32_t bytesWritten;
+    uint32_t bytesRead;
+    uint32_t nacks;
+    uint32_t timeouts;
+    uint32_t errors;
+    uint32_t retries;
+    uint32_t durations[I2C_DURATION_BUCKETS];
+};
+
+class I2CBus
+{
+    private:
+        enum BusPhase : uint8_t {
+            BP_IDLE,
+            BP_SELECT,
+            BP_TRANSFER
+        };
+
+        I2CTransaction mQueue[I2C_QUEUE_SIZE];
+
+        uint8_t mHead = 0;
+        uint8_t mCount = 0;
+
+        BusPhase mPhase = BP_IDLE;
+
+        uint32_t mStartTime = 0;
+
+        // Write buffer of the multiplexer select
+        uint8_t mMuxSelect = 0;
+
+        // Currently selected multiplexer port, I2C_NO_MUX_PORT if unknown
+        uint8_t mMuxPort = I2C_NO_MUX_PORT;
+
+        // Number of transactions run since the last port switch
+        uint8_t mBatchLength = 0;
+
+        // One bit per multiplexer port that runs with the fast mode clock
+        uint8_t mFastPorts = 0;
+
+        I2CBusStats mStats = {};
+
+        I2CDeviceStats mDeviceStats[MAX_I2C_DEVICES];
+        uint8_t mNumDevices = 0;
+
+        /**
+         * Get the statistics of a device, or nullptr if there are too many devices.
+         */
+        I2CDeviceStats *deviceStats(uint8_t address, uint8_t muxPort);
+
+        void recordTransfer(uint8_t address, uint8_t muxPort, uint8_t bytesWritten, uint8_t bytesRead,
+                            I2CStatus status, uint32_t duration);
+
+        I2CTransaction *enqueue(Controller controller, uint8_t muxPort, bool read, uint8_t length,
+                                I2CCompletionCallback callback, void *context);
+
+        /**
+         * Move the oldest transaction that needs no port switch to the head of the queue.
+         */
+        void selectNextTransaction();
+
+        /**
+         * Set the clock of the port of a transaction, if it differs from the current clock.
+         */
+        void setClock(uint8_t muxPort);
+
+        void startTransaction();
+
+        void startTransfer();
+
+        void completeTransaction(I2CStatus status);
+
+    public:
+        I2CBus() {}
+
+        /**
+         * Queue a write of a command and its data.
+         * \return false if the queue is full or the data is too long.
+         */
+        bool write(Controller controller, uint8_t muxPort, uint8_t command, const uint8_t *data, uint8_t length,
+                   I2CCompletionCallback callback = nullptr, void *context = nullptr);
+
+        /**
+         * Queue a read. The callback gets the received data.
+         * \param length Number of bytes to read, or the maximum length of a counted read.
+         * \param countOffset Offset of the count byte of a counted read, see I2CMaster::startRead.
+         * \return false if the queue is full or the length is too long.
+         */
+        bool read(Controller controller, uint8_t muxPort, uint8_t length,
+                  I2CCompletionCallback callback, void *context, uint8_t countOffset = I2C_NO_COUNT);
+
+        /**
+         * Check if a read or write to the controller is queued or running.
+         */
+        bool isQueued(Controller controller, bool read) const;
+
+        bool idle() const { return mCount == 0; }
+
+        uint8_t queued() const { return mCount; }
+
+        const I2CBusStats &stats() const { return mStats; }
+
+        uint8_t numDevices() const { return mNumDevices; }
+
+        /**
+         * Get the statistics of a device, 0..numDevices()-1, in order of first use.
+         */
+        const I2CDeviceStats &device(uint8_t index) const { return mDeviceStats[index]; }
+
+        void resetStats();
+
+        /**
+         * Run the transfers of a multiplexer port with the fast mode or the standard clock.
+         * The multiplexer and the devices that are not behind it must support fast mode.
+         */
+        void setFastMode(uint8_t muxPort, bool fast);
+
+        bool fastMode(uint8_t muxPort) const { return muxPort < NUM_MUX_PORTS && (mFastPorts & (1 << muxPort)); }
+
+        uint32_t portClock(uint8_t muxPort) const { return fastMode(muxPort) ? I2C_FAST_CLOCK : I2C_STANDARD_CLOCK; }
+
+        void begin();
+
+        void loop();
+};
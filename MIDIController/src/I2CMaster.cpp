@@ -0,0 +1,225 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Interrupt driven I2C master using the LPI2C1 controller of the Wire port
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "I2CMaster.h"
+
+#include <Arduino.h>
+#include <Wire.h>
+
+#include <inttypes.h>
+
+// Size of the LPI2C command and receive FIFOs
+static const uint8_t LPI2C_FIFO_SIZE = 4;
+
+static const uint32_t LPI2C_ERROR_FLAGS = LPI2C_MSR_NDF | LPI2C_MSR_ALF | LPI2C_MSR_FEF | LPI2C_MSR_PLTF;
+
+I2CMaster I2CPort;
+
+static void lpi2c1ISR()
+{
+    I2CPort.isr();
+}
+
+void I2CMaster::begin(uint32_t clock)
+{
+    // Wire sets up the pins and clocks of the controller
+    Wire.begin();
+    Wire.setClock(clock);
+    mClock = clock;
+
+    attachInterruptVector(IRQ_LPI2C1, lpi2c1ISR);
+    NVIC_ENABLE_IRQ(IRQ_LPI2C1);
+}
+
+void I2CMaster::setClock(uint32_t clock)
+{
+    waitTransfer();
+    Wire.setClock(clock);
+    mClock = clock;
+}
+
+uint8_t I2CMaster::numTxWords() const
+{
+    if (!mRead) {
+        return mLength + 2;
+    }
+    if (mCountOffset == I2C_NO_COUNT) {
+        return 3;
+    }
+    if (!mCountReceived) {
+        // No stop until the count is known
+        return 2;
+    }
+    return (mLength > mCountOffset + 1) ? 4 : 3;
+}
+
+uint32_t I2CMaster::txWord(uint8_t index) const
+{
+    if (index == 0) {
+        return LPI2C_MTDR_CMD_START | (mAddress << 1) | (mRead ? 1 : 0);
+    }
+    if (!mRead) {
+        return index <= mLength ? (LPI2C_MTDR_CMD_TRANSMIT | mData[index - 1]) : LPI2C_MTDR_CMD_STOP;
+    }
+    if (mCountOffset == I2C_NO_COUNT) {
+        return index == 1 ? (LPI2C_MTDR_CMD_RECEIVE | (mLength - 1)) : LPI2C_MTDR_CMD_STOP;
+    }
+    if (index == 1) {
+        // Read up to and including the count byte
+        return LPI2C_MTDR_CMD_RECEIVE | mCountOffset;
+    }
+    if (index == 2 && mLength > mCountOffset + 1) {
+        return LPI2C_MTDR_CMD_RECEIVE | (mLength - mCountOffset - 2);
+    }
+    return LPI2C_MTDR_CMD_STOP;
+}
+
+bool I2CMaster::fillTxFIFO()
+{
+    uint8_t numWords = numTxWords();
+
+    while (mTxWords < numWords && (LPI2C1_MFSR & 0x07) < LPI2C_FIFO_SIZE) {
+        LPI2C1_MTDR = txWord(mTxWords);
+        mTxWords++;
+    }
+
+    return mTxWords < numWords;
+}
+
+void I2CMaster::startTransfer()
+{
+    mTxWords = 0;
+    mRxBytes = 0;
+    mCountReceived = false;
+    mStatus = I2CStatus::IS_OK;
+    mBusy = true;
+
+    LPI2C1_MCR |= LPI2C_MCR_RTF | LPI2C_MCR_RRF;
+    LPI2C1_MSR = LPI2C_ERROR_FLAGS | LPI2C_MSR_SDF | LPI2C_MSR_EPF;
+    LPI2C1_MFCR = LPI2C_MFCR_TXWATER(1) | LPI2C_MFCR_RXWATER(0);
+
+    uint32_t irqs = LPI2C_MIER_NDIE | LPI2C_MIER_ALIE | LPI2C_MIER_FEIE | LPI2C_MIER_PLTIE | LPI2C_MIER_SDIE;
+    if (mRead) {
+        irqs |= LPI2C_MIER_RDIE;
+    }
+    if (fillTxFIFO()) {
+        // Refill the FIFO from the interrupt handler
+        irqs |= LPI2C_MIER_TDIE;
+    }
+    LPI2C1_MIER = irqs;
+}
+
+void I2CMaster::finishTransfer(I2CStatus status)
+{
+    LPI2C1_MIER = 0;
+
+    if (status != I2CStatus::IS_OK) {
+        // Drop the remaining commands and release the bus
+        LPI2C1_MCR |= LPI2C_MCR_RTF | LPI2C_MCR_RRF;
+        if (LPI2C1_MSR & LPI2C_MSR_MBF) {
+            LPI2C1_MTDR = LPI2C_MTDR_CMD_STOP;
+        }
+    }
+    LPI2C1_MSR = LPI2C_ERROR_FLAGS | LPI2C_MSR_SDF | LPI2C_MSR_EPF;
+
+    mStatus = status;
+    mBusy = false;
+}
+
+void I2CMaster::startWrite(uint8_t address, const uint8_t *data, uint8_t length)
+{
+    mAddress = address;
+    mData = data;
+    mLength = length;
+    mRead = false;
+    mCountOffset = I2C_NO_COUNT;
+
+    startTransfer();
+}
+
+void I2CMaster::startRead(uint8_t address, uint8_t *buffer, uint8_t length, uint8_t countOffset)
+{
+    mAddress = address;
+    mBuffer = buffer;
+    mLength = length;
+    mRead = true;
+    mCountOffset = (countOffset < length) ? countOffset : I2C_NO_COUNT;
+
+    startTransfer();
+}
+
+void I2CMaster::abort()
+{
+    __disable_irq();
+    if (mBusy) {
+        finishTransfer(I2CStatus::IS_TIMEOUT);
+    }
+    __enable_irq();
+}
+
+void I2CMaster::waitTransfer()
+{
+    uint32_t start = micros();
+
+    while (mBusy) {
+        if (micros() - start > I2C_TRANSFER_TIMEOUT_US) {
+            abort();
+        }
+    }
+}
+
+void I2CMaster::waitIdle()
+{
+    waitTransfer();
+    mClock = 0;
+}
+
+void I2CMaster::isr()
+{
+    uint32_t status = LPI2C1_MSR;
+
+    if (status & LPI2C_ERROR_FLAGS) {
+        finishTransfer((status & LPI2C_MSR_NDF) ? I2CStatus::IS_NACK : I2CStatus::IS_ERROR);
+        return;
+    }
+
+    if (mRead) {
+        while (mRxBytes < mLength) {
+            uint32_t data = LPI2C1_MRDR;
+            if (data & LPI2C_MRDR_RXEMPTY) {
+                break;
+            }
+            mBuffer[mRxBytes] = data & 0xFF;
+            mRxBytes++;
+        }
+
+        if (mCountOffset != I2C_NO_COUNT && !mCountReceived && mRxBytes > mCountOffset) {
+            uint8_t count = mBuffer[mCountOffset];
+            if (count > mLength - mCountOffset - 1) {
+                count = mLength - mCountOffset - 1;
+            }
+            mLength = mCountOffset + 1 + count;
+            mCountReceived = true;
+
+            // Continue with the remaining bytes and the stop
+            if (fillTxFIFO()) {
+                LPI2C1_MIER |= LPI2C_MIER_TDIE;
+            }
+        }
+    }
+
+    if ((status & LPI2C_MSR_TDF) && !fillTxFIFO()) {
+        LPI2C1_MIER &= ~LPI2C_MIER_TDIE;
+    }
+
+    if (status & LPI2C_MSR_SDF) {
+        finishTransfer(I2CStatus::IS_OK);
+    }
+}
@@ -0,0 +1,124 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Interrupt driven I2C master on the Wire port.
+ * A transfer is started by the main loop and runs in the background; the main loop
+ * polls busy() for completion. The Wire library can still be used on the same port
+ * (e.g. by the audio codec), but only after waitIdle().
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+// Maximum duration of a transfer including clock stretching by the encoders
+static const uint32_t I2C_TRANSFER_TIMEOUT_US = 20000;
+
+// Count offset of reads without a count byte
+static const uint8_t I2C_NO_COUNT = 0xFF;
+
+enum I2CStatus : uint8_t {
+    IS_OK      = 0,
+    IS_NACK    = 1,  // address or data not acknowledged
+    IS_ERROR   = 2,  // arbitration lost, pin low timeout or FIFO error
+    IS_TIMEOUT = 3   // transfer did not complete in time and was aborted
+};
+
+class I2CMaster
+{
+    private:
+        // Transfer state, updated by the interrupt handler
+        const uint8_t *mData = nullptr;
+        uint8_t *mBuffer = nullptr;
+        uint8_t  mLength = 0;
+        uint8_t  mAddress = 0;
+        bool     mRead = false;
+
+        // Offset of the count byte of a counted read, I2C_NO_COUNT for fixed length reads
+        uint8_t  mCountOffset = I2C_NO_COUNT;
+        volatile bool mCountReceived = false;
+
+        // Number of command words written to the TX FIFO and bytes read from the RX FIFO
+        volatile uint8_t mTxWords = 0;
+        volatile uint8_t mRxBytes = 0;
+
+        volatile bool      mBusy = false;
+        volatile I2CStatus mStatus = I2CStatus::IS_OK;
+
+        // Clock set by setClock(), 0 if Wire may have changed it
+        uint32_t mClock = 0;
+
+        uint8_t numTxWords() const;
+
+        uint32_t txWord(uint8_t index) const;
+
+        /**
+         * Write command words until the TX FIFO is full.
+         * \return true if there are command words left.
+         */
+        bool fillTxFIFO();
+
+        void startTransfer();
+
+        void finishTransfer(I2CStatus status);
+
+        void waitTransfer();
+
+    public:
+        I2CMaster() {}
+
+        void begin(uint32_t clock);
+
+        void setClock(uint32_t clock);
+
+        /**
+         * SCL clock of the next transfer, or 0 if unknown.
+         */
+        uint32_t clock() const { return mClock; }
+
+        /**
+         * Start writing data to a device. The data must stay valid until the transfer completes.
+         */
+        void startWrite(uint8_t address, const uint8_t *data, uint8_t length);
+
+        /**
+         * Start reading from a device into the buffer.
+         *
+         * If a count offset is given, only the bytes up to the count byte are read first;
+         * the master holds the bus until the count byte is received and then reads
+         * as many more bytes as the count says, at most up to length.
+         */
+        void startRead(uint8_t address, uint8_t *buffer, uint8_t length, uint8_t countOffset = I2C_NO_COUNT);
+
+        /**
+         * Stop the current transfer, e.g. on a timeout.
+         */
+        void abort();
+
+        bool busy() const { return mBusy; }
+
+        /**
+         * Result of the last transfer.
+         */
+        I2CStatus status() const { return mStatus; }
+
+        /**
+         * Number of bytes received by the last read.
+         */
+        uint8_t received() const { return mRxBytes; }
+
+        /**
+         * Wait for the current transfer to complete before the port is used with Wire.
+         * Transfers that do not complete in time are aborted. Since Wire may reset the
+         * clock, the clock must be set again before the next transfer.
+         */
+        void waitIdle();
+
+        void isr();
+};
+
+extern I2CMaster I2CPort;
@@ -19,6 +19,7 @@
 #include <common_config.h>
 
 #include "CouplerProcessor.h"
+#include "Profiler.h"
 
 // MIDI Devices
 MIDI_CREATE_INSTANCE(HardwareSerial, Serial7,    MIDI1);
@@ -417,6 +418,8 @@ void MIDIRouter::begin()
 
 void MIDIRouter::loop()
 {
+    ProfileScope scope(ProfileSection::PS_MIDI_ROUTER);
+
     // Empty all MIDI input queues
     while (MIDI1.read()) {}
     while (MIDI2.read()) {}
@@ -62,6 +62,16 @@ void OrganStateManager::begin()
 {
 }
 
+void OrganStateManager::updatePistonLEDs()
+{
+    // Only changed LEDs are sent by the driver
+    mControl.setPistonLEDs(MIDIDivision::MD_Choir, mCoupler.pistonLEDs(MIDIDivision::MD_Choir));
+    mControl.setPistonLEDs(MIDIDivision::MD_Pedal, mCoupler.pistonLEDs(MIDIDivision::MD_Pedal));
+    mControl.setPistonLEDs(MIDIDivision::MD_Swell, mCoupler.pistonLEDs(MIDIDivision::MD_Swell));
+    mControl.setPistonLEDs(MIDIDivision::MD_Solo,  mCoupler.pistonLEDs(MIDIDivision::MD_Solo));
+}
+
 void OrganStateManager::loop()
 {
+    updatePistonLEDs();
 }
\ No newline at end of file
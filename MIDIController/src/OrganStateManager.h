@@ -29,6 +29,11 @@ class OrganStateManager
 
         midi::Channel mDivisionChannels[MAX_DIVISION_CHANNEL + 1];
 
+        /**
+         * Show the coupler and combination state on the piston LEDs.
+         */
+        void updatePistonLEDs();
+
     public:
         explicit OrganStateManager(MIDIRouter &router, CouplerProcessor &coupler, ControllerDriver &driver);
 
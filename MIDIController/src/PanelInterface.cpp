@@ -16,6 +16,8 @@
 #include <common_config.h>
 #include <panel_commands.h>
 
+#include "Profiler.h"
+
 PanelInterface::PanelInterface(OrganStateManager &stateManager, CouplerProcessor &coupler,
                                MIDIRouter &router, AudioProcessor &audio)
 : mStateManager(stateManager), mCoupler(coupler), mRouter(router), mAudio(audio)
@@ -165,6 +167,8 @@ void PanelInterface::begin()
 
 void PanelInterface::loop()
 {
+    ProfileScope scope(ProfileSection::PS_PANEL);
+
     while (Serial6.available()) {
         uint8_t data = Serial6.read();
         processSerialData(data);
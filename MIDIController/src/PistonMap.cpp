@@ -0,0 +1,244 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Piston map implementation and default piston mapping
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "PistonMap.h"
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+#include "CombinationMemory.h"
+
+// EEPROM layout: magic, version, followed by division, type and param of every piston
+static const int PISTON_EEPROM_ADDRESS = 0;
+static const uint8_t PISTON_EEPROM_MAGIC = 0xB5;
+static const uint8_t PISTON_EEPROM_VERSION = 1;
+
+static constexpr PistonTable makeDefaultPistonTable()
+{
+    PistonTable table = {};
+
+
+    table.commands[MD_Control][2]  = {.division = MD_Control, .type = PCT_SOUNDOFF, .param = BT_ALL};        // Top row, right (right to left)
+    table.commands[MD_Control][3]  = {.division = MD_Control, .type = PCT_SEQUENCE, .param = BT_NEXT};
+    table.commands[MD_Control][4]  = {.division = MD_Control, .type = PCT_SEQUENCE, .param = BT_PREV};
+    table.commands[MD_Control][5]  = {.division = MD_Pedal,   .type = PCT_COMBINATION, .param = 4}; // Bottom row, right (right to left)
+    table.commands[MD_Control][6]  = {.division = MD_Pedal,   .type = PCT_COMBINATION, .param = 3};
+    table.commands[MD_Control][7]  = {.division = MD_Pedal,   .type = PCT_COMBINATION, .param = 2};
+    table.commands[MD_Control][8]  = {.division = MD_Pedal,   .type = PCT_COMBINATION, .param = 1};
+    table.commands[MD_Control][9]  = {.division = MD_Control, .type = PCT_PAGE, .param = BT_NEXT};
+    table.commands[MD_Control][11] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 5}; // Top row, left
+    table.commands[MD_Control][12] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 6};
+    table.commands[MD_Control][13] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 7};
+    table.commands[MD_Control][14] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 8};
+    table.commands[MD_Control][15] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 1}; // Bottom row, left
+    table.commands[MD_Control][16] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 2};
+    table.commands[MD_Control][17] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 3};
+    table.commands[MD_Control][18] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 4};
+    table.commands[MD_Control][19] = {.division = MD_Control, .type = PCT_PAGE, .param = BT_PREV};
+
+    table.commands[MD_Pedal][0]  = {.division = MD_Pedal, .type = PCT_CRESCENDO, .param = 0};
+    table.commands[MD_Pedal][1]  = {.division = MD_Pedal, .type = PCT_CLEAR,     .param = 0};
+    table.commands[MD_Pedal][2]  = {.division = MD_Pedal, .type = PCT_COMBINATION, .param = 5};
+    table.commands[MD_Pedal][3]  = {.division = MD_Pedal, .type = PCT_COMBINATION, .param = 4};
+    table.commands[MD_Pedal][4]  = {.division = MD_Pedal, .type = PCT_COMBINATION, .param = 3};
+    table.commands[MD_Pedal][5]  = {.division = MD_Pedal, .type = PCT_COMBINATION, .param = 2};
+    table.commands[MD_Pedal][6]  = {.division = MD_Pedal, .type = PCT_COMBINATION, .param = 1};
+    table.commands[MD_Pedal][7]  = {.division = MD_Pedal, .type = PCT_OFF,       .param = 0};
+    table.commands[MD_Pedal][8]  = {.division = MD_Pedal, .type = PCT_TRANSPOSE, .param = BT_TOGGLE};
+    table.commands[MD_Pedal][9]  = {.division = MD_Pedal, .type = PCT_COUPLER, .param = MIDIDivision::MD_Choir};
+    table.commands[MD_Pedal][10] = {.division = MD_Pedal, .type = PCT_COUPLER, .param = MIDIDivision::MD_Great};
+    table.commands[MD_Pedal][11] = {.division = MD_Pedal, .type = PCT_COUPLER, .param = MIDIDivision::MD_Swell};
+    table.commands[MD_Pedal][17] = {.division = MD_Pedal, .type = PCT_COUPLER, .param = MIDIDivision::MD_Solo};
+
+    table.commands[MD_Choir][0]  = {.division = MD_Choir, .type = PCT_CRESCENDO, .param = 0};
+    table.commands[MD_Choir][1]  = {.division = MD_Choir, .type = PCT_CLEAR,     .param = 0};
+    table.commands[MD_Choir][2]  = {.division = MD_Choir, .type = PCT_COMBINATION, .param = 5};
+    table.commands[MD_Choir][3]  = {.division = MD_Choir, .type = PCT_COMBINATION, .param = 4};
+    table.commands[MD_Choir][4]  = {.division = MD_Choir, .type = PCT_COMBINATION, .param = 3};
+    table.commands[MD_Choir][5]  = {.division = MD_Choir, .type = PCT_COMBINATION, .param = 2};
+    table.commands[MD_Choir][6]  = {.division = MD_Choir, .type = PCT_COMBINATION, .param = 1};
+    table.commands[MD_Choir][7]  = {.division = MD_Choir, .type = PCT_OFF,       .param = 0};
+    table.commands[MD_Choir][8]  = {.division = MD_Choir, .type = PCT_TRANSPOSE, .param = BT_TOGGLE};
+    table.commands[MD_Choir][9]  = {.division = MD_Choir, .type = PCT_COUPLER, .param = MIDIDivision::MD_Great};
+    table.commands[MD_Choir][10] = {.division = MD_Choir, .type = PCT_COUPLER, .param = MIDIDivision::MD_Swell};
+    table.commands[MD_Choir][11] = {.division = MD_Choir, .type = PCT_COUPLER, .param = MIDIDivision::MD_Solo};
+
+    table.commands[MD_Swell][0]  = {.division = MD_Swell, .type = PCT_CRESCENDO, .param = 0};
+    table.commands[MD_Swell][1]  = {.division = MD_Swell, .type = PCT_CLEAR,     .param = 0};
+    table.commands[MD_Swell][2]  = {.division = MD_Swell, .type = PCT_COMBINATION, .param = 5};
+    table.commands[MD_Swell][3]  = {.division = MD_Swell, .type = PCT_COMBINATION, .param = 4};
+    table.commands[MD_Swell][4]  = {.division = MD_Swell, .type = PCT_COMBINATION, .param = 3};
+    table.commands[MD_Swell][5]  = {.division = MD_Swell, .type = PCT_COMBINATION, .param = 2};
+    table.commands[MD_Swell][6]  = {.division = MD_Swell, .type = PCT_COMBINATION, .param = 1};
+    table.commands[MD_Swell][7]  = {.division = MD_Swell, .type = PCT_OFF,       .param = 0};
+    table.commands[MD_Swell][8]  = {.division = MD_Swell, .type = PCT_TRANSPOSE, .param = BT_TOGGLE};
+    table.commands[MD_Swell][9]  = {.division = MD_Swell, .type = PCT_COUPLER, .param = MIDIDivision::MD_Pedal};
+    table.commands[MD_Swell][10] = {.division = MD_Swell, .type = PCT_COUPLER, .param = MIDIDivision::MD_Great};
+    table.commands[MD_Swell][11] = {.division = MD_Swell, .type = PCT_COUPLER, .param = MIDIDivision::MD_Solo};
+
+    table.commands[MD_Swell][12] = {.division = MD_Control, .type = PCT_PAGE, .param = BT_NEXT};
+    table.commands[MD_Swell][13] = {.division = MD_Control, .type = PCT_PAGE, .param = BT_PREV};
+    table.commands[MD_Swell][14] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 12};
+    table.commands[MD_Swell][15] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 11};
+    table.commands[MD_Swell][16] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 10};
+    table.commands[MD_Swell][17] = {.division = MD_Control, .type = PCT_COMBINATION, .param =  9};
+    table.commands[MD_Swell][18] = {.division = MD_Control, .type = PCT_CLEAR, .param = 0};
+    table.commands[MD_Swell][19] = {.division = MD_Control, .type = PCT_HOLD,  .param = 0};
+    table.commands[MD_Swell][20] = {.division = MD_Control, .type = PCT_SET,   .param = 0};
+
+    table.commands[MD_Solo][0]  = {.division = MD_Solo, .type = PCT_CRESCENDO, .param = 0};
+    table.commands[MD_Solo][1]  = {.division = MD_Solo, .type = PCT_CLEAR,     .param = 0};
+    table.commands[MD_Solo][2]  = {.division = MD_Solo, .type = PCT_COMBINATION, .param = 5};
+    table.commands[MD_Solo][3]  = {.division = MD_Solo, .type = PCT_COMBINATION, .param = 4};
+    table.commands[MD_Solo][4]  = {.division = MD_Solo, .type = PCT_COMBINATION, .param = 3};
+    table.commands[MD_Solo][5]  = {.division = MD_Solo, .type = PCT_COMBINATION, .param = 2};
+    table.commands[MD_Solo][6]  = {.division = MD_Solo, .type = PCT_COMBINATION, .param = 1};
+    table.commands[MD_Solo][7]  = {.division = MD_Solo, .type = PCT_OFF,       .param = 0};
+    table.commands[MD_Solo][8]  = {.division = MD_Solo, .type = PCT_TRANSPOSE, .param = BT_TOGGLE};
+    table.commands[MD_Solo][9]  = {.division = MD_Solo, .type = PCT_COUPLER, .param = MIDIDivision::MD_Choir};
+    table.commands[MD_Solo][10] = {.division = MD_Solo, .type = PCT_COUPLER, .param = MIDIDivision::MD_Great};
+    table.commands[MD_Solo][11] = {.division = MD_Solo, .type = PCT_COUPLER, .param = MIDIDivision::MD_Swell};
+
+    table.commands[MD_Solo][12] = {.division = MD_Control, .type = PCT_SEQUENCE, .param = BT_NEXT};
+    table.commands[MD_Solo][13] = {.division = MD_Control, .type = PCT_SEQUENCE, .param = BT_PREV};
+    table.commands[MD_Solo][14] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 8};
+    table.commands[MD_Solo][15] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 7};
+    table.commands[MD_Solo][16] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 6};
+    table.commands[MD_Solo][17] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 5};
+    table.commands[MD_Solo][18] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 4};
+    table.commands[MD_Solo][19] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 3};
+    table.commands[MD_Solo][20] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 2};
+    table.commands[MD_Solo][21] = {.division = MD_Control, .type = PCT_COMBINATION, .param = 1};
+    return table;
+}
+
+const PistonTable DEFAULT_PISTON_TABLE PROGMEM = makeDefaultPistonTable();
+
+PistonMap::PistonMap()
+: mActive(&DEFAULT_PISTON_TABLE)
+{
+}
+
+PistonTable &PistonMap::inactiveTable()
+{
+    return (mActive == &mTables[0]) ? mTables[1] : mTables[0];
+}
+
+void PistonMap::activate(const PistonTable &table)
+{
+    // Single pointer store, lookups see either the old or the new table
+    mActive = &table;
+}
+
+bool PistonMap::validCommand(const PistonCommand &cmd)
+{
+    if (cmd.division > MAX_DIVISION_CHANNEL || cmd.type >= NUM_PISTON_COMMAND_TYPES) {
+        return false;
+    }
+    switch (cmd.type) {
+        case PCT_COUPLER:
+        case PCT_MELODY:
+        case PCT_BASS:
+        case PCT_TRANSFER:
+            return cmd.param.division <= MAX_DIVISION_CHANNEL;
+        case PCT_COMBINATION:
+            return CombinationMemory::validCombination(cmd.param.value);
+        default:
+            return true;
+    }
+}
+
+bool PistonMap::setCommand(MIDIDivision division, uint8_t button, const PistonCommand &cmd)
+{
+    if (division > MAX_DIVISION_CHANNEL || button >= MAX_PISTONS || !validCommand(cmd)) {
+        return false;
+    }
+
+    PistonTable &table = inactiveTable();
+    table = *mActive;
+    table.commands[division][button] = cmd;
+    activate(table);
+
+    return true;
+}
+
+bool PistonMap::load(const PistonTable &table)
+{
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        for (int j = 0; j < MAX_PISTONS; j++) {
+            if (!validCommand(table.commands[i][j])) {
+                return false;
+            }
+        }
+    }
+
+    PistonTable &newTable = inactiveTable();
+    newTable = table;
+    activate(newTable);
+
+    return true;
+}
+
+void PistonMap::reset()
+{
+    activate(DEFAULT_PISTON_TABLE);
+}
+
+bool PistonMap::loadEEPROM()
+{
+    int addr = PISTON_EEPROM_ADDRESS;
+
+    if (EEPROM.read(addr++) != PISTON_EEPROM_MAGIC || EEPROM.read(addr++) != PISTON_EEPROM_VERSION) {
+        return false;
+    }
+
+    // Read directly into the inactive table, it is only swapped in if it is valid
+    PistonTable &table = inactiveTable();
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        for (int j = 0; j < MAX_PISTONS; j++) {
+            PistonCommand &cmd = table.commands[i][j];
+            cmd.division    = (MIDIDivision) EEPROM.read(addr++);
+            cmd.type        = (PistonCommandType) EEPROM.read(addr++);
+            cmd.param.value = EEPROM.read(addr++);
+            if (!validCommand(cmd)) {
+                return false;
+            }
+        }
+    }
+
+    activate(table);
+    return true;
+}
+
+void PistonMap::saveEEPROM()
+{
+    int addr = PISTON_EEPROM_ADDRESS;
+
+    EEPROM.update(addr++, PISTON_EEPROM_MAGIC);
+    EEPROM.update(addr++, PISTON_EEPROM_VERSION);
+
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        for (int j = 0; j < MAX_PISTONS; j++) {
+            const PistonCommand &cmd = mActive->commands[i][j];
+            EEPROM.update(addr++, cmd.division);
+            EEPROM.update(addr++, cmd.type);
+            EEPROM.update(addr++, cmd.param.value);
+        }
+    }
+}
+
+void PistonMap::clearEEPROM()
+{
+    EEPROM.update(PISTON_EEPROM_ADDRESS, 0xFF);
+}
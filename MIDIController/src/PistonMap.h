@@ -0,0 +1,130 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Mapping of piston buttons to piston commands.
+ * The default mapping is a constant table in flash; a modified mapping is kept in RAM
+ * and swapped in with a single pointer update, so it can be changed without a reboot.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+enum ButtonType : uint8_t {
+    BT_NONE = 0,
+    BT_NEXT = 4,
+    BT_PREV = 5,
+    BT_TOGGLE = 6,
+    BT_ALL = 7
+};
+
+union PistonParameter {
+    uint8_t      value;
+    MIDIDivision division;
+    ButtonType   button;
+};
+
+enum PistonCommandType : uint8_t {
+    PCT_NONE,         // Not a valid input or no action defined
+    PCT_COUPLER,      // coupler piston; Param.division: division to couple to
+    PCT_TRANSPOSE,    // transpose piston; Param.type: TOGGLE
+    PCT_OFF,          // turn division unison off; couplers from the division keep playing
+    PCT_COMBINATION,  // select preset; Param.value: number of preset
+    PCT_CLEAR,        // clear combination
+    PCT_CRESCENDO,    // crescendo coupler
+    PCT_PAGE,         // Page turn; Param.type: PREV, NEXT
+    PCT_SEQUENCE,     // Sequencer; Param.type: PREV, NEXT
+    PCT_SET,          // Set combination
+    PCT_HOLD,         // Hold current combination
+    PCT_SOUNDOFF,     // Send AllSoundOff; Param.value: ALL = all divisions, else param.division
+    PCT_MELODY,       // melody coupler; Param.division: division to play the highest key on
+    PCT_BASS,         // bass coupler; Param.division: division to play the lowest key on
+    PCT_TRANSFER,     // swap manuals; Param.division: division to swap with
+    PCT_LATCH,        // latch currently pressed keys of the division until turned off
+    PCT_RESTORE       // restore the couplers from before the last reset
+};
+
+static const int NUM_PISTON_COMMAND_TYPES = PCT_RESTORE + 1;
+
+/**
+ * Piston command, three bytes.
+ */
+struct PistonCommand {
+    MIDIDivision        division;
+    PistonCommandType   type;
+    PistonParameter     param;
+};
+
+/**
+ * Piston commands of all buttons, indexed by the division and button number of the piston press.
+ */
+struct PistonTable {
+    PistonCommand commands[MAX_DIVISION_CHANNEL + 1][MAX_PISTONS];
+};
+
+extern const PistonTable DEFAULT_PISTON_TABLE;
+
+class PistonMap
+{
+    private:
+        // Currently used table, either DEFAULT_PISTON_TABLE or one of mTables
+        const PistonTable * volatile mActive;
+
+        // RAM copies of modified mappings; the inactive one is written before it is swapped in
+        PistonTable mTables[2];
+
+        PistonTable &inactiveTable();
+
+        void activate(const PistonTable &table);
+
+    public:
+        PistonMap();
+
+        static bool validCommand(const PistonCommand &cmd);
+
+        /**
+         * Get the command of a piston. The button must be less than MAX_PISTONS.
+         */
+        const PistonCommand &command(MIDIDivision division, uint8_t button) const { return mActive->commands[division][button]; }
+
+        /**
+         * Change the command of a single piston.
+         * Returns false if the command is not valid.
+         */
+        bool setCommand(MIDIDivision division, uint8_t button, const PistonCommand &cmd);
+
+        /**
+         * Replace the whole mapping with the given table.
+         * Returns false and keeps the current mapping if any command is invalid.
+         */
+        bool load(const PistonTable &table);
+
+        /**
+         * Switch back to the default mapping in flash.
+         */
+        void reset();
+
+        bool isDefault() const { return mActive == &DEFAULT_PISTON_TABLE; }
+
+        /**
+         * Load the mapping stored in EEPROM.
+         * Returns false and keeps the current mapping if no valid mapping is stored.
+         */
+        bool loadEEPROM();
+
+        /**
+         * Store the current mapping in EEPROM.
+         */
+        void saveEEPROM();
+
+        /**
+         * Invalidate the mapping in EEPROM, so that the default mapping is used after a reboot.
+         */
+        void clearEEPROM();
+};
@@ -0,0 +1,83 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Run time profiler implementation
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "Profiler.h"
+
+#include <Arduino.h>
+
+#include <inttypes.h>
+
+static const char* SECTION_NAMES[NUM_PROFILE_SECTIONS] = { "router", "coupler", "i2c", "panel", "cmdline" };
+
+Profiler Profile;
+
+uint32_t Profiler::percentile(ProfileSection section, uint8_t percent) const
+{
+    const ProfileStats &stats = mStats[section];
+
+    // Number of durations that are at or below the percentile, rounded up
+    uint64_t limit = ((uint64_t)stats.count * percent + 99) / 100;
+    uint64_t count = 0;
+
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        count += stats.buckets[i];
+        if (count >= limit && count > 0) {
+            uint32_t upper = i == PROFILE_BUCKETS - 1 ? 0xFFFFFFFF : (2u << i) - 1;
+            return upper < stats.maxTicks ? upper : stats.maxTicks;
+        }
+    }
+    return stats.maxTicks;
+}
+
+void Profiler::print(bool histograms) const
+{
+    float ticksPerUs = profileTicksPerUs();
+
+    Serial.printf("Profile: %lu ticks per us\n", (unsigned long)profileTicksPerUs());
+    Serial.println("Section       count    min us    avg us    p99 us    max us");
+    for (int i = 0; i < NUM_PROFILE_SECTIONS; i++) {
+        const ProfileStats &stats = mStats[i];
+        if (stats.count == 0) {
+            Serial.printf("%-8s %10d\n", SECTION_NAMES[i], 0);
+            continue;
+        }
+
+        Serial.printf("%-8s %10lu %9.2f %9.2f %9.2f %9.2f\n", SECTION_NAMES[i], (unsigned long)stats.count,
+                      stats.minTicks / ticksPerUs, stats.totalTicks / ticksPerUs / stats.count,
+                      percentile((ProfileSection)i, 99) / ticksPerUs, stats.maxTicks / ticksPerUs);
+    }
+
+    if (!histograms) {
+        return;
+    }
+
+    for (int i = 0; i < NUM_PROFILE_SECTIONS; i++) {
+        const ProfileStats &stats = mStats[i];
+        if (stats.count == 0) {
+            continue;
+        }
+
+        Serial.printf("Histogram %s (ticks):\n", SECTION_NAMES[i]);
+        for (int j = 0; j < PROFILE_BUCKETS; j++) {
+            if (stats.buckets[j] == 0) {
+                continue;
+            }
+            Serial.printf("  < %10lu: %10lu %5.1f%%\n", j == PROFILE_BUCKETS - 1 ? 0xFFFFFFFFUL : (2UL << j),
+                          (unsigned long)stats.buckets[j], 100.0f * stats.buckets[j] / stats.count);
+        }
+    }
+}
+
+void Profiler::reset()
+{
+    for (int i = 0; i < NUM_PROFILE_SECTIONS; i++) {
+        mStats[i] = {};
+    }
+}
@@ -0,0 +1,122 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Run time profiler of the main loop subsystems.
+ * A ProfileScope measures the time until the end of its block with the DWT cycle counter
+ * of the Teensy, or with std::chrono on host builds, and adds it to a log2 histogram of
+ * its section. Sections may be nested; the time of the inner section is included in the
+ * outer section.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#if defined(__IMXRT1062__)
+  #include <Arduino.h>
+#else
+  #include <chrono>
+#endif
+
+enum ProfileSection : uint8_t {
+    PS_MIDI_ROUTER = 0,     // MIDIRouter::loop
+    PS_COUPLER     = 1,     // CouplerProcessor::routeDivisionInput, included in PS_MIDI_ROUTER
+    PS_CONTROLLER  = 2,     // ControllerDriver::loop
+    PS_PANEL       = 3,     // PanelInterface::loop
+    PS_CMDLINE     = 4,     // CommandLine::loop, including the command printouts
+    NUM_PROFILE_SECTIONS
+};
+
+// Histogram buckets; bucket i counts durations of 2^i .. 2^(i+1)-1 ticks
+static const uint8_t PROFILE_BUCKETS = 32;
+
+#if defined(__IMXRT1062__)
+
+// The cycle counter is enabled by the Teensy startup code
+inline uint32_t profileTicks() { return ARM_DWT_CYCCNT; }
+
+inline uint32_t profileTicksPerUs() { return F_CPU_ACTUAL / 1000000; }
+
+#else
+
+// Nanoseconds on host builds; durations must be shorter than 4s
+inline uint32_t profileTicks() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint32_t profileTicksPerUs() { return 1000; }
+
+#endif
+
+struct ProfileStats {
+    uint32_t count;
+    uint32_t minTicks;
+    uint32_t maxTicks;
+    uint64_t totalTicks;
+    uint32_t buckets[PROFILE_BUCKETS];
+};
+
+class Profiler
+{
+    private:
+        ProfileStats mStats[NUM_PROFILE_SECTIONS];
+
+    public:
+        Profiler() { reset(); }
+
+        void record(ProfileSection section, uint32_t ticks) {
+            ProfileStats &stats = mStats[section];
+
+            if (stats.count == 0 || ticks < stats.minTicks) {
+                stats.minTicks = ticks;
+            }
+            if (ticks > stats.maxTicks) {
+                stats.maxTicks = ticks;
+            }
+            stats.count++;
+            stats.totalTicks += ticks;
+            stats.buckets[31 - __builtin_clz(ticks | 1)]++;
+        }
+
+        const ProfileStats &stats(ProfileSection section) const { return mStats[section]; }
+
+        /**
+         * Get an upper bound of the given percentile 0..100 of the durations, in ticks,
+         * from the histogram.
+         */
+        uint32_t percentile(ProfileSection section, uint8_t percent) const;
+
+        /**
+         * Print min/avg/p99/max of all sections, and the histograms if requested.
+         */
+        void print(bool histograms = false) const;
+
+        void reset();
+};
+
+/**
+ * Measures the time from its construction to the end of the enclosing block.
+ */
+class ProfileScope
+{
+    private:
+        const ProfileSection mSection;
+        const uint32_t mStart;
+
+    public:
+        explicit ProfileScope(ProfileSection section) : mSection(section), mStart(profileTicks()) {}
+
+        ~ProfileScope();
+};
+
+extern Profiler Profile;
+
+inline ProfileScope::~ProfileScope()
+{
+    Profile.record(mSection, profileTicks() - mStart);
+}
@@ -0,0 +1,74 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Registration sequencer implementation
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "RegistrationSequencer.h"
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+RegistrationSequencer::RegistrationSequencer()
+{
+    reset();
+}
+
+void RegistrationSequencer::reset()
+{
+    mNumSteps = 0;
+    mPosition = -1;
+}
+
+void RegistrationSequencer::setPosition(int position)
+{
+    if (position < -1 || position >= mNumSteps) {
+        return;
+    }
+    mPosition = position;
+}
+
+void RegistrationSequencer::updateDelta(int index)
+{
+    if (index < 0 || index + 1 >= mNumSteps) {
+        return;
+    }
+
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        mDeltas[index].stops[i] = mSteps[index].stops[i] ^ mSteps[index + 1].stops[i];
+    }
+}
+
+bool RegistrationSequencer::storeStep(int index, const Registration &registration)
+{
+    if (index < 0 || index > mNumSteps || index >= MAX_SEQUENCER_STEPS) {
+        return false;
+    }
+
+    mSteps[index] = registration;
+    if (index == mNumSteps) {
+        mNumSteps++;
+    }
+
+    updateDelta(index - 1);
+    updateDelta(index);
+
+    return true;
+}
+
+void RegistrationSequencer::truncate(int numSteps)
+{
+    if (numSteps < 0 || numSteps >= mNumSteps) {
+        return;
+    }
+
+    mNumSteps = numSteps;
+    if (mPosition >= mNumSteps) {
+        mPosition = mNumSteps - 1;
+    }
+}
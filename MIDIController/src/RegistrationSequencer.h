@@ -0,0 +1,74 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Registration sequencer: ordered list of registration steps.
+ * The stop changes between adjacent steps are precomputed when a step is stored,
+ * so that advancing the sequencer only has to send the stored changes.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+#include "CombinationMemory.h"
+
+static const int MAX_SEQUENCER_STEPS = 64;
+
+class RegistrationSequencer
+{
+    private:
+        Registration mSteps[MAX_SEQUENCER_STEPS];
+
+        // mDeltas[i]: stops that differ between step i and step i+1
+        Registration mDeltas[MAX_SEQUENCER_STEPS];
+
+        int mNumSteps = 0;
+
+        // Current step, -1 before the first step
+        int mPosition = -1;
+
+        void updateDelta(int index);
+
+    public:
+        RegistrationSequencer();
+
+        /**
+         * Remove all steps and move before the first step.
+         */
+        void reset();
+
+        int numSteps() const { return mNumSteps; }
+
+        int position() const { return mPosition; }
+
+        /**
+         * \param position step index, or -1 to move before the first step.
+         */
+        void setPosition(int position);
+
+        const Registration &step(int index) const { return mSteps[index]; }
+
+        /**
+         * Get the stops that differ between step index and step index+1.
+         */
+        const Registration &delta(int index) const { return mDeltas[index]; }
+
+        /**
+         * Store a registration to a step.
+         * 
+         * \param index step index, at most numSteps() to append a step.
+         * \return false if the step index is out of range.
+         */
+        bool storeStep(int index, const Registration &registration);
+
+        /**
+         * Keep only the first numSteps steps.
+         */
+        void truncate(int numSteps);
+};
@@ -0,0 +1,193 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Cooperative main loop scheduler implementation
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "TaskScheduler.h"
+
+#include <Arduino.h>
+
+#include <inttypes.h>
+
+static const char* PRIORITY_NAMES[] = { "rt", "high", "normal", "idle" };
+
+int TaskScheduler::addTask(const char *name, TaskFunction function, TaskPriority priority,
+                           uint32_t interval, uint32_t budget)
+{
+    if (mNumTasks == MAX_TASKS) {
+        return -1;
+    }
+
+    Task &task = mTasks[mNumTasks];
+    task.name = name;
+    task.function = function;
+    task.priority = priority;
+    task.interval = interval;
+    task.budget = budget;
+    task.due = interval != TASK_ON_WAKEUP;
+    task.deadline = micros();
+    task.running = false;
+    task.stats = {};
+
+    return mNumTasks++;
+}
+
+void TaskScheduler::wake(int task)
+{
+    wakeAt(task, micros());
+}
+
+void TaskScheduler::wakeAt(int task, uint32_t time)
+{
+    if (task < 0 || task >= mNumTasks) {
+        return;
+    }
+
+    Task &t = mTasks[task];
+    if (!t.due || (int32_t)(time - t.deadline) < 0) {
+        t.deadline = time;
+    }
+    t.due = true;
+}
+
+bool TaskScheduler::isDue(const Task &task, uint32_t now) const
+{
+    if (!task.due || task.running) {
+        return false;
+    }
+    return task.interval == 0 || (int32_t)(now - task.deadline) >= 0;
+}
+
+void TaskScheduler::runTask(Task &task)
+{
+    uint32_t start = micros();
+
+    if (task.interval != 0) {
+        uint32_t latency = start - task.deadline;
+        if (latency > task.stats.maxLatency) {
+            task.stats.maxLatency = latency;
+        }
+
+        if (task.interval == TASK_ON_WAKEUP) {
+            task.due = false;
+        } else if ((int32_t)(start - task.deadline) >= (int32_t)task.interval) {
+            // Skip missed periods instead of running the task repeatedly to catch up
+            task.deadline = start + task.interval;
+        } else {
+            task.deadline += task.interval;
+        }
+    }
+
+    task.running = true;
+    task.function();
+    task.running = false;
+
+    uint32_t duration = micros() - start;
+
+    task.stats.runs++;
+    task.stats.totalTime += duration;
+    if (duration > task.stats.maxTime) {
+        task.stats.maxTime = duration;
+    }
+    if (task.budget && duration > task.budget) {
+        task.stats.overruns++;
+    }
+}
+
+void TaskScheduler::runRealtime()
+{
+    uint32_t now = micros();
+
+    for (int i = 0; i < mNumTasks; i++) {
+        if (mTasks[i].priority == TP_REALTIME && isDue(mTasks[i], now)) {
+            runTask(mTasks[i]);
+        }
+    }
+}
+
+void TaskScheduler::runPriority(TaskPriority priority)
+{
+    for (int i = 0; i < mNumTasks; i++) {
+        if (mTasks[i].priority == priority && isDue(mTasks[i], micros())) {
+            runTask(mTasks[i]);
+            runRealtime();
+        }
+    }
+}
+
+void TaskScheduler::runIdle(uint32_t passStart)
+{
+    uint32_t now = micros();
+    uint32_t elapsed = now - passStart;
+    bool starved = now - mLastIdleRun >= SCHEDULER_IDLE_MAX_WAIT_US;
+
+    for (int n = 0; n < mNumTasks; n++) {
+        int i = (mNextIdle + n) % mNumTasks;
+        Task &task = mTasks[i];
+
+        if (task.priority != TP_IDLE || !isDue(task, now)) {
+            continue;
+        }
+        if (!starved && elapsed + task.budget > SCHEDULER_FRAME_US) {
+            // No slack left in this pass
+            return;
+        }
+
+        mNextIdle = (i + 1) % mNumTasks;
+        mLastIdleRun = now;
+
+        runTask(task);
+        runRealtime();
+        return;
+    }
+
+    // Nothing to do counts as a run, so that waiting idle tasks are not considered starved
+    mLastIdleRun = now;
+}
+
+void TaskScheduler::printStats()
+{
+    Serial.printf("Scheduler: %lu passes\n", (unsigned long)mPasses);
+    Serial.println("Task       prio    interval  budget     runs   avg us   max us  overruns  max late");
+    for (int i = 0; i < mNumTasks; i++) {
+        const Task &task = mTasks[i];
+        const TaskStats &stats = task.stats;
+
+        uint32_t avg = stats.runs ? (uint32_t)(stats.totalTime / stats.runs) : 0;
+
+        Serial.printf("%-10s %-6s ", task.name, PRIORITY_NAMES[task.priority]);
+        if (task.interval == TASK_ON_WAKEUP) {
+            Serial.print("  wakeup ");
+        } else {
+            Serial.printf("%8lu ", (unsigned long)task.interval);
+        }
+        Serial.printf("%7lu %8lu %8lu %8lu %9lu %9lu\n", (unsigned long)task.budget,
+                      (unsigned long)stats.runs, (unsigned long)avg, (unsigned long)stats.maxTime,
+                      (unsigned long)stats.overruns, (unsigned long)stats.maxLatency);
+    }
+}
+
+void TaskScheduler::resetStats()
+{
+    mPasses = 0;
+    for (int i = 0; i < mNumTasks; i++) {
+        mTasks[i].stats = {};
+    }
+}
+
+void TaskScheduler::loop()
+{
+    uint32_t passStart = micros();
+
+    mPasses++;
+
+    runRealtime();
+    runPriority(TP_HIGH);
+    runPriority(TP_NORMAL);
+    runIdle(passStart);
+}
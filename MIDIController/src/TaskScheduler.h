@@ -0,0 +1,122 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Cooperative scheduler of the main loop.
+ * Tasks run to completion in order of their priority. Realtime tasks run on every pass and
+ * again after every other task, so that a slow task delays them by its own run time only.
+ * Idle tasks run only in the slack time of a pass, one per pass, unless they waited too long.
+ * Periodic tasks and tasks that wait for a wakeup run when their deadline is reached.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+static const uint8_t MAX_TASKS = 8;
+
+// Interval of tasks that run only when they are woken up
+static const uint32_t TASK_ON_WAKEUP = 0xFFFFFFFF;
+
+// Time of a pass in which idle tasks may run, in us
+static const uint32_t SCHEDULER_FRAME_US = 1000;
+
+// Idle tasks run even without slack time after waiting this long, in us
+static const uint32_t SCHEDULER_IDLE_MAX_WAIT_US = 20000;
+
+enum TaskPriority : uint8_t {
+    // Runs on every pass and between all other tasks
+    TP_REALTIME = 0,
+    TP_HIGH     = 1,
+    TP_NORMAL   = 2,
+    // Runs only in slack time
+    TP_IDLE     = 3
+};
+
+using TaskFunction = void(*)();
+
+struct TaskStats {
+    uint32_t runs;
+    // Run times, in us
+    uint32_t maxTime;
+    uint64_t totalTime;
+    // Runs that took longer than the budget of the task
+    uint32_t overruns;
+    // Maximum time between the deadline and the start of the task, in us
+    uint32_t maxLatency;
+};
+
+class TaskScheduler
+{
+    private:
+        struct Task {
+            const char  *name;
+            TaskFunction function;
+            TaskPriority priority;
+            // Time between runs in us, 0 to run on every pass, or TASK_ON_WAKEUP
+            uint32_t     interval;
+            // Expected maximum run time in us, 0 for no budget
+            uint32_t     budget;
+            bool         due;
+            uint32_t     deadline;
+            bool         running;
+            TaskStats    stats;
+        };
+
+        Task mTasks[MAX_TASKS];
+        uint8_t mNumTasks = 0;
+
+        // Next idle task to run, round robin
+        uint8_t mNextIdle = 0;
+
+        uint32_t mLastIdleRun = 0;
+
+        uint32_t mPasses = 0;
+
+        bool isDue(const Task &task, uint32_t now) const;
+
+        void runTask(Task &task);
+
+        void runPriority(TaskPriority priority);
+
+        void runIdle(uint32_t passStart);
+
+    public:
+        TaskScheduler() {}
+
+        /**
+         * Add a task.
+         * \param interval Time between the starts of the task in us, 0 to run it on every pass,
+         *                 or TASK_ON_WAKEUP to run it only after wake() or wakeAt().
+         * \param budget Expected maximum run time in us; idle tasks run only if the budget fits
+         *               into the slack time of the pass.
+         * \return the id of the task, or -1 if there are too many tasks.
+         */
+        int addTask(const char *name, TaskFunction function, TaskPriority priority,
+                    uint32_t interval = 0, uint32_t budget = 0);
+
+        /**
+         * Run the task on the next pass.
+         */
+        void wake(int task);
+
+        /**
+         * Run the task when the time in micros() is reached, or earlier if it is due before.
+         */
+        void wakeAt(int task, uint32_t time);
+
+        /**
+         * Run all realtime tasks. Long running tasks call this between steps of their work,
+         * e.g. between the lines of a long printout.
+         */
+        void runRealtime();
+
+        void printStats();
+
+        void resetStats();
+
+        void loop();
+};
@@ -0,0 +1,45 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Velocity curve tables, generated at compile time
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "VelocityCurve.h"
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+static constexpr uint8_t curveVelocity(VelocityCurve curve, int v)
+{
+    switch (curve) {
+        case VC_SOFT:
+            return 127 - (127 - v) * (127 - v) / 127;
+        case VC_HARD:
+            return v * v / 127 > 0 ? v * v / 127 : 1;
+        case VC_FIXED:
+            return KEY_VELOCITY;
+        default:
+            return v;
+    }
+}
+
+static constexpr VelocityTable makeVelocityTable(VelocityCurve curve)
+{
+    VelocityTable table = {};
+    for (int v = 1; v < NUM_VELOCITIES; v++) {
+        table.velocity[v] = curveVelocity(curve, v);
+    }
+    return table;
+}
+
+constexpr VelocityTable VELOCITY_CURVES[NUM_VELOCITY_CURVES] = {
+    makeVelocityTable(VC_LINEAR),
+    makeVelocityTable(VC_SOFT),
+    makeVelocityTable(VC_HARD),
+    makeVelocityTable(VC_FIXED)
+};
@@ -0,0 +1,35 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Velocity curve lookup tables.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+enum VelocityCurve : int {
+    VC_LINEAR = 0,
+    VC_SOFT   = 1,  // louder at light touch
+    VC_HARD   = 2,  // needs a harder touch for the same velocity
+    VC_FIXED  = 3   // always KEY_VELOCITY
+};
+
+static const int NUM_VELOCITY_CURVES = 4;
+
+static const int NUM_VELOCITIES = 128;
+
+/**
+ * Maps a key velocity to an output velocity. Velocity 0 (NoteOff) always maps to 0.
+ */
+struct VelocityTable {
+    uint8_t velocity[NUM_VELOCITIES];
+};
+
+extern const VelocityTable VELOCITY_CURVES[NUM_VELOCITY_CURVES];
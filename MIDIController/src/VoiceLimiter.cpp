@@ -0,0 +1,109 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Output polyphony limiter implementation
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "VoiceLimiter.h"
+
+#include <inttypes.h>
+
+void VoiceLimiter::setLimit(uint8_t maxVoices, StealPolicy policy)
+{
+    mMaxVoices = maxVoices > MAX_VOICES ? MAX_VOICES : maxVoices;
+    mPolicy = policy;
+    reset();
+}
+
+void VoiceLimiter::reset()
+{
+    mNumVoices = 0;
+}
+
+int VoiceLimiter::findVoice(uint8_t note, uint8_t owner) const
+{
+    for (int i = 0; i < mNumVoices; i++) {
+        if (mVoices[i].note == note && mVoices[i].owner == owner) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void VoiceLimiter::removeVoice(int index)
+{
+    for (int i = index; i < mNumVoices - 1; i++) {
+        mVoices[i] = mVoices[i + 1];
+    }
+    mNumVoices--;
+}
+
+int VoiceLimiter::noteOn(uint8_t note)
+{
+    Voice stolen;
+    if (noteOn(note, 0, stolen)) {
+        return stolen.note;
+    }
+    return -1;
+}
+
+bool VoiceLimiter::noteOn(uint8_t note, uint8_t owner, Voice &stolen)
+{
+    if (!mMaxVoices) {
+        return false;
+    }
+
+    bool steal = false;
+
+    int index = findVoice(note, owner);
+    if (index >= 0) {
+        // Retriggered note becomes the newest voice
+        removeVoice(index);
+    } else if (mNumVoices >= mMaxVoices) {
+        int victim = 0;
+        for (int i = 1; i < mNumVoices; i++) {
+            if ((mPolicy == SP_LOWEST  && mVoices[i].note < mVoices[victim].note) ||
+                (mPolicy == SP_HIGHEST && mVoices[i].note > mVoices[victim].note)) {
+                victim = i;
+            }
+        }
+        stolen = mVoices[victim];
+        steal = true;
+        removeVoice(victim);
+        mStolenVoices++;
+    }
+
+    mVoices[mNumVoices++] = { note, owner };
+
+    return steal;
+}
+
+bool VoiceLimiter::noteOff(uint8_t note, uint8_t owner)
+{
+    if (!mMaxVoices) {
+        return true;
+    }
+
+    int index = findVoice(note, owner);
+    if (index < 0) {
+        return false;
+    }
+
+    removeVoice(index);
+    return true;
+}
+
+void VoiceLimiter::releaseOwner(uint8_t owner)
+{
+    int n = 0;
+    for (int i = 0; i < mNumVoices; i++) {
+        if (mVoices[i].owner != owner) {
+            mVoices[n++] = mVoices[i];
+        }
+    }
+    mNumVoices = n;
+}
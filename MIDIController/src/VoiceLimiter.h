@@ -0,0 +1,105 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Output polyphony limiter with voice stealing.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+// Maximum polyphony that can be set as limit
+static const int MAX_VOICES = 16;
+
+enum StealPolicy : uint8_t {
+    SP_OLDEST  = 0,
+    SP_LOWEST  = 1,
+    SP_HIGHEST = 2
+};
+
+class VoiceLimiter
+{
+    public:
+        struct Voice {
+            uint8_t note;
+            // Division or other source playing the note, if the limiter is shared
+            uint8_t owner;
+        };
+
+    private:
+        // Notes playing, in order of their NoteOn, oldest first
+        Voice mVoices[MAX_VOICES];
+
+        uint8_t mNumVoices = 0;
+
+        // Maximum number of voices, 0 for no limit
+        uint8_t mMaxVoices = 0;
+
+        StealPolicy mPolicy = SP_OLDEST;
+
+        uint32_t mStolenVoices = 0;
+
+        int findVoice(uint8_t note, uint8_t owner) const;
+
+        void removeVoice(int index);
+
+    public:
+        VoiceLimiter() {}
+
+        /**
+         * \param maxVoices 1..MAX_VOICES, or 0 to disable the limit.
+         */
+        void setLimit(uint8_t maxVoices, StealPolicy policy);
+
+        bool limited() const { return mMaxVoices > 0; }
+
+        uint8_t maxVoices() const { return mMaxVoices; }
+
+        StealPolicy policy() const { return mPolicy; }
+
+        uint8_t numVoices() const { return mNumVoices; }
+
+        /**
+         * Get a playing note, 0..numVoices()-1, oldest first.
+         */
+        uint8_t voice(int index) const { return mVoices[index].note; }
+
+        uint8_t voiceOwner(int index) const { return mVoices[index].owner; }
+
+        uint32_t stolenVoices() const { return mStolenVoices; }
+
+        /**
+         * Forget all playing voices.
+         */
+        void reset();
+
+        /**
+         * Allocate a voice for a note.
+         * 
+         * \return the note whose voice was stolen and must be turned off, or -1.
+         */
+        int noteOn(uint8_t note);
+
+        /**
+         * Allocate a voice for a note of an owner, stealing from any owner.
+         * 
+         * \return true if a voice was stolen, it is returned in \a stolen.
+         */
+        bool noteOn(uint8_t note, uint8_t owner, Voice &stolen);
+
+        /**
+         * Release the voice of a note.
+         * 
+         * \return false if the note has no voice, i.e., it has been stolen.
+         */
+        bool noteOff(uint8_t note, uint8_t owner = 0);
+
+        /**
+         * Release all voices of an owner.
+         */
+        void releaseOwner(uint8_t owner);
+};
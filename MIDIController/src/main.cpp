@@ -13,6 +13,8 @@
 #include "OrganStateManager.h"
 #include "CouplerProcessor.h"
 #include "PanelInterface.h"
+#include "Profiler.h"
+#include "TaskScheduler.h"
 
 #ifdef TEENSY_DEBUG
   #include "TeensyDebug.h"
@@ -25,6 +27,7 @@ CouplerProcessor Coupler(MIDI);
 ControllerDriver Control;
 OrganStateManager StateMngr(MIDI, Coupler, Control);
 PanelInterface Panel(StateMngr, Coupler, MIDI, Audio);
+TaskScheduler Scheduler;
 
 static const int PIN_LED = 23;
 
@@ -41,6 +44,11 @@ static int PrintI2C = 0;
 
 static bool KeyboardIsLearning = false;
 
+// Interval of the piston LED updates, in us; piston presses update the LEDs immediately
+static const uint32_t PISTON_LED_INTERVAL_US = 10000;
+
+static int PistonLEDTask = -1;
+
 static const char* divisionName(MIDIDivision division) {
     switch (division) {
         case MIDIDivision::MD_Choir:
@@ -111,19 +119,33 @@ class DebugParser: public CommandParser
 
 class StatusParser: public CommandParser
 {
+    private:
+        bool mTasks = false;
+
     public:
         StatusParser() {}
 
         virtual void printArguments() { 
-            Serial.print("all|technics|keyboard|toestud|pedal");
+            Serial.print("all|technics|keyboard|toestud|pedal|tasks [reset]");
         }
 
         virtual CmdErrorCode startCommand(const char* cmd) {
+            mTasks = false;
             return CmdErrorCode::CmdNextArgument;
         }
 
         virtual CmdErrorCode parseNextArgument(int argNo, const char* arg) {
-            if (strcmp("all", arg) == 0) {
+            if (mTasks) {
+                if (strcmp("reset", arg) != 0) {
+                    return CmdErrorCode::CmdInvalidArgument;
+                }
+                Scheduler.resetStats();
+                return CmdErrorCode::CmdOK;
+            }
+            if (strcmp("tasks", arg) == 0) {
+                mTasks = true;
+                return CmdErrorCode::CmdNextArgument;
+            } else if (strcmp("all", arg) == 0) {
                 // Setup mngr for printing next status
                 PrintNextStatus = PRINT_ALL;
 
@@ -149,6 +171,10 @@ class StatusParser: public CommandParser
         }
 
         virtual CmdErrorCode completeCommand(bool expectArgument) {
+            if (mTasks) {
+                Scheduler.printStats();
+                return CmdErrorCode::CmdOK;
+            }
             if (expectArgument) {
                 // no argument given, read all
                 PrintNextStatus = PRINT_ALL;
@@ -157,6 +183,7 @@ class StatusParser: public CommandParser
                 Control.readAll();
             }
             Control.printIRQStatus();
+            Control.printBusStatus();
             
             return CmdErrorCode::CmdOK;
         }
@@ -202,6 +229,185 @@ class ChannelParser: public CommandParser
         }
 };
 
+class VelocityParser: public CommandParser
+{
+    private:
+        MIDIDivision mDivision;
+
+    public:
+        VelocityParser() {}
+
+        virtual void printArguments() { 
+            Serial.print("<division> linear|soft|hard|fixed");
+        }
+
+        virtual CmdErrorCode startCommand(const char* cmd) {
+            return CmdErrorCode::CmdNextArgument;
+        }
+
+        virtual CmdErrorCode parseNextArgument(int argNo, const char* arg) {
+            if (argNo == 0) {
+                if (parseDivision(arg, mDivision)) {
+                    return CmdErrorCode::CmdNextArgument;
+                }
+                return CmdErrorCode::CmdError;
+            }
+            if (argNo == 1) {
+                if (strcmp(arg, "linear") == 0) {
+                    Coupler.setVelocityCurve(mDivision, VelocityCurve::VC_LINEAR);
+                    return CmdErrorCode::CmdOK;
+                }
+                if (strcmp(arg, "soft") == 0) {
+                    Coupler.setVelocityCurve(mDivision, VelocityCurve::VC_SOFT);
+                    return CmdErrorCode::CmdOK;
+                }
+                if (strcmp(arg, "hard") == 0) {
+                    Coupler.setVelocityCurve(mDivision, VelocityCurve::VC_HARD);
+                    return CmdErrorCode::CmdOK;
+                }
+                if (strcmp(arg, "fixed") == 0) {
+                    Coupler.setVelocityCurve(mDivision, VelocityCurve::VC_FIXED);
+                    return CmdErrorCode::CmdOK;
+                }
+            }
+            return CmdErrorCode::CmdInvalidArgument;
+        }
+};
+
+class TransposeParser: public CommandParser
+{
+    public:
+        TransposeParser() {}
+
+        virtual void printArguments() { 
+            Serial.print("<semitones>");
+        }
+
+        virtual CmdErrorCode startCommand(const char* cmd) {
+            return CmdErrorCode::CmdNextArgument;
+        }
+
+        virtual CmdErrorCode parseNextArgument(int argNo, const char* arg) {
+            int semitones;
+            if (argNo == 0 && parseInteger(arg, semitones, -MAX_TRANSPOSE, MAX_TRANSPOSE)) {
+                Coupler.setTranspose(semitones);
+                return CmdErrorCode::CmdOK;
+            }
+            return CmdErrorCode::CmdInvalidArgument;
+        }
+
+        virtual CmdErrorCode completeCommand(bool expectArgument) {
+            if (expectArgument) {
+                Serial.printf("Transpose: %d\n", Coupler.transpose());
+            }
+            return CmdErrorCode::CmdOK;
+        }
+};
+
+class VoicesParser: public CommandParser
+{
+    private:
+        MIDIDivision mDivision;
+        int mMaxVoices;
+        // Set the limit of the division inject port instead of the division
+        bool mPort;
+
+        void setPolyphony(StealPolicy policy) {
+            if (mPort) {
+                Coupler.setPortPolyphony(mDivision, mMaxVoices, policy);
+            } else {
+                Coupler.setPolyphony(mDivision, mMaxVoices, policy);
+            }
+        }
+
+    public:
+        VoicesParser() {}
+
+        virtual void printArguments() { 
+            Serial.print("[<division> [port] <max voices> [oldest|lowest|highest]]");
+        }
+
+        virtual CmdErrorCode startCommand(const char* cmd) {
+            mMaxVoices = -1;
+            mPort = false;
+            return CmdErrorCode::CmdNextArgument;
+        }
+
+        virtual CmdErrorCode parseNextArgument(int argNo, const char* arg) {
+            if (argNo == 1 && strcmp(arg, "port") == 0) {
+                mPort = true;
+                return CmdErrorCode::CmdNextArgument;
+            }
+            if (mPort) {
+                argNo--;
+            }
+            switch (argNo) {
+                case 0:
+                    if (parseDivision(arg, mDivision)) {
+                        return CmdErrorCode::CmdNextArgument;
+                    }
+                    return CmdErrorCode::CmdError;
+                case 1:
+                    if (parseInteger(arg, mMaxVoices, 0, MAX_VOICES)) {
+                        return CmdErrorCode::CmdNextArgument;
+                    }
+                    return CmdErrorCode::CmdError;
+                case 2:
+                    if (strcmp(arg, "oldest") == 0) {
+                        setPolyphony(StealPolicy::SP_OLDEST);
+                        return CmdErrorCode::CmdOK;
+                    }
+                    if (strcmp(arg, "lowest") == 0) {
+                        setPolyphony(StealPolicy::SP_LOWEST);
+                        return CmdErrorCode::CmdOK;
+                    }
+                    if (strcmp(arg, "highest") == 0) {
+                        setPolyphony(StealPolicy::SP_HIGHEST);
+                        return CmdErrorCode::CmdOK;
+                    }
+                    return CmdErrorCode::CmdInvalidArgument;
+                default:
+                    return CmdErrorCode::CmdError;
+            }
+        }
+
+        virtual CmdErrorCode completeCommand(bool expectArgument) {
+            if (!expectArgument) {
+                return CmdErrorCode::CmdOK;
+            }
+            if (mMaxVoices >= 0) {
+                // no steal policy given, steal oldest voice
+                setPolyphony(StealPolicy::SP_OLDEST);
+                return CmdErrorCode::CmdOK;
+            }
+            if (mPort) {
+                return CmdErrorCode::CmdError;
+            }
+            // no arguments given, print voice statistics
+            for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+                const VoiceLimiter &voices = Coupler.voiceLimiter((MIDIDivision)i);
+                if (voices.limited()) {
+                    Serial.printf("%s: voices=%d/%d stolen=%lu\n", divisionName((MIDIDivision)i), 
+                                  voices.numVoices(), voices.maxVoices(), (unsigned long)voices.stolenVoices());
+                }
+            }
+            for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+                // print each port once, at the first division sending to it
+                MIDIPort port = Coupler.injectPort((MIDIDivision)i);
+                int first = 0;
+                while (Coupler.injectPort((MIDIDivision)first) != port) {
+                    first++;
+                }
+                const VoiceLimiter &voices = Coupler.portVoiceLimiter((MIDIDivision)i);
+                if (first == i && voices.limited()) {
+                    Serial.printf("Port %d: voices=%d/%d stolen=%lu\n", port, 
+                                  voices.numVoices(), voices.maxVoices(), (unsigned long)voices.stolenVoices());
+                }
+            }
+            return CmdErrorCode::CmdOK;
+        }
+};
+
 class CalibrationParser: public CommandParser
 {
     public:
@@ -288,7 +494,7 @@ class LEDControlParser: public CommandParser
         LEDControlParser() {}
 
         virtual void printArguments() { 
-            Serial.print("rgb1|rbg2 <R> <G> <B>; led 0..255; pedal 0..15");
+            Serial.print("rgb1|rbg2 <R> <G> <B>; led 0..255; pedal 0..15; refresh <ms>");
         }
 
         virtual CmdErrorCode startCommand(const char* cmd) {
@@ -314,6 +520,18 @@ class LEDControlParser: public CommandParser
                     mLED = 3;
                     return CmdErrorCode::CmdNextArgument;
                 }
+                if (strcmp(arg, "refresh") == 0) {
+                    mLED = 4;
+                    return CmdErrorCode::CmdNextArgument;
+                }
+            }
+            else if (argNo == 1 && mLED == 4) {
+                // Minimum time between piston LED updates
+                int refresh;
+                if (parseInteger(arg, refresh, 0, 1000)) {
+                    Control.setPistonLEDRefresh(refresh);
+                    return CmdErrorCode::CmdOK;
+                }
             }
             else if (argNo < 4) {
                 // in 'led' command
@@ -376,6 +594,458 @@ class ToeStudModeParser: public CommandParser
         }
 };
 
+class CrescendoParser: public CommandParser
+{
+    private:
+        enum CrescendoParserCmd {
+            CPC_NONE,
+            CPC_STORE
+        };
+
+        CrescendoParserCmd mCommand;
+
+    public:
+        CrescendoParser() {}
+
+        virtual void printArguments() { 
+            Serial.print("store <stage>|clear");
+        }
+
+        virtual CmdErrorCode startCommand(const char* cmd) {
+            mCommand = CPC_NONE;
+            return CmdErrorCode::CmdNextArgument;
+        }
+
+        virtual CmdErrorCode parseNextArgument(int argNo, const char* arg) {
+            if (argNo == 0) {
+                if (strcmp(arg, "store") == 0) {
+                    mCommand = CPC_STORE;
+                    return CmdErrorCode::CmdNextArgument;
+                }
+                if (strcmp(arg, "clear") == 0) {
+                    Coupler.clearCrescendoStages();
+                    return CmdErrorCode::CmdOK;
+                }
+            }
+            if (argNo == 1) {
+                if (mCommand == CPC_STORE) {
+                    int stage;
+                    if (parseInteger(arg, stage, 1, MAX_CRESCENDO_STAGES) && Coupler.storeCrescendoStage(stage)) {
+                        return CmdErrorCode::CmdOK;
+                    }
+                    return CmdErrorCode::CmdError;
+                }
+            }
+            return CmdErrorCode::CmdInvalidArgument;
+        }
+
+        virtual CmdErrorCode completeCommand(bool expectArgument) {
+            if (expectArgument && mCommand == CPC_NONE) {
+                // no argument given, print crescendo status
+                const CrescendoEngine &crescendo = Coupler.crescendoEngine();
+                Serial.printf("Crescendo: stage %d of %d\n", crescendo.stage(), crescendo.numStages());
+                return CmdErrorCode::CmdOK;
+            }
+            return CommandParser::completeCommand(expectArgument);
+        }
+};
+
+static const char* PISTON_COMMAND_NAMES[NUM_PISTON_COMMAND_TYPES] = {
+    "none", "coupler", "transpose", "off", "combination", "clear", "crescendo", "page",
+    "sequence", "set", "hold", "soundoff", "melody", "bass", "transfer", "latch", "restore"
+};
+
+static const char* buttonTypeName(ButtonType button) {
+    switch (button) {
+        case ButtonType::BT_NEXT:
+            return "next";
+        case ButtonType::BT_PREV:
+            return "prev";
+        case ButtonType::BT_TOGGLE:
+            return "toggle";
+        case ButtonType::BT_ALL:
+            return "all";
+        case ButtonType::BT_NONE:
+            break;
+    }
+    return "none";
+}
+
+static bool pistonHasDivisionParam(PistonCommandType type) {
+    return type == PCT_COUPLER || type == PCT_MELODY || type == PCT_BASS || type == PCT_TRANSFER;
+}
+
+static bool pistonHasButtonParam(PistonCommandType type) {
+    return type == PCT_TRANSPOSE || type == PCT_PAGE || type == PCT_SEQUENCE || type == PCT_SOUNDOFF;
+}
+
+class PistonParser: public CommandParser
+{
+    private:
+        MIDIDivision  mDivision;
+        int           mButton;
+        PistonCommand mCommand;
+
+        void printMapping() {
+            const PistonMap &map = Coupler.pistonMap();
+            Serial.printf("Piston map: %s\n", map.isDefault() ? "default" : "modified");
+            for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+                for (int j = 0; j < MAX_PISTONS; j++) {
+                    const PistonCommand &cmd = map.command((MIDIDivision)i, j);
+                    if (cmd.type == PCT_NONE) {
+                        continue;
+                    }
+                    Serial.printf("%s %d: %s %s", divisionName((MIDIDivision)i), j, 
+                                  divisionName(cmd.division), PISTON_COMMAND_NAMES[cmd.type]);
+                    if (pistonHasDivisionParam(cmd.type)) {
+                        Serial.printf(" %s", divisionName(cmd.param.division));
+                    } else if (pistonHasButtonParam(cmd.type)) {
+                        Serial.printf(" %s", buttonTypeName(cmd.param.button));
+                    } else if (cmd.type == PCT_COMBINATION) {
+                        Serial.printf(" %d", cmd.param.value);
+                    }
+                    Serial.println();
+                }
+                Scheduler.runRealtime();
+            }
+        }
+
+        bool parseButtonType(const char* arg, ButtonType &button) {
+            for (int i = 0; i <= ButtonType::BT_ALL; i++) {
+                if (strcmp(arg, buttonTypeName((ButtonType)i)) == 0) {
+                    button = (ButtonType)i;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        CmdErrorCode setCommand() {
+            if (Coupler.pistonMap().setCommand(mDivision, mButton, mCommand)) {
+                return CmdErrorCode::CmdOK;
+            }
+            return CmdErrorCode::CmdError;
+        }
+
+    public:
+        PistonParser() {}
+
+        virtual void printArguments() { 
+            Serial.print("[<division> <button> <target> <command> [<param>]|save|load|default]");
+        }
+
+        virtual CmdErrorCode startCommand(const char* cmd) {
+            mDivision = MIDIDivision::MD_MIDI;
+            return CmdErrorCode::CmdNextArgument;
+        }
+
+        virtual CmdErrorCode parseNextArgument(int argNo, const char* arg) {
+            switch (argNo) {
+                case 0:
+                    if (strcmp(arg, "save") == 0) {
+                        Coupler.pistonMap().saveEEPROM();
+                        return CmdErrorCode::CmdOK;
+                    }
+                    if (strcmp(arg, "load") == 0) {
+                        return Coupler.pistonMap().loadEEPROM() ? CmdErrorCode::CmdOK : CmdErrorCode::CmdError;
+                    }
+                    if (strcmp(arg, "default") == 0) {
+                        Coupler.pistonMap().reset();
+                        Coupler.pistonMap().clearEEPROM();
+                        return CmdErrorCode::CmdOK;
+                    }
+                    if (parseDivision(arg, mDivision)) {
+                        return CmdErrorCode::CmdNextArgument;
+                    }
+                    return CmdErrorCode::CmdInvalidArgument;
+                case 1:
+                    if (parseInteger(arg, mButton, 0, MAX_PISTONS - 1)) {
+                        return CmdErrorCode::CmdNextArgument;
+                    }
+                    return CmdErrorCode::CmdError;
+                case 2:
+                    if (parseDivision(arg, mCommand.division)) {
+                        return CmdErrorCode::CmdNextArgument;
+                    }
+                    return CmdErrorCode::CmdError;
+                case 3:
+                    for (int i = 0; i < NUM_PISTON_COMMAND_TYPES; i++) {
+                        if (strcmp(arg, PISTON_COMMAND_NAMES[i]) == 0) {
+                            mCommand.type = (PistonCommandType)i;
+                            mCommand.param.value = 0;
+                            if (pistonHasDivisionParam(mCommand.type) || pistonHasButtonParam(mCommand.type) || 
+                                mCommand.type == PCT_COMBINATION) 
+                            {
+                                return CmdErrorCode::CmdNextArgument;
+                            }
+                            return setCommand();
+                        }
+                    }
+                    return CmdErrorCode::CmdError;
+                case 4: {
+                    int value;
+                    if (pistonHasDivisionParam(mCommand.type) && parseDivision(arg, mCommand.param.division)) {
+                        return setCommand();
+                    }
+                    if (pistonHasButtonParam(mCommand.type) && parseButtonType(arg, mCommand.param.button)) {
+                        return setCommand();
+                    }
+                    if (mCommand.type == PCT_COMBINATION) {
+                        if (!parseInteger(arg, value, 1, MAX_COMBINATIONS)) {
+                            Serial.printf("Invalid combination '%s', must be 1..%d!\n", arg, MAX_COMBINATIONS);
+                            return CmdErrorCode::CmdInvalidArgument;
+                        }
+                        mCommand.param.value = value;
+                        return setCommand();
+                    }
+                    return CmdErrorCode::CmdError;
+                }
+                default:
+                    return CmdErrorCode::CmdInvalidArgument;
+            }
+        }
+
+        virtual CmdErrorCode completeCommand(bool expectArgument) {
+            if (expectArgument && mDivision == MIDIDivision::MD_MIDI) {
+                // no argument given, print the piston mapping
+                printMapping();
+                return CmdErrorCode::CmdOK;
+            }
+            return CommandParser::completeCommand(expectArgument);
+        }
+};
+
+class TraceParser: public CommandParser
+{
+    private:
+        void printEvent(const CouplerTraceEvent &event) {
+            Serial.printf("%10lu %-7s ", (unsigned long)event.time, divisionName((MIDIDivision)event.division));
+            switch (event.type) {
+                case CTT_COUPLER:
+                    Serial.printf("coupler -> %s: %d -> %d\n", divisionName((MIDIDivision)event.note),
+                                  event.value >> 4, event.value & 0x0F);
+                    break;
+                case CTT_NOTE_ON:
+                    Serial.printf("on  %3d vel %d\n", event.note, event.value);
+                    break;
+                case CTT_NOTE_OFF:
+                    Serial.printf("off %3d\n", event.note);
+                    break;
+                case CTT_SUPPRESSED:
+                    Serial.printf("suppressed %s %d\n", event.value ? "on" : "off", event.note);
+                    break;
+                case CTT_HOLDER_ADD:
+                case CTT_HOLDER_REMOVE:
+                    Serial.printf("holder %c %s.%d note %d\n", event.type == CTT_HOLDER_ADD ? '+' : '-',
+                                  divisionName((MIDIDivision)(event.value / COUPLER_HOLDERS_PER_DIVISION)),
+                                  event.value % COUPLER_HOLDERS_PER_DIVISION, event.note);
+                    break;
+            }
+        }
+
+        void drain(bool raw) {
+            CouplerTrace &trace = Coupler.trace();
+            CouplerTraceEvent event;
+            uint32_t count = 0;
+
+            // Bounded, since the coupler adds events while MIDI is routed during the printout
+            while (count++ < COUPLER_TRACE_SIZE && trace.read(event)) {
+                if (raw) {
+                    const uint8_t *data = (const uint8_t*)&event;
+                    for (unsigned i = 0; i < sizeof(CouplerTraceEvent); i++) {
+                        Serial.printf("%02x", data[i]);
+                    }
+                    Serial.println();
+                } else {
+                    printEvent(event);
+                }
+                Scheduler.runRealtime();
+            }
+            if (trace.lost()) {
+                Serial.printf("Trace: %lu events lost\n", (unsigned long)trace.lost());
+            }
+        }
+
+    public:
+        TraceParser() {}
+
+        virtual void printArguments() { 
+            Serial.print("[on|off|raw|clear]");
+        }
+
+        virtual CmdErrorCode startCommand(const char* cmd) {
+            return CmdErrorCode::CmdNextArgument;
+        }
+
+        virtual CmdErrorCode parseNextArgument(int argNo, const char* arg) {
+            if (strcmp(arg, "on") == 0) {
+                Coupler.trace().enable(true);
+            } else if (strcmp(arg, "off") == 0) {
+                Coupler.trace().enable(false);
+            } else if (strcmp(arg, "raw") == 0) {
+                drain(true);
+            } else if (strcmp(arg, "clear") == 0) {
+                Coupler.trace().clear();
+            } else {
+                return CmdErrorCode::CmdInvalidArgument;
+            }
+            return CmdErrorCode::CmdOK;
+        }
+
+        virtual CmdErrorCode completeCommand(bool expectArgument) {
+            if (expectArgument) {
+                // no argument given, print all new events
+                drain(false);
+            }
+            return CmdErrorCode::CmdOK;
+        }
+};
+
+class BusParser: public CommandParser
+{
+    private:
+        enum BusParserCmd {
+            BPC_NONE,
+            BPC_COUNTED,
+            BPC_FAST,
+            BPC_IRQ
+        };
+
+        BusParserCmd mCommand;
+        int mIRQLine;
+
+    public:
+        BusParser() {}
+
+        virtual void printArguments() { 
+            Serial.print("[reset|probe|counted on|off|fast on|off|irq <line> hi|lo|irq save|load|clear]");
+        }
+
+        virtual CmdErrorCode startCommand(const char* cmd) {
+            mCommand = BPC_NONE;
+            mIRQLine = -1;
+            return CmdErrorCode::CmdNextArgument;
+        }
+
+        virtual CmdErrorCode parseNextArgument(int argNo, const char* arg) {
+            if (argNo == 0) {
+                if (strcmp(arg, "reset") == 0) {
+                    Control.resetBusStats();
+                    Control.resetIRQStats();
+                    return CmdErrorCode::CmdOK;
+                }
+                if (strcmp(arg, "probe") == 0) {
+                    Control.negotiateClock();
+                    return CmdErrorCode::CmdOK;
+                }
+                if (strcmp(arg, "counted") == 0) {
+                    mCommand = BPC_COUNTED;
+                    return CmdErrorCode::CmdNextArgument;
+                }
+                if (strcmp(arg, "fast") == 0) {
+                    mCommand = BPC_FAST;
+                    return CmdErrorCode::CmdNextArgument;
+                }
+                if (strcmp(arg, "irq") == 0) {
+                    mCommand = BPC_IRQ;
+                    return CmdErrorCode::CmdNextArgument;
+                }
+            } else if (argNo == 1 && mCommand == BPC_IRQ) {
+                if (strcmp(arg, "save") == 0) {
+                    Control.saveIRQPolarity();
+                    return CmdErrorCode::CmdOK;
+                }
+                if (strcmp(arg, "load") == 0) {
+                    return Control.loadIRQPolarity() ? CmdErrorCode::CmdOK : CmdErrorCode::CmdError;
+                }
+                if (strcmp(arg, "clear") == 0) {
+                    Control.clearIRQPolarity();
+                    return CmdErrorCode::CmdOK;
+                }
+                mIRQLine = ControllerDriver::findIRQLine(arg);
+                if (mIRQLine < 0) {
+                    return CmdErrorCode::CmdInvalidArgument;
+                }
+                return CmdErrorCode::CmdNextArgument;
+            } else if (argNo == 2 && mCommand == BPC_IRQ) {
+                if (strcmp(arg, "hi") == 0) {
+                    Control.setIRQPolarity((IRQLine)mIRQLine, true);
+                } else if (strcmp(arg, "lo") == 0) {
+                    Control.setIRQPolarity((IRQLine)mIRQLine, false);
+                } else {
+                    return CmdErrorCode::CmdInvalidArgument;
+                }
+                return CmdErrorCode::CmdOK;
+            } else if (argNo == 1 && mCommand != BPC_NONE) {
+                bool enabled;
+                if (strcmp(arg, "on") == 0) {
+                    enabled = true;
+                } else if (strcmp(arg, "off") == 0) {
+                    enabled = false;
+                } else {
+                    return CmdErrorCode::CmdInvalidArgument;
+                }
+
+                if (mCommand == BPC_COUNTED) {
+                    Control.setCountedReads(enabled);
+                } else {
+                    Control.setFastMode(enabled);
+                }
+                return CmdErrorCode::CmdOK;
+            }
+            return CmdErrorCode::CmdInvalidArgument;
+        }
+
+        virtual CmdErrorCode completeCommand(bool expectArgument) {
+            if (expectArgument) {
+                if (mCommand == BPC_IRQ && mIRQLine < 0) {
+                    Control.printIRQStatus();
+                    return CmdErrorCode::CmdOK;
+                }
+                if (mCommand != BPC_NONE) {
+                    return CmdErrorCode::CmdInvalidArgument;
+                }
+                Serial.printf("Counted reads: %s\n", Control.countedReads() ? "on" : "off");
+                Control.printBusStatus();
+                Control.printBusDevices();
+            }
+            return CmdErrorCode::CmdOK;
+        }
+};
+
+class PerfParser: public CommandParser
+{
+    public:
+        PerfParser() {}
+
+        virtual void printArguments() { 
+            Serial.print("[hist|reset]");
+        }
+
+        virtual CmdErrorCode startCommand(const char* cmd) {
+            return CmdErrorCode::CmdNextArgument;
+        }
+
+        virtual CmdErrorCode parseNextArgument(int argNo, const char* arg) {
+            if (strcmp(arg, "hist") == 0) {
+                Profile.print(true);
+                return CmdErrorCode::CmdOK;
+            }
+            if (strcmp(arg, "reset") == 0) {
+                Profile.reset();
+                return CmdErrorCode::CmdOK;
+            }
+            return CmdErrorCode::CmdInvalidArgument;
+        }
+
+        virtual CmdErrorCode completeCommand(bool expectArgument) {
+            if (expectArgument) {
+                Profile.print();
+            }
+            return CmdErrorCode::CmdOK;
+        }
+};
+
 void onKeyboardStatus(uint8_t channel1, uint8_t channel2, bool training, uint8_t lastKey)
 {
     char noteName[4];
@@ -449,6 +1119,8 @@ void onPistonPress(MIDIDivision division, uint8_t button, bool longPress)
 
     // Send all piston events to Coupler for handling
     Coupler.processPistonPress(division, button, longPress);
+
+    Scheduler.wake(PistonLEDTask);
 }
 
 void onLEDControllerButton(uint8_t button, uint8_t value) {
@@ -469,6 +1141,16 @@ void onLEDControllerButton(uint8_t button, uint8_t value) {
     }
 }
 
+void runMIDI() { MIDI.loop(); }
+
+void runControl() { Control.loop(); }
+
+void runPanel() { Panel.loop(); }
+
+void runStateMngr() { StateMngr.loop(); }
+
+void runCmdline() { Cmdline.loop(); }
+
 void setup()
 {
 #ifdef TEENSY_DEBUG
@@ -488,9 +1170,17 @@ void setup()
     Cmdline.addCommand("calibrate", new CalibrationParser());
     Cmdline.addCommand("status", new StatusParser());
     Cmdline.addCommand("channel", new ChannelParser());
+    Cmdline.addCommand("velocity", new VelocityParser());
+    Cmdline.addCommand("transpose", new TransposeParser());
+    Cmdline.addCommand("voices", new VoicesParser());
     Cmdline.addCommand("router", new RouterParser());
     Cmdline.addCommand("toestud", new ToeStudModeParser());
     Cmdline.addCommand("led", new LEDControlParser());
+    Cmdline.addCommand("crescendo", new CrescendoParser());
+    Cmdline.addCommand("piston", new PistonParser());
+    Cmdline.addCommand("trace", new TraceParser());
+    Cmdline.addCommand("bus", new BusParser());
+    Cmdline.addCommand("perf", new PerfParser());
 
     Control.setKeyboardStatusCallback(onKeyboardStatus);
     Control.setTechnicsStatusCallback(onTechnicsStatus);
@@ -508,12 +1198,15 @@ void setup()
     StateMngr.begin();
     Audio.begin();
     Panel.begin();
+
+    // MIDI routing runs between all other tasks; the command line only runs in slack time
+    Scheduler.addTask("midi", runMIDI, TaskPriority::TP_REALTIME, 0, 100);
+    Scheduler.addTask("i2c", runControl, TaskPriority::TP_HIGH, 0, 100);
+    Scheduler.addTask("panel", runPanel, TaskPriority::TP_HIGH, 0, 100);
+    PistonLEDTask = Scheduler.addTask("leds", runStateMngr, TaskPriority::TP_NORMAL, PISTON_LED_INTERVAL_US, 50);
+    Scheduler.addTask("cmdline", runCmdline, TaskPriority::TP_IDLE, 0, 500);
 }
 
 void loop() {
-    Cmdline.loop();
-    Control.loop();
-    MIDI.loop();
-    StateMngr.loop();
-    Panel.loop();
+    Scheduler.loop();
 }
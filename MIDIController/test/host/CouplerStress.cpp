@@ -0,0 +1,654 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Randomized stress test and benchmark of the coupler engine.
+ *
+ * Plays random key presses interleaved with piston presses, coupler, transpose,
+ * unison off, latch, transfer, channel and coupler mode changes, and checks after every
+ * step that the notes sounding on the output match the notes held by the coupler.
+ * Played notes and controllers must come out of the port of their keyboard.
+ * While the coupler is not enabled, and until the keys pressed before it was enabled again
+ * are released, only stuck notes are checked.
+ *
+ * Usage: CouplerStress [<steps> [<seed>]]
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include <Arduino.h>
+#include <MIDI.h>
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <random>
+
+#include <common_config.h>
+
+#include "CouplerProcessor.h"
+#include "FakeRouter.h"
+#include "Profiler.h"
+
+static const int NUM_MANUALS = 5;
+
+static const MIDIDivision MANUALS[NUM_MANUALS] = {
+    MIDIDivision::MD_Pedal,
+    MIDIDivision::MD_Choir,
+    MIDIDivision::MD_Great,
+    MIDIDivision::MD_Swell,
+    MIDIDivision::MD_Solo
+};
+
+// Range of keys played on the manuals
+static const int LOWEST_KEY = 28;
+static const int HIGHEST_KEY = 100;
+
+// Maximum number of keys held down at once on a manual
+static const int MAX_HELD_KEYS = 12;
+
+// Input channel of the external keyboard on MIDI2, played as the Great manual. Its notes
+// are sent on this channel unless the manual is transferred.
+static const uint8_t EXTERNAL_CHANNEL = 9;
+
+// Controller sent by the keyboards
+static const uint8_t CONTROL_NUMBER = midi::MidiControlChangeNumber::ModulationWheel;
+
+// Number of recent operations printed when a check fails
+static const int HISTORY_LENGTH = 16;
+
+static const int MAX_OPERATION_LENGTH = 64;
+
+enum Operation {
+    OP_KEY,
+    OP_PISTON,
+    OP_COUPLE,
+    OP_TRANSPOSE_DIVISION,
+    OP_MELODY,
+    OP_ENABLE,
+    OP_LATCH,
+    OP_TRANSPOSE,
+    OP_TRANSFER,
+    OP_CHANNEL,
+    OP_POLYPHONY,
+    OP_COUPLER_NOTES_OFF,
+    OP_RESET,
+    OP_MODE,
+    OP_CONTROL,
+    OP_PORT_POLYPHONY,
+    NUM_OPERATIONS
+};
+
+static const char* OPERATION_NAMES[NUM_OPERATIONS] = {
+    "key", "piston", "couple", "transposeDivision", "melody", "enable", "latch",
+    "transpose", "transfer", "channel", "polyphony", "allCouplerNotesOff", "reset", "mode", "control",
+    "portPolyphony"
+};
+
+// Relative frequency of the operations
+static const int OPERATION_WEIGHTS[NUM_OPERATIONS] = {
+    60, 10, 8, 3, 3, 3, 2, 2, 2, 1, 1, 1, 1, 1, 3, 1
+};
+
+struct OperationStats {
+    long     count;
+    uint64_t totalNs;
+    uint64_t worstNs;
+};
+
+MIDIRouter Router;
+CouplerProcessor Coupler(Router);
+
+static std::mt19937 Random;
+
+// Channel of each division, mirrors the coupler
+static uint8_t Channels[MAX_DIVISION_CHANNEL + 1];
+
+// Division each manual is transferred to, mirrors the coupler
+static MIDIDivision Transfer[MAX_DIVISION_CHANNEL + 1];
+
+// Keys held down on each manual
+static NoteSet Keys[MAX_DIVISION_CHANNEL + 1];
+
+// Held keys of the Great manual that are played on the external keyboard
+static NoteSet ExternalKeys;
+
+// Held keys that were pressed while the coupler was not enabled, or that were held when
+// it was switched off. Their notes are not tracked by the coupler.
+static NoteSet Unrecorded[MAX_DIVISION_CHANNEL + 1];
+
+// Set when the coupler is switched off, until all keys are released with the coupler
+// enabled. Notes of unrecorded keys may overlap with coupled notes in the meantime.
+static bool Unchecked = false;
+
+// Message counters of the output when the checks were resumed
+static long DuplicateNoteOns = 0;
+static long SilentNoteOffs = 0;
+static long MismatchedNoteOffs = 0;
+
+static OperationStats Stats[NUM_OPERATIONS];
+
+static char History[HISTORY_LENGTH][MAX_OPERATION_LENGTH];
+static long Step = 0;
+
+static int randomInt(int minValue, int maxValue)
+{
+    return std::uniform_int_distribution<int>(minValue, maxValue)(Random);
+}
+
+static MIDIDivision randomManual()
+{
+    return MANUALS[randomInt(0, NUM_MANUALS - 1)];
+}
+
+static Operation randomOperation()
+{
+    int total = 0;
+    for (int i = 0; i < NUM_OPERATIONS; i++) {
+        total += OPERATION_WEIGHTS[i];
+    }
+    int value = randomInt(0, total - 1);
+    for (int i = 0; i < NUM_OPERATIONS; i++) {
+        if (value < OPERATION_WEIGHTS[i]) {
+            return (Operation)i;
+        }
+        value -= OPERATION_WEIGHTS[i];
+    }
+    return OP_KEY;
+}
+
+static void fail(const char *fmt, ...)
+{
+    printf("FAIL at step %ld: ", Step);
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\nLast operations:\n");
+    for (int i = HISTORY_LENGTH - 1; i >= 0; i--) {
+        if (Step - i >= 0) {
+            printf("  %ld: %s\n", Step - i, History[(Step - i) % HISTORY_LENGTH]);
+        }
+    }
+    exit(1);
+}
+
+static MIDIPort keyboardPort(bool external)
+{
+    return external ? MIDIPort::MP_MIDI2 : MIDIPort::MP_MIDI1;
+}
+
+/**
+ * Get the output channel of the messages a keyboard plays on a manual.
+ */
+static uint8_t keyboardChannel(MIDIDivision manual, bool external)
+{
+    if (Transfer[manual] != manual) {
+        return Channels[Transfer[manual]];
+    }
+    return external ? EXTERNAL_CHANNEL : Channels[manual];
+}
+
+/**
+ * Check that a note played on a keyboard is sent from the keyboard port, unless it was
+ * already sounding or is held by a coupler of the division to itself.
+ */
+static void checkPlayedNote(MIDIDivision manual, uint8_t note, bool external, bool sounding)
+{
+    MIDIDivision division = Transfer[manual];
+    int outNote = note + Coupler.transpose();
+    uint8_t channel = keyboardChannel(manual, external);
+
+    if (Unchecked || sounding || !Coupler.enabled(division) || (Coupler.coupled(division, division) & CS_UNISON) ||
+        outNote < 0 || outNote >= NUM_MIDI_NOTES || !Output.sounding(channel).test(outNote))
+    {
+        return;
+    }
+    if (Output.notePort(channel, outNote) != keyboardPort(external)) {
+        fail("division %d: played note %d sent from port %d, keyboard is on port %d", division, note,
+             Output.notePort(channel, outNote), keyboardPort(external));
+    }
+}
+
+static void sendKey(MIDIDivision manual, uint8_t note, bool press)
+{
+    if (press && manual == MIDIDivision::MD_Great && randomInt(0, 3) == 0) {
+        ExternalKeys.set(note);
+    }
+    bool external = ExternalKeys.test(note) && manual == MIDIDivision::MD_Great;
+
+    MidiMessage msg;
+    msg.channel = external ? EXTERNAL_CHANNEL : Channels[manual];
+    msg.type = press ? midi::MidiType::NoteOn : midi::MidiType::NoteOff;
+    msg.data1 = note;
+    msg.data2 = press ? randomInt(1, 127) : 0;
+    msg.length = 3;
+    msg.valid = true;
+
+    int outNote = note + Coupler.transpose();
+    bool sounding = outNote >= 0 && outNote < NUM_MIDI_NOTES &&
+                    Output.sounding(keyboardChannel(manual, external)).test(outNote);
+
+    Coupler.routeDivisionInput(keyboardPort(external), msg);
+
+    if (press) {
+        checkPlayedNote(manual, note, external, sounding);
+    }
+
+    if (press) {
+        Keys[manual].set(note);
+        if (Coupler.couplerMode() != CouplerMode::CM_ENABLED) {
+            Unrecorded[manual].set(note);
+        }
+    } else {
+        Keys[manual].clear(note);
+        Unrecorded[manual].clear(note);
+        if (manual == MIDIDivision::MD_Great) {
+            ExternalKeys.clear(note);
+        }
+    }
+}
+
+/**
+ * Send a controller from the keyboard of a manual, check that it is sent from the same port
+ * as the played notes.
+ */
+static void sendControl(MIDIDivision manual, bool external)
+{
+    MidiMessage msg;
+    msg.channel = external ? EXTERNAL_CHANNEL : Channels[manual];
+    msg.type = midi::MidiType::ControlChange;
+    msg.data1 = CONTROL_NUMBER;
+    msg.data2 = randomInt(0, 127);
+    msg.length = 3;
+    msg.valid = true;
+
+    long messages = Output.messages();
+
+    Coupler.routeDivisionInput(keyboardPort(external), msg);
+
+    uint8_t channel = keyboardChannel(manual, external);
+    if (Coupler.couplerMode() == CouplerMode::CM_ENABLED && !Coupler.enabled(Transfer[manual])) {
+        return;
+    }
+    if (Output.messages() == messages || Output.controlPort(channel) != keyboardPort(external)) {
+        fail("manual %d: controller not sent from the keyboard port %d", manual, keyboardPort(external));
+    }
+}
+
+static bool hasUnrecordedKeys()
+{
+    for (int i = 0; i < NUM_MANUALS; i++) {
+        if (!Unrecorded[MANUALS[i]].empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void releaseAllKeys()
+{
+    for (int i = 0; i < NUM_MANUALS; i++) {
+        MIDIDivision manual = MANUALS[i];
+        Keys[manual].forEach([&](int note) {
+            sendKey(manual, note, false);
+        });
+    }
+}
+
+static void changeChannel(MIDIDivision division)
+{
+    // Only move to channels that are not used by any division
+    uint8_t channel;
+    bool used;
+    do {
+        channel = randomInt(0, NUM_MIDI_CHANNELS - 1);
+        used = false;
+        for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+            used |= (i != MIDIDivision::MD_MIDI && Channels[i] == channel);
+        }
+    } while (used || channel == EXTERNAL_CHANNEL);
+
+    Coupler.setDivisionChannel(division, channel);
+    Channels[division] = channel;
+}
+
+/**
+ * Execute a random operation, write its description into the history.
+ */
+static Operation runOperation()
+{
+    char *desc = History[Step % HISTORY_LENGTH];
+    Operation op = randomOperation();
+    MIDIDivision division = randomManual();
+    MIDIDivision target = randomManual();
+
+    switch (op) {
+        case OP_KEY: {
+            bool press = Keys[division].empty() || (Keys[division].count() < MAX_HELD_KEYS && randomInt(0, 1));
+            uint8_t note;
+            if (press) {
+                do {
+                    note = randomInt(LOWEST_KEY, HIGHEST_KEY);
+                } while (Keys[division].test(note));
+            } else {
+                // Release a random held key
+                int index = randomInt(0, Keys[division].count() - 1);
+                note = 0;
+                Keys[division].forEach([&](int key) {
+                    if (index-- == 0) {
+                        note = key;
+                    }
+                });
+            }
+            snprintf(desc, MAX_OPERATION_LENGTH, "key %s %d %d", press ? "press" : "release", division, note);
+            sendKey(division, note, press);
+            break;
+        }
+        case OP_PISTON: {
+            MIDIDivision panel = randomInt(0, NUM_MANUALS) == NUM_MANUALS ? MIDIDivision::MD_Control : division;
+            uint8_t button = randomInt(0, MAX_PISTONS - 1);
+            bool longPress = randomInt(0, 4) == 0;
+            snprintf(desc, MAX_OPERATION_LENGTH, "piston %d.%d%s", panel, button, longPress ? " long" : "");
+            Coupler.processPistonPress(panel, button, longPress);
+            break;
+        }
+        case OP_COUPLE: {
+            CouplerState state = (CouplerState)randomInt(0, CS_UNISON | CS_SUPER | CS_SUB);
+            snprintf(desc, MAX_OPERATION_LENGTH, "couple %d -> %d state %d", division, target, state);
+            Coupler.coupleDivision(division, target, state);
+            break;
+        }
+        case OP_TRANSPOSE_DIVISION: {
+            CouplerState state = (CouplerState)randomInt(0, CS_UNISON | CS_SUPER | CS_SUB);
+            snprintf(desc, MAX_OPERATION_LENGTH, "transposeDivision %d state %d", division, state);
+            Coupler.transposeDivision(division, state);
+            break;
+        }
+        case OP_MELODY: {
+            MelodyMode mode = (MelodyMode)randomInt(0, NUM_MELODY_MODES - 1);
+            if (randomInt(0, 2) == 0) {
+                target = MIDIDivision::MD_MIDI;
+            }
+            snprintf(desc, MAX_OPERATION_LENGTH, "melody %d mode %d -> %d", division, mode, target);
+            Coupler.melodyCoupleDivision(division, mode, target);
+            break;
+        }
+        case OP_ENABLE:
+            snprintf(desc, MAX_OPERATION_LENGTH, "enable %d %d", division, !Coupler.enabled(division));
+            Coupler.enableDivision(division, !Coupler.enabled(division));
+            break;
+        case OP_LATCH:
+            snprintf(desc, MAX_OPERATION_LENGTH, "latch %d %d", division, !Coupler.latched(division));
+            Coupler.latchDivision(division, !Coupler.latched(division));
+            break;
+        case OP_TRANSPOSE: {
+            int semitones = randomInt(-MAX_TRANSPOSE, MAX_TRANSPOSE);
+            snprintf(desc, MAX_OPERATION_LENGTH, "transpose %d", semitones);
+            Coupler.setTranspose(semitones);
+            break;
+        }
+        case OP_TRANSFER:
+            snprintf(desc, MAX_OPERATION_LENGTH, "transfer %d <-> %d", division, target);
+            Coupler.transferDivisions(division, target);
+            if (division != target) {
+                for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+                    if (Transfer[i] == division) {
+                        Transfer[i] = target;
+                    } else if (Transfer[i] == target) {
+                        Transfer[i] = division;
+                    }
+                }
+            }
+            break;
+        case OP_CHANNEL:
+            changeChannel(division);
+            snprintf(desc, MAX_OPERATION_LENGTH, "channel %d -> %d", division, Channels[division]);
+            break;
+        case OP_POLYPHONY: {
+            int voices = randomInt(0, 8);
+            StealPolicy policy = (StealPolicy)randomInt(SP_OLDEST, SP_HIGHEST);
+            snprintf(desc, MAX_OPERATION_LENGTH, "polyphony %d voices %d policy %d", division, voices, policy);
+            Coupler.setPolyphony(division, voices, policy);
+            break;
+        }
+        case OP_PORT_POLYPHONY: {
+            int voices = randomInt(0, 12);
+            StealPolicy policy = (StealPolicy)randomInt(SP_OLDEST, SP_HIGHEST);
+            snprintf(desc, MAX_OPERATION_LENGTH, "port polyphony %d voices %d policy %d", division, voices, policy);
+            Coupler.setPortPolyphony(division, voices, policy);
+            break;
+        }
+        case OP_COUPLER_NOTES_OFF:
+            snprintf(desc, MAX_OPERATION_LENGTH, "allCouplerNotesOff");
+            Coupler.allCouplerNotesOff();
+            break;
+        case OP_RESET:
+            snprintf(desc, MAX_OPERATION_LENGTH, "reset");
+            Coupler.reset();
+            break;
+        case OP_MODE: {
+            // Switch the coupler off or on while keys are held
+            CouplerMode mode = CouplerMode::CM_ENABLED;
+            if (Coupler.couplerMode() == CouplerMode::CM_ENABLED) {
+                mode = randomInt(0, 1) ? CouplerMode::CM_MIDI : CouplerMode::CM_DISABLED;
+                for (int i = 0; i < NUM_MANUALS; i++) {
+                    Unrecorded[MANUALS[i]] |= Keys[MANUALS[i]];
+                }
+                Unchecked = true;
+            }
+            snprintf(desc, MAX_OPERATION_LENGTH, "mode %d", mode);
+            Coupler.setCouplerMode(mode);
+            break;
+        }
+        case OP_CONTROL: {
+            bool external = division == MIDIDivision::MD_Great && randomInt(0, 1);
+            snprintf(desc, MAX_OPERATION_LENGTH, "control %d%s", division, external ? " external" : "");
+            sendControl(division, external);
+            break;
+        }
+        default:
+            break;
+    }
+
+    return op;
+}
+
+/**
+ * Check that the output notes of all divisions match the notes held by the coupler.
+ */
+static void checkOutput()
+{
+    if (Unchecked) {
+        return;
+    }
+
+    if (Output.duplicateNoteOns() > DuplicateNoteOns) {
+        fail("NoteOn sent for a note that is already sounding");
+    }
+    if (Output.silentNoteOffs() > SilentNoteOffs) {
+        fail("NoteOff sent for a note that is not sounding");
+    }
+    if (Output.mismatchedNoteOffs() > MismatchedNoteOffs) {
+        fail("NoteOff sent from another port than the NoteOn");
+    }
+
+    int portSounding[NUM_MIDI_PORTS] = {};
+
+    for (int i = 0; i < NUM_MANUALS; i++) {
+        MIDIDivision division = MANUALS[i];
+        NoteSet sounding = Output.sounding(Channels[division]);
+        if (division == MIDIDivision::MD_Great) {
+            sounding |= Output.sounding(EXTERNAL_CHANNEL);
+        }
+        portSounding[Coupler.injectPort(division)] += sounding.count();
+
+        NoteSet held = Coupler.heldNotes(division).shifted(Coupler.transpose());
+
+        NoteSet unheld = sounding & ~held;
+        if (!unheld.empty()) {
+            fail("division %d: note %d is sounding without a holder", division, unheld.lowest());
+        }
+
+        const VoiceLimiter &voices = Coupler.voiceLimiter(division);
+        const VoiceLimiter &portVoices = Coupler.portVoiceLimiter(division);
+        if (voices.limited()) {
+            if (sounding.count() > voices.maxVoices()) {
+                fail("division %d: %d notes sounding, limit is %d voices", division, sounding.count(), voices.maxVoices());
+            }
+        } else if (!portVoices.limited()) {
+            NoteSet missing = held & ~sounding;
+            if (!missing.empty()) {
+                fail("division %d: held note %d is not sounding", division, missing.lowest());
+            }
+        }
+    }
+
+    for (int i = 0; i < NUM_MANUALS; i++) {
+        MIDIDivision division = MANUALS[i];
+        const VoiceLimiter &portVoices = Coupler.portVoiceLimiter(division);
+        int count = portSounding[Coupler.injectPort(division)];
+        if (portVoices.limited() && count > portVoices.maxVoices()) {
+            fail("port %d: %d notes sounding, limit is %d voices", Coupler.injectPort(division), count, portVoices.maxVoices());
+        }
+    }
+}
+
+/**
+ * Check that after allCouplerNotesOff only pressed or latched keys are sounding.
+ */
+static void checkCouplerNotesOff()
+{
+    for (int i = 0; i < NUM_MANUALS; i++) {
+        MIDIDivision division = MANUALS[i];
+        NoteSet coupled = Coupler.heldNotes(division) & ~Coupler.keyNotes(division);
+        if (!coupled.empty()) {
+            fail("division %d: coupled note %d still held after allCouplerNotesOff", division, coupled.lowest());
+        }
+    }
+}
+
+/**
+ * Check that no notes are sounding on any division.
+ */
+static void checkSilent(const char *when)
+{
+    if (!Output.sounding(EXTERNAL_CHANNEL).empty()) {
+        fail("%d notes stuck on the external keyboard channel after %s", Output.sounding(EXTERNAL_CHANNEL).count(), when);
+    }
+
+    for (int i = 0; i < NUM_MANUALS; i++) {
+        MIDIDivision division = MANUALS[i];
+        const NoteSet &sounding = Output.sounding(Channels[division]);
+        if (!sounding.empty()) {
+            int note = sounding.lowest() - Coupler.transpose();
+            fail("division %d: %d notes stuck after %s, note %d is %s", division, sounding.count(), when, note,
+                 Coupler.keyNotes(division).test(note) ? "a key" : "coupled");
+        }
+    }
+}
+
+/**
+ * Release all keys and latches and check that no notes are left sounding.
+ */
+static void checkAllReleased()
+{
+    Step++;
+    snprintf(History[Step % HISTORY_LENGTH], MAX_OPERATION_LENGTH, "release all keys and latches");
+
+    releaseAllKeys();
+    for (int i = 0; i < NUM_MANUALS; i++) {
+        Coupler.latchDivision(MANUALS[i], false);
+    }
+    checkOutput();
+    checkSilent("releasing all keys");
+
+    Coupler.allCouplerNotesOff();
+    checkOutput();
+    checkSilent("allCouplerNotesOff");
+
+    if (Coupler.couplerMode() == CouplerMode::CM_ENABLED) {
+        Unchecked = false;
+        DuplicateNoteOns = Output.duplicateNoteOns();
+        SilentNoteOffs = Output.silentNoteOffs();
+        MismatchedNoteOffs = Output.mismatchedNoteOffs();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    long steps = (argc > 1) ? atol(argv[1]) : 1000000;
+    unsigned seed = (argc > 2) ? atoi(argv[2]) : 1;
+
+    Random.seed(seed);
+
+    for (int i = 0; i < MAX_DIVISION_CHANNEL + 1; i++) {
+        Channels[i] = i;
+        Transfer[i] = (MIDIDivision)i;
+    }
+    Coupler.begin();
+    Coupler.setCouplerMode(CouplerMode::CM_ENABLED);
+
+    for (long i = 0; i < steps; i++) {
+        Step++;
+
+        auto start = std::chrono::steady_clock::now();
+
+        Operation op = runOperation();
+
+        auto end = std::chrono::steady_clock::now();
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+        OperationStats &stats = Stats[op];
+        stats.count++;
+        stats.totalNs += ns;
+        if (ns > stats.worstNs) {
+            stats.worstNs = ns;
+        }
+
+        // Resume all checks once the keys from before the coupler was enabled are released
+        if (Unchecked && Coupler.couplerMode() == CouplerMode::CM_ENABLED && !hasUnrecordedKeys()) {
+            checkAllReleased();
+        }
+
+        checkOutput();
+        if (op == OP_COUPLER_NOTES_OFF) {
+            checkCouplerNotesOff();
+        }
+
+        // Every now and then, let go of everything
+        if (Step % 10000 == 9999) {
+            checkAllReleased();
+        }
+    }
+    checkAllReleased();
+
+    long total = 0;
+    uint64_t totalNs = 0;
+    uint64_t worstNs = 0;
+
+    printf("%-20s %10s %10s %10s\n", "operation", "count", "mean ns", "worst ns");
+    for (int i = 0; i < NUM_OPERATIONS; i++) {
+        const OperationStats &stats = Stats[i];
+        if (stats.count == 0) {
+            continue;
+        }
+        printf("%-20s %10ld %10lu %10lu\n", OPERATION_NAMES[i], stats.count,
+               (unsigned long)(stats.totalNs / stats.count), (unsigned long)stats.worstNs);
+        total += stats.count;
+        totalNs += stats.totalNs;
+        if (stats.worstNs > worstNs) {
+            worstNs = stats.worstNs;
+        }
+    }
+    printf("\n%ld events (seed %u), %ld output messages\n", total, seed, Output.messages());
+    printf("Throughput: %.0f events/s, worst case %lu ns per event\n",
+           totalNs ? total * 1e9 / totalNs : 0.0, (unsigned long)worstNs);
+    printf("\n");
+    Profile.print(true);
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * MIDI router replacement for host tests
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "FakeRouter.h"
+
+#include <MIDI.h>
+
+OutputMonitor Output;
+
+OutputMonitor::OutputMonitor()
+{
+    reset();
+}
+
+void OutputMonitor::reset()
+{
+    for (int i = 0; i < NUM_MIDI_CHANNELS; i++) {
+        mSounding[i].reset();
+        mControlPorts[i] = MIDIPort::MP_MIDI1;
+    }
+    mMessages = 0;
+    mDuplicateNoteOns = 0;
+    mSilentNoteOffs = 0;
+    mMismatchedNoteOffs = 0;
+}
+
+void OutputMonitor::processMessage(MIDIPort port, const MidiMessage &msg)
+{
+    uint8_t channel = msg.channel % NUM_MIDI_CHANNELS;
+    uint8_t note = msg.data1 & 0x7F;
+
+    mMessages++;
+
+    switch (msg.type) {
+        case midi::MidiType::NoteOn:
+            if (msg.data2 > 0) {
+                if (mSounding[channel].test(note)) {
+                    mDuplicateNoteOns++;
+                }
+                mSounding[channel].set(note);
+                mNotePorts[channel][note] = port;
+                break;
+            }
+            // NoteOn with velocity 0 is a NoteOff
+            [[fallthrough]];
+        case midi::MidiType::NoteOff:
+            if (!mSounding[channel].test(note)) {
+                mSilentNoteOffs++;
+            } else if (mNotePorts[channel][note] != port) {
+                mMismatchedNoteOffs++;
+            }
+            mSounding[channel].clear(note);
+            break;
+        case midi::MidiType::ControlChange:
+            mControlPorts[channel] = port;
+            if (msg.data1 == midi::MidiControlChangeNumber::AllNotesOff || 
+                msg.data1 == midi::MidiControlChangeNumber::AllSoundOff) 
+            {
+                mSounding[channel].reset();
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+int OutputMonitor::numSounding() const
+{
+    int count = 0;
+    for (int i = 0; i < NUM_MIDI_CHANNELS; i++) {
+        count += mSounding[i].count();
+    }
+    return count;
+}
+
+MIDIRouter::MIDIRouter()
+{
+}
+
+void MIDIRouter::injectMessage(MIDIPort inPort, const MidiMessage &msg)
+{
+    Output.processMessage(inPort, msg);
+}
@@ -0,0 +1,63 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Replacement of the MIDI router for host tests.
+ * Records the note state of the messages the coupler sends to each output channel,
+ * and the ports the notes and controllers are sent from.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include <common_config.h>
+
+#include "BitSet.h"
+#include "MIDIRouter.h"
+
+class OutputMonitor
+{
+    private:
+        NoteSet mSounding[NUM_MIDI_CHANNELS];
+
+        // Port of the NoteOn of each sounding note, and of the last ControlChange
+        MIDIPort mNotePorts[NUM_MIDI_CHANNELS][NUM_MIDI_NOTES];
+        MIDIPort mControlPorts[NUM_MIDI_CHANNELS];
+
+        long mMessages;
+        long mDuplicateNoteOns;
+        long mSilentNoteOffs;
+        long mMismatchedNoteOffs;
+
+    public:
+        OutputMonitor();
+
+        void reset();
+
+        void processMessage(MIDIPort port, const MidiMessage &msg);
+
+        const NoteSet &sounding(uint8_t channel) const { return mSounding[channel]; }
+
+        MIDIPort notePort(uint8_t channel, uint8_t note) const { return mNotePorts[channel][note]; }
+
+        MIDIPort controlPort(uint8_t channel) const { return mControlPorts[channel]; }
+
+        int numSounding() const;
+
+        long messages() const { return mMessages; }
+
+        // NoteOn for a note that is already sounding on the channel
+        long duplicateNoteOns() const { return mDuplicateNoteOns; }
+
+        // NoteOff for a note that is not sounding on the channel
+        long silentNoteOffs() const { return mSilentNoteOffs; }
+
+        // NoteOff sent from another port than the NoteOn of the note
+        long mismatchedNoteOffs() const { return mMismatchedNoteOffs; }
+};
+
+extern OutputMonitor Output;
@@ -0,0 +1,390 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Benchmark of the controller I2C bus on the simulated encoders.
+ *
+ * Runs the ControllerDriver against the I2C simulator with random piston and toestud
+ * presses, pedal moves and LED controller buttons, and toggles the piston LED of every
+ * press that arrives. Every scenario checks that each press is reported exactly once,
+ * except for presses in replies that failed on the bus after the encoder sent them, and
+ * that such reads are not repeated. It reports the bus throughput and the latency from the
+ * press at the encoder to the piston callback, in simulated time.
+ *
+ * Usage: I2CBench [<seconds> [<seed> [<presses per second>]]]
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include <Arduino.h>
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <common_config.h>
+
+#include "ControllerDriver.h"
+#include "I2CSimulator.h"
+
+// Time of one iteration of the main loop besides the controller driver, in us
+static const uint32_t LOOP_TIME_US = 10;
+
+// Time to wait for outstanding presses after the last press, in us
+static const uint32_t DRAIN_TIME_US = 1000000;
+
+static const uint32_t PEDAL_INTERVAL_US = 5000;
+static const uint32_t LED_BUTTON_INTERVAL_US = 100000;
+
+// Presses of more buttons than fit into one status read
+static const uint32_t BURST_INTERVAL_US = 500000;
+static const int BURST_LENGTH = 10;
+
+struct Scenario {
+    const char *name;
+    bool     countedReads;
+    bool     fastMode;
+    // Slave model changes
+    double   nackRate;
+    uint32_t requestDelay;
+    uint32_t jitter;
+    bool     version;
+    // The Choir/Pedal piston encoder reports fast mode but fails with the fast clock
+    bool     slowPistons;
+    double   readErrorRate;
+    // The Keyboard IRQ line is wired active high, and the level is changed after begin()
+    bool     keyboardActiveHigh;
+};
+
+static const Scenario SCENARIOS[] = {
+    { "standard clock",     true,  false, 0.0,  40,  10,  true,  false, 0.0,  false },
+    { "legacy reads",       false, false, 0.0,  40,  10,  true,  false, 0.0,  false },
+    { "fast mode",          true,  true,  0.0,  40,  10,  true,  false, 0.0,  false },
+    { "fast mode, 1% NACK", true,  true,  0.01, 40,  10,  true,  false, 0.0,  false },
+    { "1% read errors",     true,  false, 0.0,  40,  10,  true,  false, 0.01, false },
+    { "fast mode, slow",    true,  true,  0.0,  200, 100, true,  false, 0.0,  false },
+    { "fast mode fallback", true,  true,  0.0,  40,  10,  true,  true,  0.0,  false },
+    { "old firmware",       true,  true,  0.0,  40,  10,  false, false, 0.0,  false },
+    { "kbd IRQ high",       true,  false, 0.0,  40,  10,  true,  false, 0.0,  true  }
+};
+
+static const int NUM_SCENARIOS = sizeof(SCENARIOS) / sizeof(SCENARIOS[0]);
+
+static std::mt19937 Random;
+
+// Press times of the presses that have not been reported yet, by division, button and long press
+static std::map<uint16_t, std::deque<uint32_t>> Pending;
+
+static long Presses;
+static long Dropped;
+// Presses in replies that failed on the bus after the encoder sent them
+static long Failed;
+static long Unexpected;
+static long PedalUpdates;
+static long LEDButtons;
+
+static std::vector<uint32_t> Latencies;
+
+static bool PistonLEDs[MAX_DIVISION_CHANNEL + 1][MAX_PISTONS];
+
+static ControllerDriver *Driver;
+
+static uint16_t pressKey(MIDIDivision division, uint8_t button, bool longPress)
+{
+    return (division << 8) | (button << 1) | (longPress ? 1 : 0);
+}
+
+static void onPistonPress(MIDIDivision division, uint8_t button, bool longPress)
+{
+    std::deque<uint32_t> &pending = Pending[pressKey(division, button, longPress)];
+    if (pending.empty()) {
+        Unexpected++;
+        return;
+    }
+    Latencies.push_back(micros() - pending.front());
+    pending.pop_front();
+
+    if (button < MAX_PISTONS) {
+        PistonLEDs[division][button] = !PistonLEDs[division][button];
+        Driver->setPistonLED(division, button, PistonLEDs[division][button]);
+    }
+}
+
+static void onToeStudStatus(uint16_t crescendo, uint16_t swell, uint16_t choir)
+{
+    PedalUpdates++;
+}
+
+static void onLEDControllerButton(uint8_t button, uint8_t value)
+{
+    LEDButtons++;
+}
+
+static void pressed(bool queued, MIDIDivision division, uint8_t button, bool longPress)
+{
+    if (queued) {
+        Pending[pressKey(division, button, longPress)].push_back(micros());
+        Presses++;
+    } else {
+        // Encoder queue is full
+        Dropped++;
+    }
+}
+
+static uint32_t randomInt(uint32_t max)
+{
+    return std::uniform_int_distribution<uint32_t>(0, max - 1)(Random);
+}
+
+/**
+ * Schedule a random press at one of the piston encoders or the toestuds.
+ */
+static void schedulePress(uint32_t time, SimPiston &pistonKbd, SimPiston &pistonTechnics, SimToeStud &toeStud)
+{
+    bool longPress = randomInt(8) == 0;
+
+    switch (randomInt(3)) {
+        case 0: {
+            uint8_t kbd = randomInt(2);
+            uint8_t button = randomInt(12);
+            MIDIDivision division = kbd ? MIDIDivision::MD_Solo : MIDIDivision::MD_Swell;
+            I2CSim.schedule(time, [&pistonKbd, kbd, button, longPress, division]() {
+                pressed(pistonKbd.press(kbd, button, longPress), division, button, longPress);
+            });
+            break;
+        }
+        case 1: {
+            uint8_t button = randomInt(24);
+            // Upper buttons are the Pedal pistons
+            MIDIDivision division = button >= PEDAL_PISTON_OFFSET ? MIDIDivision::MD_Pedal : MIDIDivision::MD_Choir;
+            uint8_t index = button >= PEDAL_PISTON_OFFSET ? button - PEDAL_PISTON_OFFSET : button;
+            I2CSim.schedule(time, [&pistonTechnics, button, longPress, division, index]() {
+                pressed(pistonTechnics.press(0, button, longPress), division, index, longPress);
+            });
+            break;
+        }
+        default: {
+            uint8_t button = randomInt(10);
+            I2CSim.schedule(time, [&toeStud, button, longPress]() {
+                pressed(toeStud.press(button, longPress), MIDIDivision::MD_Control, button, longPress);
+            });
+            break;
+        }
+    }
+}
+
+static void dropPress(uint16_t key)
+{
+    std::deque<uint32_t> &pending = Pending[key];
+    if (pending.empty()) {
+        // The encoder sent a press that was never pressed
+        Unexpected++;
+        return;
+    }
+    pending.pop_front();
+    Failed++;
+}
+
+/**
+ * Remove the presses in failed replies from the pending presses; they cannot be recovered.
+ */
+static void dropFailedPresses(SimPiston &pistonKbd, SimPiston &pistonTechnics, SimToeStud &toeStud)
+{
+    for (uint8_t event : pistonKbd.lostEvents) {
+        MIDIDivision division = (event >> 7) ? MIDIDivision::MD_Solo : MIDIDivision::MD_Swell;
+        dropPress(pressKey(division, (event >> 1) & 0x3F, event & 1));
+    }
+    for (uint8_t event : pistonTechnics.lostEvents) {
+        uint8_t button = (event >> 1) & 0x3F;
+        MIDIDivision division = button >= PEDAL_PISTON_OFFSET ? MIDIDivision::MD_Pedal : MIDIDivision::MD_Choir;
+        uint8_t index = button >= PEDAL_PISTON_OFFSET ? button - PEDAL_PISTON_OFFSET : button;
+        dropPress(pressKey(division, index, event & 1));
+    }
+    for (uint8_t event : toeStud.lostEvents) {
+        dropPress(pressKey(MIDIDivision::MD_Control, event >> 1, event & 1));
+    }
+
+    pistonKbd.lostEvents.clear();
+    pistonTechnics.lostEvents.clear();
+    toeStud.lostEvents.clear();
+}
+
+static bool pending()
+{
+    for (const auto &entry : Pending) {
+        if (!entry.second.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool runScenario(const Scenario &scenario, uint32_t seconds, unsigned seed, uint32_t pressRate)
+{
+    Random.seed(seed);
+    Pending.clear();
+    Latencies.clear();
+    Presses = Dropped = Failed = Unexpected = PedalUpdates = LEDButtons = 0;
+    memset(PistonLEDs, 0, sizeof(PistonLEDs));
+
+    I2CSim.clear();
+    I2CSim.seed(seed);
+
+    SimKeyboard      keyboard(IRQLine::IL_Keyboard);
+    SimPiston        pistonKbd(Controller::MC_Piston_Keyboard, SIM_PORT_KEYBOARD, IRQLine::IL_Keyboard);
+    SimTechnics      technics;
+    SimPiston        pistonTechnics(Controller::MC_Piston_Technics, SIM_PORT_TECHNICS, IRQLine::IL_Technics);
+    SimPedal         pedal(IRQLine::IL_ToeStud);
+    SimToeStud       toeStud(IRQLine::IL_ToeStud);
+    SimLEDController ledController(IRQLine::IL_StopLeft);
+
+    SimSlave *slaves[] = { &keyboard, &pistonKbd, &technics, &pistonTechnics, &pedal, &toeStud, &ledController };
+
+    for (SimSlave *slave : slaves) {
+        slave->model.nackRate = scenario.nackRate;
+        slave->model.requestDelay = scenario.requestDelay;
+        slave->model.jitter = scenario.jitter;
+        slave->model.version = scenario.version;
+        slave->model.readErrorRate = scenario.readErrorRate;
+        I2CSim.addSlave(slave);
+    }
+    if (scenario.slowPistons) {
+        pistonTechnics.model.maxClock = I2C_STANDARD_CLOCK;
+    }
+
+    uint32_t start = I2CSim.now();
+    uint32_t end = start + seconds * 1000000;
+
+    // Script the input at the encoders
+    std::exponential_distribution<double> pressInterval(pressRate / 1e6);
+    for (double time = start + pressInterval(Random); time < end; time += pressInterval(Random)) {
+        schedulePress((uint32_t)time, pistonKbd, pistonTechnics, toeStud);
+    }
+    for (uint32_t time = start + BURST_INTERVAL_US; time < end; time += BURST_INTERVAL_US) {
+        for (int i = 0; i < BURST_LENGTH; i++) {
+            schedulePress(time, pistonKbd, pistonTechnics, toeStud);
+        }
+    }
+    for (uint32_t time = start + PEDAL_INTERVAL_US; time < end; time += PEDAL_INTERVAL_US) {
+        uint16_t value = randomInt(1024);
+        I2CSim.schedule(time, [&toeStud, value]() { toeStud.movePedal(0, value); });
+    }
+    for (uint32_t time = start + LED_BUTTON_INTERVAL_US; time < end; time += LED_BUTTON_INTERVAL_US) {
+        uint8_t button = randomInt(5);
+        I2CSim.schedule(time, [&ledController, button]() { ledController.pressButton(button); });
+    }
+
+    ControllerDriver driver;
+    Driver = &driver;
+
+    driver.setPistonPressCallback(onPistonPress);
+    driver.setToeStudStatusCallback(onToeStudStatus);
+    driver.setLEDControllerCallback(onLEDControllerButton);
+    driver.setCountedReads(scenario.countedReads);
+    I2CSim.setIRQPolarity(IL_Keyboard, scenario.keyboardActiveHigh);
+    driver.begin();
+    driver.setIRQPolarity(IL_Keyboard, scenario.keyboardActiveHigh);
+    if (!scenario.fastMode) {
+        driver.setFastMode(false);
+    }
+
+    auto wallStart = std::chrono::steady_clock::now();
+
+    while (I2CSim.now() < end || ((pending() || I2CSim.scheduled()) && I2CSim.now() < end + DRAIN_TIME_US)) {
+        driver.loop();
+        I2CSim.advance(LOOP_TIME_US);
+        dropFailedPresses(pistonKbd, pistonTechnics, toeStud);
+    }
+    // Let the last LED updates complete
+    for (int i = 0; i < 1000; i++) {
+        driver.loop();
+        I2CSim.advance(LOOP_TIME_US);
+        dropFailedPresses(pistonKbd, pistonTechnics, toeStud);
+    }
+
+    auto wallEnd = std::chrono::steady_clock::now();
+    double wallSeconds = std::chrono::duration_cast<std::chrono::microseconds>(wallEnd - wallStart).count() / 1e6;
+    double simSeconds = (I2CSim.now() - start) / 1e6;
+
+    long lost = 0;
+    for (const auto &entry : Pending) {
+        lost += entry.second.size();
+    }
+
+    std::sort(Latencies.begin(), Latencies.end());
+    uint64_t totalLatency = 0;
+    for (uint32_t latency : Latencies) {
+        totalLatency += latency;
+    }
+    size_t count = Latencies.size();
+
+    const I2CBusStats &bus = driver.busStats();
+    const I2CSimStats &sim = I2CSim.stats();
+
+    printf("%-20s %8ld %6ld %6ld %8.0f %7.1f%% %7lu %7lu %7lu %6lu %6lu %8.1f\n", scenario.name, Presses, Dropped, Failed,
+           bus.transactions / simSeconds, sim.busyTime * 100.0 / (simSeconds * 1e6),
+           count ? (unsigned long)(totalLatency / count) : 0UL,
+           count ? (unsigned long)Latencies[count * 99 / 100] : 0UL,
+           count ? (unsigned long)Latencies[count - 1] : 0UL,
+           (unsigned long)sim.nacks, (unsigned long)bus.clockFallbacks,
+           wallSeconds > 0 ? simSeconds / wallSeconds : 0.0);
+
+    bool ok = true;
+    if (lost > 0) {
+        printf("FAIL: %ld presses were not reported\n", lost);
+        ok = false;
+    }
+    if (Unexpected > 0) {
+        printf("FAIL: %ld presses were reported that were not pressed\n", Unexpected);
+        ok = false;
+    }
+    if (PedalUpdates == 0 || LEDButtons == 0) {
+        printf("FAIL: no pedal or LED controller updates\n");
+        ok = false;
+    }
+    if (scenario.nackRate == 0.0 && !scenario.slowPistons && bus.retries > 0) {
+        // Only reads fail in these scenarios, after the encoder removed the events of its reply
+        printf("FAIL: %lu failed reads were repeated\n", (unsigned long)bus.retries);
+        ok = false;
+    }
+    if (scenario.fastMode && scenario.version && bus.clockChanges == 0) {
+        printf("FAIL: fast mode was not negotiated\n");
+        ok = false;
+    }
+    if (!scenario.version && driver.busStats().clockChanges > 0) {
+        printf("FAIL: fast mode was used with firmware without the version reply\n");
+        ok = false;
+    }
+
+    Driver = nullptr;
+    I2CSim.clear();
+
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t seconds = (argc > 1) ? atol(argv[1]) : 10;
+    unsigned seed = (argc > 2) ? atoi(argv[2]) : 1;
+    uint32_t pressRate = (argc > 3) ? atol(argv[3]) : 200;
+
+    printf("%-20s %8s %6s %6s %8s %8s %7s %7s %7s %6s %6s %8s\n", "scenario", "presses", "drops", "failed", "trans/s", "busy",
+           "avg us", "p99 us", "max us", "nacks", "fallbk", "sim/wall");
+
+    bool ok = true;
+    for (int i = 0; i < NUM_SCENARIOS; i++) {
+        ok = runScenario(SCENARIOS[i], seconds, seed, pressRate) && ok;
+    }
+
+    printf("\n%u s per scenario, %u presses/s (seed %u)\n", seconds, pressRate, seed);
+    printf(ok ? "OK\n" : "FAIL\n");
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,679 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Simulated I2C bus and encoder slaves, and the host I2CMaster on top of it
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include "I2CSimulator.h"
+
+#include <Arduino.h>
+
+#include "I2CBus.h"
+
+const SimSlaveModel DEFAULT_SLAVE_MODEL = {
+    40,                 // requestDelay
+    4,                  // byteDelay
+    10,                 // jitter
+    I2C_FAST_CLOCK,     // maxClock
+    0.0,                // nackRate
+    0.0,                // readErrorRate
+    true,               // version
+    I2C_CAP_FAST_MODE   // capabilities
+};
+
+I2CSimulator I2CSim;
+
+// IRQ flags, as in the encoder firmware
+static const uint8_t IRQ_STATUS = 0;
+static const uint8_t IRQ_EVENTS = 1;
+
+SimSlave::SimSlave(uint8_t address, uint8_t muxPort, int irqLine)
+: mAddress(address), mMuxPort(muxPort), mIRQLine(irqLine), model(DEFAULT_SLAVE_MODEL)
+{
+}
+
+void SimSlave::sendIRQ(uint8_t flag)
+{
+    mIRQFlags |= (1 << flag);
+    if (mIRQLine >= 0) {
+        I2CSim.updateIRQLine(mIRQLine);
+    }
+}
+
+void SimSlave::clearIRQ(uint8_t flag)
+{
+    mIRQFlags &= ~(1 << flag);
+    if (mIRQLine >= 0) {
+        I2CSim.updateIRQLine(mIRQLine);
+    }
+}
+
+void SimSlave::reset()
+{
+    mIRQFlags = 0;
+    if (mIRQLine >= 0) {
+        I2CSim.updateIRQLine(mIRQLine);
+    }
+}
+
+void SimSlave::receive(const uint8_t *data, uint8_t length)
+{
+    writes++;
+    if (length == 0) {
+        return;
+    }
+
+    uint8_t cmd = data[0];
+    mSendVersion = model.version && cmd == I2C_CMD_GET_VERSION;
+
+    if (cmd == I2C_CMD_RESET) {
+        reset();
+    }
+    command(cmd, data + 1, length - 1);
+}
+
+uint8_t SimSlave::request(uint8_t *buffer)
+{
+    reads++;
+    mNumReplyEvents = 0;
+
+    if (mSendVersion) {
+        mSendVersion = false;
+        buffer[0] = I2C_VERSION_MAGIC;
+        buffer[1] = I2C_PROTOCOL_VERSION;
+        buffer[2] = model.capabilities;
+        return I2C_VERSION_LENGTH;
+    }
+    return status(buffer);
+}
+
+void SimSlave::setReplyEvents(const uint8_t *buffer)
+{
+    mNumReplyEvents = buffer[0];
+    for (uint8_t i = 0; i < mNumReplyEvents; i++) {
+        mReplyEvents[i] = buffer[i + 1];
+    }
+}
+
+void SimSlave::replyFailed()
+{
+    lostEvents.insert(lostEvents.end(), mReplyEvents, mReplyEvents + mNumReplyEvents);
+}
+
+
+void SimKeyboard::command(uint8_t cmd, const uint8_t *data, uint8_t length)
+{
+    switch (cmd) {
+        case I2C_CMD_RESET:
+            mLearning = false;
+            break;
+        case I2C_CMD_SET_CHANNEL:
+            if (length > 1) {
+                channels[0] = data[0];
+                channels[1] = data[1];
+            }
+            break;
+        case I2C_CMD_CALIBRATE:
+            if (length > 0) {
+                mLearning = true;
+                mLearnedKey = 0;
+                sendIRQ(IRQ_STATUS);
+            }
+            break;
+    }
+}
+
+uint8_t SimKeyboard::status(uint8_t *buffer)
+{
+    buffer[0] = channels[0];
+    buffer[1] = channels[1];
+    if (mLearning) {
+        buffer[2] = mLearnedKey != 0 ? mLearnedKey : 0xFF;
+    } else {
+        buffer[2] = 0x00;
+    }
+    clearIRQ(IRQ_STATUS);
+    return 3;
+}
+
+void SimKeyboard::learnKey(uint8_t key)
+{
+    mLearnedKey = key;
+    sendIRQ(IRQ_STATUS);
+}
+
+
+void SimTechnics::command(uint8_t cmd, const uint8_t *data, uint8_t length)
+{
+    if (cmd == I2C_CMD_SET_CHANNEL && length > 0) {
+        channel = data[0];
+    }
+}
+
+uint8_t SimTechnics::status(uint8_t *buffer)
+{
+    buffer[0] = channel;
+    buffer[1] = wheel >> 8;
+    buffer[2] = wheel & 0xFF;
+    return 3;
+}
+
+
+void SimPedal::command(uint8_t cmd, const uint8_t *data, uint8_t length)
+{
+    switch (cmd) {
+        case I2C_CMD_SET_CHANNEL:
+            if (length > 0) {
+                channel = data[0];
+            }
+            break;
+        case I2C_CMD_LED_INTENSITY:
+            if (length > 0) {
+                intensity = data[0];
+            }
+            break;
+    }
+}
+
+uint8_t SimPedal::status(uint8_t *buffer)
+{
+    buffer[0] = channel;
+    buffer[1] = intensity;
+    clearIRQ(IRQ_STATUS);
+    return 2;
+}
+
+void SimPedal::setChannel(uint8_t value)
+{
+    channel = value;
+    sendIRQ(IRQ_STATUS);
+}
+
+
+bool SimEventQueue::push(uint8_t event)
+{
+    if (mLength == SIM_EVENT_QUEUE_SIZE) {
+        return false;
+    }
+    mEvents[mLength++] = event;
+    return true;
+}
+
+uint8_t SimEventQueue::pop(uint8_t *buffer)
+{
+    uint8_t count = mLength < I2C_MAX_STATUS_EVENTS ? mLength : I2C_MAX_STATUS_EVENTS;
+
+    buffer[0] = count;
+    for (uint8_t i = 0; i < count; i++) {
+        buffer[i + 1] = mEvents[i];
+    }
+
+    // Keep the remaining events for the next read
+    for (uint8_t i = count; i < mLength; i++) {
+        mEvents[i - count] = mEvents[i];
+    }
+    mLength -= count;
+
+    return count + 1;
+}
+
+
+void SimPiston::command(uint8_t cmd, const uint8_t *data, uint8_t length)
+{
+    if (cmd == I2C_CMD_SET_LEDS && length > 3) {
+        uint8_t kbd = data[0] >> 7;
+        leds[kbd][0] = data[0] & 0x7F;
+        leds[kbd][1] = data[1];
+        leds[kbd][2] = data[2];
+        leds[kbd][3] = data[3];
+    }
+}
+
+uint8_t SimPiston::status(uint8_t *buffer)
+{
+    uint8_t length = mQueue.pop(buffer);
+    setReplyEvents(buffer);
+    if (mQueue.empty()) {
+        clearIRQ(IRQ_EVENTS);
+    }
+    return length;
+}
+
+bool SimPiston::press(uint8_t kbd, uint8_t button, bool longPress)
+{
+    bool queued = mQueue.push((kbd << 7) | (button << 1) | (longPress ? 1 : 0));
+    sendIRQ(IRQ_EVENTS);
+    return queued;
+}
+
+void SimPiston::reset()
+{
+    mQueue.clear();
+    SimSlave::reset();
+}
+
+
+void SimToeStud::command(uint8_t cmd, const uint8_t *data, uint8_t length)
+{
+    if (cmd == I2C_CMD_SET_SENSITIVITY && length > 0) {
+        sensitivity = data[0];
+    }
+}
+
+uint8_t SimToeStud::status(uint8_t *buffer)
+{
+    for (uint8_t i = 0; i < 3; i++) {
+        buffer[i * 2] = pedals[i] >> 8;
+        buffer[i * 2 + 1] = pedals[i] & 0xFF;
+    }
+    clearIRQ(IRQ_STATUS);
+
+    uint8_t length = mQueue.pop(buffer + 6);
+    setReplyEvents(buffer + 6);
+    if (mQueue.empty()) {
+        clearIRQ(IRQ_EVENTS);
+    }
+    return length + 6;
+}
+
+bool SimToeStud::press(uint8_t button, bool longPress)
+{
+    bool queued = mQueue.push((button << 1) | (longPress ? 1 : 0));
+    sendIRQ(IRQ_EVENTS);
+    return queued;
+}
+
+void SimToeStud::movePedal(uint8_t pedal, uint16_t value)
+{
+    pedals[pedal] = value;
+    sendIRQ(IRQ_STATUS);
+}
+
+void SimToeStud::reset()
+{
+    mQueue.clear();
+    SimSlave::reset();
+}
+
+
+void SimLEDController::command(uint8_t cmd, const uint8_t *data, uint8_t length)
+{
+    if (cmd != I2C_CMD_LED_INTENSITY || length < 2) {
+        return;
+    }
+    switch (data[0]) {
+        case 0:
+        case 1:
+            for (uint8_t i = 0; i < 3 && i + 1 < length; i++) {
+                intensity[data[0] * 3 + i] = data[i + 1];
+            }
+            break;
+        case 2:
+            intensity[6] = data[1];
+            break;
+    }
+}
+
+uint8_t SimLEDController::status(uint8_t *buffer)
+{
+    buffer[0] = mButtons;
+
+    // BTN5 is a push button, reset the status when read via I2C
+    mButtons &= 0x0F;
+
+    clearIRQ(IRQ_STATUS);
+    return 1;
+}
+
+void SimLEDController::pressButton(uint8_t button)
+{
+    if (button < 4) {
+        mButtons ^= (1 << button);
+    } else {
+        mButtons |= (1 << 4);
+    }
+    sendIRQ(IRQ_STATUS);
+}
+
+
+I2CSimulator::I2CSimulator()
+{
+    clear();
+}
+
+void I2CSimulator::addSlave(SimSlave *slave)
+{
+    mSlaves.push_back(slave);
+    if (slave->irqLine() >= 0) {
+        updateIRQLine(slave->irqLine());
+    }
+}
+
+void I2CSimulator::clear()
+{
+    mSlaves.clear();
+    while (!mActions.empty()) {
+        mActions.pop();
+    }
+    mMuxSelect = 0;
+    mBusy = false;
+    mStats = {};
+
+    // Transfers of the driver started before the first advance() run on the simulated time
+    setTime(mNow);
+
+    for (int i = 0; i < NUM_IRQ_LINES; i++) {
+        updateIRQLine(i);
+    }
+}
+
+void I2CSimulator::setIRQPolarity(int line, bool activeHigh)
+{
+    if (activeHigh) {
+        mIRQActiveHigh |= (1 << line);
+    } else {
+        mIRQActiveHigh &= ~(1 << line);
+    }
+    updateIRQLine(line);
+}
+
+void I2CSimulator::updateIRQLine(int line)
+{
+    bool asserted = false;
+    for (SimSlave *slave : mSlaves) {
+        if (slave->irqLine() == line && slave->irqAsserted()) {
+            asserted = true;
+        }
+    }
+    bool activeHigh = mIRQActiveHigh & (1 << line);
+    setInputPin(SIM_IRQ_PINS[line], (asserted == activeHigh) ? HIGH : LOW);
+}
+
+void I2CSimulator::schedule(uint32_t time, std::function<void()> action)
+{
+    mActions.push({ time, mSequence++, action });
+}
+
+void I2CSimulator::setTime(uint32_t time)
+{
+    mNow = time;
+    setMicros(time);
+}
+
+void I2CSimulator::advance(uint32_t us)
+{
+    uint32_t target = mNow + us;
+
+    while (true) {
+        bool transferDone = mBusy && mDoneTime <= target;
+        bool actionDue = !mActions.empty() && mActions.top().time <= target;
+
+        if (transferDone && (!actionDue || mDoneTime <= mActions.top().time)) {
+            setTime(mDoneTime > mNow ? mDoneTime : mNow);
+            I2CPort.isr();
+        } else if (actionDue) {
+            ScheduledAction action = mActions.top();
+            mActions.pop();
+            setTime(action.time > mNow ? action.time : mNow);
+            action.action();
+        } else {
+            break;
+        }
+    }
+
+    setTime(target);
+}
+
+void I2CSimulator::completeTransfer()
+{
+    if (mBusy) {
+        advance(mDoneTime > mNow ? mDoneTime - mNow : 0);
+    }
+}
+
+SimSlave *I2CSimulator::findSlave(uint8_t address) const
+{
+    for (SimSlave *slave : mSlaves) {
+        if (slave->address() != address) {
+            continue;
+        }
+        if (slave->muxPort() == I2C_NO_MUX_PORT ||
+            (slave->muxPort() < NUM_MUX_PORTS && (mMuxSelect & (1 << slave->muxPort()))))
+        {
+            return slave;
+        }
+    }
+    return nullptr;
+}
+
+uint32_t I2CSimulator::transferTime(uint8_t bytes, uint32_t clock) const
+{
+    // Start, 9 bits per byte including the acknowledge, and stop
+    uint64_t bits = bytes * 9 + 2;
+    return (uint32_t)((bits * 1000000 + clock - 1) / clock);
+}
+
+void I2CSimulator::startTransfer(uint8_t address, bool read, uint32_t clock)
+{
+    mBusy = true;
+    mAddress = address;
+    mRead = read;
+    mLength = 0;
+    mStatus = I2CStatus::IS_OK;
+    mSlave = nullptr;
+
+    if (address == I2C_MUX_ADDRESS) {
+        return;
+    }
+
+    mSlave = findSlave(address);
+    if (!mSlave) {
+        mStatus = I2CStatus::IS_NACK;
+        return;
+    }
+
+    const SimSlaveModel &model = mSlave->model;
+    if (mSlave->nackCount > 0) {
+        mSlave->nackCount--;
+        mStatus = I2CStatus::IS_NACK;
+    } else if (model.nackRate > 0.0 && random() < model.nackRate) {
+        mStatus = I2CStatus::IS_NACK;
+    } else if (clock > model.maxClock) {
+        // The slave misses bits and the transfer ends with a bus error
+        mStatus = I2CStatus::IS_ERROR;
+    }
+}
+
+void I2CSimulator::startWrite(uint8_t address, const uint8_t *data, uint8_t length, uint32_t clock)
+{
+    if (clock == 0) {
+        // Wire default clock
+        clock = I2C_STANDARD_CLOCK;
+    }
+
+    startTransfer(address, false, clock);
+
+    uint32_t duration = transferTime(1, clock);
+    if (mStatus != I2CStatus::IS_NACK) {
+        mWriteData = data;
+        mLength = length;
+        duration = transferTime(1 + length, clock);
+        if (mSlave) {
+            duration += mSlave->model.byteDelay * length;
+            if (mSlave->model.jitter > 0) {
+                duration += (uint32_t)(random() * mSlave->model.jitter);
+            }
+        }
+    }
+
+    mDoneTime = mNow + duration;
+    mStats.busyTime += duration;
+}
+
+uint8_t I2CSimulator::startRead(uint8_t address, uint8_t length, uint8_t countOffset, uint32_t clock)
+{
+    if (clock == 0) {
+        clock = I2C_STANDARD_CLOCK;
+    }
+
+    startTransfer(address, true, clock);
+
+    uint32_t duration = transferTime(1, clock);
+    if (mStatus == I2CStatus::IS_OK) {
+        uint8_t replyLength = 0;
+        if (mSlave) {
+            // The slave prepares its reply when it is addressed
+            replyLength = mSlave->request(mReply);
+        } else {
+            mReply[0] = mMuxSelect;
+            replyLength = 1;
+        }
+
+        // The slave sends 0xFF after the end of its reply
+        for (uint8_t i = replyLength; i < SIM_MAX_REPLY; i++) {
+            mReply[i] = 0xFF;
+        }
+
+        mLength = length;
+        if (countOffset < length) {
+            uint8_t count = mReply[countOffset];
+            if (count > length - countOffset - 1) {
+                count = length - countOffset - 1;
+            }
+            mLength = countOffset + 1 + count;
+        }
+
+        duration = transferTime(1 + mLength, clock);
+        if (mSlave) {
+            duration += mSlave->model.requestDelay + mSlave->model.byteDelay * mLength;
+            if (mSlave->model.jitter > 0) {
+                duration += (uint32_t)(random() * mSlave->model.jitter);
+            }
+
+            if (mSlave->model.readErrorRate > 0.0 && random() < mSlave->model.readErrorRate) {
+                // The reply is lost on the bus after the slave sent it
+                mStatus = I2CStatus::IS_ERROR;
+                mSlave->replyFailed();
+            }
+        }
+    }
+
+    mDoneTime = mNow + duration;
+    mStats.busyTime += duration;
+
+    return mStatus == I2CStatus::IS_OK ? mLength : 0;
+}
+
+void I2CSimulator::abortTransfer()
+{
+    mBusy = false;
+    mStats.errors++;
+}
+
+I2CStatus I2CSimulator::finishTransfer(uint8_t *buffer)
+{
+    mBusy = false;
+    mStats.transfers++;
+
+    if (mStatus == I2CStatus::IS_NACK) {
+        mStats.nacks++;
+        return mStatus;
+    }
+    if (mStatus != I2CStatus::IS_OK) {
+        mStats.errors++;
+        return mStatus;
+    }
+
+    mStats.bytes += mLength;
+
+    if (mRead) {
+        for (uint8_t i = 0; i < mLength; i++) {
+            buffer[i] = mReply[i];
+        }
+    } else if (mSlave) {
+        // The slave handles the data after the stop
+        mSlave->receive(mWriteData, mLength);
+    } else if (mLength > 0) {
+        mMuxSelect = mWriteData[0];
+    }
+
+    return mStatus;
+}
+
+
+/*
+ * Host implementation of the I2CMaster on the simulated bus
+ */
+
+I2CMaster I2CPort;
+
+void I2CMaster::begin(uint32_t clock)
+{
+    mClock = clock;
+}
+
+void I2CMaster::setClock(uint32_t clock)
+{
+    waitTransfer();
+    mClock = clock;
+}
+
+void I2CMaster::startWrite(uint8_t address, const uint8_t *data, uint8_t length)
+{
+    mAddress = address;
+    mData = data;
+    mLength = length;
+    mRead = false;
+    mCountOffset = I2C_NO_COUNT;
+    mRxBytes = 0;
+    mStatus = I2CStatus::IS_OK;
+    mBusy = true;
+
+    I2CSim.startWrite(address, data, length, mClock);
+}
+
+void I2CMaster::startRead(uint8_t address, uint8_t *buffer, uint8_t length, uint8_t countOffset)
+{
+    mAddress = address;
+    mBuffer = buffer;
+    mRead = true;
+    mCountOffset = (countOffset < length) ? countOffset : I2C_NO_COUNT;
+    mRxBytes = 0;
+    mStatus = I2CStatus::IS_OK;
+    mBusy = true;
+
+    mLength = I2CSim.startRead(address, length, mCountOffset, mClock);
+}
+
+void I2CMaster::abort()
+{
+    if (mBusy) {
+        I2CSim.abortTransfer();
+        mStatus = I2CStatus::IS_TIMEOUT;
+        mBusy = false;
+    }
+}
+
+void I2CMaster::waitTransfer()
+{
+    while (mBusy) {
+        I2CSim.completeTransfer();
+    }
+}
+
+void I2CMaster::waitIdle()
+{
+    waitTransfer();
+    mClock = 0;
+}
+
+void I2CMaster::isr()
+{
+    mStatus = I2CSim.finishTransfer(mRead ? mBuffer : nullptr);
+    mRxBytes = (mRead && mStatus == I2CStatus::IS_OK) ? mLength : 0;
+    mBusy = false;
+}
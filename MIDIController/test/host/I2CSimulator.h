@@ -0,0 +1,447 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Simulated I2C bus for host tests of the ControllerDriver.
+ *
+ * Replaces the I2CMaster with a model of the TCA9548 multiplexer and of the encoder
+ * slaves, following their i2cReceive/i2cRequest handlers and doc/Routes.txt.
+ * The simulation runs on a simulated time (see setMicros()): transfers take the time of
+ * their bits on the wire plus the clock stretching of the slave, and complete with an
+ * interrupt when the time is advanced. Slaves drive the IRQ lines of the controller,
+ * can be scripted with timed events, and can NACK or fail transfers on request.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include <functional>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include <common_config.h>
+
+#include "ControllerDriver.h"
+#include "I2CMaster.h"
+
+// Multiplexer ports of the controllers, as wired in ControllerDriver.cpp
+static const uint8_t SIM_PORT_STOPLEFT = 2;
+static const uint8_t SIM_PORT_TOESTUDS = 4;
+static const uint8_t SIM_PORT_TECHNICS = 5;
+static const uint8_t SIM_PORT_KEYBOARD = 6;
+
+// Pins of the IRQ lines, indexed by IRQLine, as wired in ControllerDriver.cpp
+static const uint8_t SIM_IRQ_PINS[NUM_IRQ_LINES] = { 32, 31, 30, 40 };
+
+// Maximum number of bytes a slave sends in reply to a read
+static const uint8_t SIM_MAX_REPLY = 32;
+
+// Firmware size of the event queues of the piston and toestud encoders
+static const uint8_t SIM_EVENT_QUEUE_SIZE = 16;
+
+/**
+ * Timing and fault model of a slave.
+ */
+struct SimSlaveModel {
+    // Clock stretching while the slave prepares the reply of a read, in us
+    uint32_t requestDelay;
+    // Clock stretching of the slave TWI interrupt per byte, in us
+    uint32_t byteDelay;
+    // Random additional stretching of up to the given time per transfer, in us
+    uint32_t jitter;
+    // Highest clock that the slave follows; faster transfers fail with a bus error
+    uint32_t maxClock;
+    // Probability that the slave does not acknowledge its address
+    double   nackRate;
+    // Probability that a read fails with a bus error after the slave prepared its reply
+    double   readErrorRate;
+    // Firmware replies to I2C_CMD_GET_VERSION
+    bool     version;
+    // Capabilities in the version reply
+    uint8_t  capabilities;
+};
+
+// Encoder with the current firmware on an 8MHz ATmega
+extern const SimSlaveModel DEFAULT_SLAVE_MODEL;
+
+class SimSlave
+{
+    private:
+        bool mSendVersion = false;
+
+        uint16_t mIRQFlags = 0;
+
+    protected:
+        // Queued events sent with the last reply
+        uint8_t mReplyEvents[SIM_EVENT_QUEUE_SIZE];
+        uint8_t mNumReplyEvents = 0;
+
+        /**
+         * Remember the events of a reply, starting at the count byte.
+         */
+        void setReplyEvents(const uint8_t *buffer);
+
+        const uint8_t mAddress;
+        const uint8_t mMuxPort;
+        const int     mIRQLine;
+
+        void sendIRQ(uint8_t flag);
+
+        void clearIRQ(uint8_t flag);
+
+        /**
+         * Handle a command written by the master.
+         */
+        virtual void command(uint8_t cmd, const uint8_t *data, uint8_t length) { }
+
+        /**
+         * Write the status reply of a read into the buffer.
+         * \return the number of bytes of the reply.
+         */
+        virtual uint8_t status(uint8_t *buffer) = 0;
+
+    public:
+        SimSlaveModel model;
+
+        // Number of addresses that are not acknowledged before the next transfer succeeds
+        uint32_t nackCount = 0;
+
+        // Number of writes and reads that reached the slave
+        uint32_t writes = 0;
+        uint32_t reads = 0;
+
+        // Queued events that the slave removed for replies that never reached the master
+        std::vector<uint8_t> lostEvents;
+
+        /**
+         * \param irqLine IRQ line driven by the slave, or -1 if it has no interrupt.
+         */
+        SimSlave(uint8_t address, uint8_t muxPort, int irqLine);
+
+        virtual ~SimSlave() {}
+
+        uint8_t address() const { return mAddress; }
+
+        uint8_t muxPort() const { return mMuxPort; }
+
+        int irqLine() const { return mIRQLine; }
+
+        bool irqAsserted() const { return mIRQFlags != 0; }
+
+        /**
+         * Called when a write to the slave completed, like the Wire onReceive handler.
+         */
+        void receive(const uint8_t *data, uint8_t length);
+
+        /**
+         * Called when the slave is addressed for a read, like the Wire onRequest handler.
+         * \return the number of bytes of the reply.
+         */
+        uint8_t request(uint8_t *buffer);
+
+        /**
+         * Called when the reply of the last request failed on the bus.
+         */
+        void replyFailed();
+
+        virtual void reset();
+};
+
+/**
+ * KeyboardEncoder: channels and the key learning status.
+ */
+class SimKeyboard : public SimSlave
+{
+    private:
+        bool    mLearning = false;
+        uint8_t mLearnedKey = 0;
+
+    protected:
+        virtual void command(uint8_t cmd, const uint8_t *data, uint8_t length);
+
+        virtual uint8_t status(uint8_t *buffer);
+
+    public:
+        uint8_t channels[2] = { MIDI_CHANNEL_KEYBOARD_1, MIDI_CHANNEL_KEYBOARD_2 };
+
+        SimKeyboard(int irqLine) : SimSlave(Controller::MC_Keyboard, SIM_PORT_KEYBOARD, irqLine) {}
+
+        /**
+         * A key was pressed while learning.
+         */
+        void learnKey(uint8_t key);
+};
+
+/**
+ * TechnicsEncoder: channel and pitch wheel, without an interrupt.
+ */
+class SimTechnics : public SimSlave
+{
+    protected:
+        virtual void command(uint8_t cmd, const uint8_t *data, uint8_t length);
+
+        virtual uint8_t status(uint8_t *buffer);
+
+    public:
+        uint8_t  channel = MIDI_CHANNEL_TECHNICS;
+        uint16_t wheel = 512;
+
+        SimTechnics() : SimSlave(Controller::MC_Technics, SIM_PORT_TECHNICS, -1) {}
+};
+
+/**
+ * PedalEncoder: channel and LED intensity, interrupt on changes at the encoder.
+ */
+class SimPedal : public SimSlave
+{
+    protected:
+        virtual void command(uint8_t cmd, const uint8_t *data, uint8_t length);
+
+        virtual uint8_t status(uint8_t *buffer);
+
+    public:
+        uint8_t channel = MIDI_CHANNEL_PEDAL;
+        uint8_t intensity = 0;
+
+        SimPedal(int irqLine) : SimSlave(Controller::MC_Pedal, SIM_PORT_TOESTUDS, irqLine) {}
+
+        /**
+         * Change the channel with the switches of the encoder.
+         */
+        void setChannel(uint8_t value);
+};
+
+/**
+ * Queue of button events with a count, as sent by the piston and toestud encoders.
+ */
+class SimEventQueue
+{
+    private:
+        uint8_t mEvents[SIM_EVENT_QUEUE_SIZE];
+        uint8_t mLength = 0;
+
+    public:
+        /**
+         * \return false if the queue is full and the event is dropped.
+         */
+        bool push(uint8_t event);
+
+        /**
+         * Write the count and up to I2C_MAX_STATUS_EVENTS events, and remove them.
+         */
+        uint8_t pop(uint8_t *buffer);
+
+        bool empty() const { return mLength == 0; }
+
+        void clear() { mLength = 0; }
+};
+
+/**
+ * PistonEncoder: button events and the piston LEDs of two keyboards.
+ */
+class SimPiston : public SimSlave
+{
+    private:
+        SimEventQueue mQueue;
+
+    protected:
+        virtual void command(uint8_t cmd, const uint8_t *data, uint8_t length);
+
+        virtual uint8_t status(uint8_t *buffer);
+
+    public:
+        // LED bitmasks as written by I2C_CMD_SET_LEDS, indexed by keyboard
+        uint8_t leds[2][MAX_PISTON_LED_BYTES] = {};
+
+        SimPiston(Controller address, uint8_t muxPort, int irqLine) : SimSlave(address, muxPort, irqLine) {}
+
+        /**
+         * \return false if the encoder queue is full and the press is dropped.
+         */
+        bool press(uint8_t kbd, uint8_t button, bool longPress);
+
+        virtual void reset();
+};
+
+/**
+ * ToeStudEncoder: three pedals and the toestud button events.
+ */
+class SimToeStud : public SimSlave
+{
+    private:
+        SimEventQueue mQueue;
+
+    protected:
+        virtual void command(uint8_t cmd, const uint8_t *data, uint8_t length);
+
+        virtual uint8_t status(uint8_t *buffer);
+
+    public:
+        uint16_t pedals[3] = {};
+        uint8_t  sensitivity = 0;
+
+        SimToeStud(int irqLine) : SimSlave(Controller::MC_ToeStud, SIM_PORT_TOESTUDS, irqLine) {}
+
+        bool press(uint8_t button, bool longPress);
+
+        void movePedal(uint8_t pedal, uint16_t value);
+
+        virtual void reset();
+};
+
+/**
+ * LEDController: four switches and a push button.
+ */
+class SimLEDController : public SimSlave
+{
+    private:
+        uint8_t mButtons = 0;
+
+    protected:
+        virtual void command(uint8_t cmd, const uint8_t *data, uint8_t length);
+
+        virtual uint8_t status(uint8_t *buffer);
+
+    public:
+        uint8_t intensity[7] = {};
+
+        SimLEDController(int irqLine) : SimSlave(Controller::MC_LEDController, SIM_PORT_STOPLEFT, irqLine) {}
+
+        /**
+         * Toggle a switch 0..3 or press the push button 4.
+         */
+        void pressButton(uint8_t button);
+};
+
+struct I2CSimStats {
+    uint32_t transfers;
+    uint32_t bytes;
+    uint32_t nacks;
+    uint32_t errors;
+    // Time the bus was busy with transfers, in us
+    uint64_t busyTime;
+};
+
+class I2CSimulator
+{
+    private:
+        struct ScheduledAction {
+            uint32_t time;
+            uint32_t sequence;
+            std::function<void()> action;
+
+            bool operator>(const ScheduledAction &other) const {
+                return time != other.time ? time > other.time : sequence > other.sequence;
+            }
+        };
+
+        std::vector<SimSlave*> mSlaves;
+
+        std::priority_queue<ScheduledAction, std::vector<ScheduledAction>, std::greater<ScheduledAction>> mActions;
+        uint32_t mSequence = 0;
+
+        std::mt19937 mRandom;
+
+        uint32_t mNow = 0;
+
+        // Ports selected at the TCA9548, one bit per port
+        uint8_t mMuxSelect = 0;
+
+        // Transfer in progress
+        bool     mBusy = false;
+        uint32_t mDoneTime = 0;
+        uint8_t  mAddress = 0;
+        bool     mRead = false;
+        I2CStatus mStatus = I2CStatus::IS_OK;
+        const uint8_t *mWriteData = nullptr;
+        uint8_t  mLength = 0;
+        uint8_t  mReply[SIM_MAX_REPLY];
+        SimSlave *mSlave = nullptr;
+
+        // One bit per IRQ line that is asserted with a high level. The default levels of the
+        // ControllerDriver: the Keyboard line is asserted low, the others high.
+        uint8_t mIRQActiveHigh = 0x0E;
+
+        I2CSimStats mStats = {};
+
+        SimSlave *findSlave(uint8_t address) const;
+
+        uint32_t transferTime(uint8_t bytes, uint32_t clock) const;
+
+        void startTransfer(uint8_t address, bool read, uint32_t clock);
+
+        void setTime(uint32_t time);
+
+    public:
+        I2CSimulator();
+
+        void seed(unsigned seed) { mRandom.seed(seed); }
+
+        /**
+         * Add a slave. The slave must stay valid while the simulation runs.
+         */
+        void addSlave(SimSlave *slave);
+
+        /**
+         * Remove all slaves and scheduled actions and reset the multiplexer and statistics.
+         * Switches micros() to the simulated time.
+         */
+        void clear();
+
+        uint32_t now() const { return mNow; }
+
+        const I2CSimStats &stats() const { return mStats; }
+
+        /**
+         * Set the level of an asserted IRQ line; must match the ControllerDriver.
+         */
+        void setIRQPolarity(int line, bool activeHigh);
+
+        /**
+         * Drive the IRQ line from the slaves that are connected to it.
+         */
+        void updateIRQLine(int line);
+
+        /**
+         * Run an action, e.g. a button press at a slave, at the given simulated time.
+         */
+        void schedule(uint32_t time, std::function<void()> action);
+
+        bool scheduled() const { return !mActions.empty(); }
+
+        /**
+         * Advance the simulated time, running scheduled actions and completing transfers.
+         */
+        void advance(uint32_t us);
+
+        /**
+         * Advance the time until the current transfer completed.
+         */
+        void completeTransfer();
+
+        double random() { return std::uniform_real_distribution<double>(0.0, 1.0)(mRandom); }
+
+        // Interface of the host I2CMaster
+
+        void startWrite(uint8_t address, const uint8_t *data, uint8_t length, uint32_t clock);
+
+        /**
+         * Start a read; the slave prepares its reply when it is addressed.
+         * \return the number of bytes the master will receive.
+         */
+        uint8_t startRead(uint8_t address, uint8_t length, uint8_t countOffset, uint32_t clock);
+
+        void abortTransfer();
+
+        /**
+         * Finish the transfer: deliver written data to the slave or copy the reply.
+         */
+        I2CStatus finishTransfer(uint8_t *buffer);
+};
+
+extern I2CSimulator I2CSim;
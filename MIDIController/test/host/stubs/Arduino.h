@@ -0,0 +1,92 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Minimal Arduino/Teensy API for building controller sources on the host.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROGMEM
+
+class HostSerial
+{
+    public:
+        int printf(const char *fmt, ...) {
+            va_list args;
+            va_start(args, fmt);
+            int ret = vprintf(fmt, args);
+            va_end(args);
+            return ret;
+        }
+
+        void print(const char *s) { fputs(s, stdout); }
+
+        void print(int value) { ::printf("%d", value); }
+
+        void println(const char *s) { puts(s); }
+
+        void println() { putchar('\n'); }
+};
+
+class HostKeyboard
+{
+    public:
+        void press(int key) { }
+
+        void release(int key) { }
+};
+
+extern HostSerial Serial;
+extern HostKeyboard Keyboard;
+
+static const int KEY_LEFT = 0xF050;
+static const int KEY_RIGHT = 0xF04F;
+
+#define LOW     0
+#define HIGH    1
+
+#define INPUT   0
+#define OUTPUT  1
+
+#define FALLING 2
+#define RISING  3
+
+// Number of simulated digital pins
+static const int HOST_NUM_PINS = 64;
+
+void pinMode(uint8_t pin, uint8_t mode);
+
+int digitalRead(uint8_t pin);
+
+void digitalWrite(uint8_t pin, uint8_t value);
+
+inline int digitalPinToInterrupt(uint8_t pin) { return pin; }
+
+void attachInterrupt(int irq, void (*handler)(), int mode);
+
+inline void noInterrupts() { }
+
+inline void interrupts() { }
+
+uint32_t micros();
+
+uint32_t millis();
+
+/**
+ * Host only: switch micros() and millis() from the system clock to a simulated time.
+ */
+void setMicros(uint32_t us);
+
+/**
+ * Host only: set the level of an input pin and call its interrupt handler on a matching edge.
+ */
+void setInputPin(uint8_t pin, uint8_t value);
@@ -0,0 +1,37 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * RAM backed EEPROM for host builds.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+// EEPROM size of the Teensy 4.1
+static const int HOST_EEPROM_SIZE = 4284;
+
+class HostEEPROM
+{
+    private:
+        uint8_t mData[HOST_EEPROM_SIZE];
+
+    public:
+        HostEEPROM() {
+            for (int i = 0; i < HOST_EEPROM_SIZE; i++) {
+                mData[i] = 0xFF;
+            }
+        }
+
+        uint8_t read(int addr) const { return mData[addr]; }
+
+        void write(int addr, uint8_t value) { mData[addr] = value; }
+
+        void update(int addr, uint8_t value) { mData[addr] = value; }
+};
+
+extern HostEEPROM EEPROM;
@@ -0,0 +1,79 @@
+/**
+ * @project     MidiController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Subset of the MIDI library types used by the controller sources, for host builds.
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include <Arduino.h>
+
+#define MIDI_CHANNEL_OMNI 0
+#define MIDI_CHANNEL_OFF 17
+
+namespace midi {
+
+typedef uint8_t Channel;
+typedef uint8_t DataByte;
+
+enum MidiType : uint8_t {
+    InvalidType           = 0x00,
+    NoteOff               = 0x80,
+    NoteOn                = 0x90,
+    AfterTouchPoly        = 0xA0,
+    ControlChange         = 0xB0,
+    ProgramChange         = 0xC0,
+    AfterTouchChannel     = 0xD0,
+    PitchBend             = 0xE0,
+    SystemExclusive       = 0xF0,
+    SystemExclusiveStart  = 0xF0,
+    TimeCodeQuarterFrame  = 0xF1,
+    SongPosition          = 0xF2,
+    SongSelect            = 0xF3,
+    TuneRequest           = 0xF6,
+    SystemExclusiveEnd    = 0xF7,
+    Clock                 = 0xF8,
+    Tick                  = 0xF9,
+    Start                 = 0xFA,
+    Continue              = 0xFB,
+    Stop                  = 0xFC,
+    ActiveSensing         = 0xFE,
+    SystemReset           = 0xFF
+};
+
+enum MidiControlChangeNumber : uint8_t {
+    ModulationWheel       = 1,
+    FootController        = 4,
+    DataEntryMSB          = 6,
+    ExpressionController  = 11,
+    DataEntryLSB          = 38,
+    NRPNLSB               = 98,
+    NRPNMSB               = 99,
+    RPNLSB                = 100,
+    RPNMSB                = 101,
+    AllSoundOff           = 120,
+    AllNotesOff           = 123
+};
+
+struct DefaultSettings {
+    static const unsigned SysExMaxSize = 128;
+};
+
+template<unsigned SysExMaxSize>
+struct Message {
+    Channel  channel = 0;
+    MidiType type = InvalidType;
+    DataByte data1 = 0;
+    DataByte data2 = 0;
+    DataByte sysexArray[SysExMaxSize];
+    bool     valid = false;
+    unsigned length = 0;
+};
+
+}
@@ -0,0 +1,87 @@
+/*
+ * @project     MIDIController
+ * @author      Stefan Hepp, stefan@stefant.org
+ *
+ * Global objects of the host Arduino API
+ *
+ * Copyright 2024 Stefan Hepp
+ * License: GPL v3
+ * See 'COPYRIGHT.txt' for copyright and licensing information.
+ */
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#include <chrono>
+
+HostSerial Serial;
+HostKeyboard Keyboard;
+HostEEPROM EEPROM;
+
+static uint8_t PinLevel[HOST_NUM_PINS];
+
+static void (*PinHandler[HOST_NUM_PINS])() = {};
+static int PinHandlerMode[HOST_NUM_PINS];
+
+static bool SimulatedTime = false;
+static uint32_t SimulatedMicros = 0;
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+int digitalRead(uint8_t pin)
+{
+    return pin < HOST_NUM_PINS ? PinLevel[pin] : LOW;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    if (pin < HOST_NUM_PINS) {
+        PinLevel[pin] = value ? HIGH : LOW;
+    }
+}
+
+void attachInterrupt(int irq, void (*handler)(), int mode)
+{
+    if (irq >= 0 && irq < HOST_NUM_PINS) {
+        PinHandler[irq] = handler;
+        PinHandlerMode[irq] = mode;
+    }
+}
+
+void setInputPin(uint8_t pin, uint8_t value)
+{
+    if (pin >= HOST_NUM_PINS) {
+        return;
+    }
+
+    uint8_t level = value ? HIGH : LOW;
+    if (level == PinLevel[pin]) {
+        return;
+    }
+    PinLevel[pin] = level;
+
+    if (PinHandler[pin] && PinHandlerMode[pin] == (level == HIGH ? RISING : FALLING)) {
+        PinHandler[pin]();
+    }
+}
+
+void setMicros(uint32_t us)
+{
+    SimulatedTime = true;
+    SimulatedMicros = us;
+}
+
+uint32_t micros()
+{
+    if (SimulatedTime) {
+        return SimulatedMicros;
+    }
+    return (uint32_t) std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t millis()
+{
+    return micros() / 1000;
+}
@@ -100,9 +100,14 @@ void onEncoderPosition(uint8_t encoder, int position) {
     interrupts();
 }
 
+static bool SendVersion = false;
+
 void i2cReceive(uint8_t length) {
     uint8_t cmd = Wire.read();
 
+    // Reply with the version on the next read
+    SendVersion = (cmd == I2C_CMD_GET_VERSION);
+
     switch (cmd) {
         case I2C_CMD_RESET: 
             resetEncoder();
@@ -137,6 +142,14 @@ void i2cReceive(uint8_t length) {
 
 void i2cRequest()
 {
+    if (SendVersion) {
+        SendVersion = false;
+        Wire.write(I2C_VERSION_MAGIC);
+        Wire.write(I2C_PROTOCOL_VERSION);
+        Wire.write(I2C_SLAVE_CAPABILITIES);
+        return;
+    }
+
     // Send poti values
     for (uint8_t i = 0; i < 3; i++) {
         int value = 1023 - volume[i].value();
@@ -153,13 +166,22 @@ void i2cRequest()
     EncoderPosition[1] = 0;
 
     // Send button press events
-    Wire.write(ButtonBufferLength);
-    for (uint8_t i = 0; i < ButtonBufferLength; i++) {
+    uint8_t count = ButtonBufferLength < I2C_MAX_STATUS_EVENTS ? ButtonBufferLength : I2C_MAX_STATUS_EVENTS;
+
+    Wire.write(count);
+    for (uint8_t i = 0; i < count; i++) {
         Wire.write(ButtonBuffer[i]);
     }
-    ButtonBufferLength = 0;
 
-    clearIRQ(IRQ_BUTTONS);
+    // Keep the remaining events for the next read
+    for (uint8_t i = count; i < ButtonBufferLength; i++) {
+        ButtonBuffer[i - count] = ButtonBuffer[i];
+    }
+    ButtonBufferLength -= count;
+
+    if (ButtonBufferLength == 0) {
+        clearIRQ(IRQ_BUTTONS);
+    }
 }
 
 void setupPoti(const uint8_t *knob, uint8_t pin)
@@ -179,10 +179,15 @@ void onKeyChange(uint8_t key, uint8_t velocity) {
     }
 }
 
+static bool SendVersion = false;
+
 void i2cReceive(uint8_t length) {
     uint8_t cmd = Wire.read();
     uint8_t value;
 
+    // Reply with the version on the next read
+    SendVersion = (cmd == I2C_CMD_GET_VERSION);
+
     switch (cmd) {
         case I2C_CMD_RESET: 
             resetEncoder();
@@ -203,6 +208,14 @@ void i2cReceive(uint8_t length) {
 }
 
 void i2cRequest() {
+    if (SendVersion) {
+        SendVersion = false;
+        Wire.write(I2C_VERSION_MAGIC);
+        Wire.write(I2C_PROTOCOL_VERSION);
+        Wire.write(I2C_SLAVE_CAPABILITIES);
+        return;
+    }
+
     Wire.write(MIDIChannel);
     Wire.write(led.getIntensity());
     clearIRQ(IRQ_CHANNEL);
@@ -68,9 +68,14 @@ void onButtonPress(uint8_t kbd, uint8_t btn, bool longPress)
     interrupts();
 }
 
+static bool SendVersion = false;
+
 void i2cReceive(uint8_t length) {
     uint8_t cmd = Wire.read();
 
+    // Reply with the version on the next read
+    SendVersion = (cmd == I2C_CMD_GET_VERSION);
+
     switch (cmd) {
         case I2C_CMD_RESET: 
             resetEncoder();
@@ -90,12 +95,30 @@ void i2cReceive(uint8_t length) {
 
 void i2cRequest()
 {
-    Wire.write(queueLength);
-    for (uint8_t i = 0; i < queueLength; i++) {
+    if (SendVersion) {
+        SendVersion = false;
+        Wire.write(I2C_VERSION_MAGIC);
+        Wire.write(I2C_PROTOCOL_VERSION);
+        Wire.write(I2C_SLAVE_CAPABILITIES);
+        return;
+    }
+
+    uint8_t count = queueLength < I2C_MAX_STATUS_EVENTS ? queueLength : I2C_MAX_STATUS_EVENTS;
+
+    Wire.write(count);
+    for (uint8_t i = 0; i < count; i++) {
         Wire.write(btnQueue[i]);
     }
-    queueLength = 0;
-    clearIRQ(IRQ_BUTTONS);
+
+    // Keep the remaining events for the next read
+    for (uint8_t i = count; i < queueLength; i++) {
+        btnQueue[i - count] = btnQueue[i];
+    }
+    queueLength -= count;
+
+    if (queueLength == 0) {
+        clearIRQ(IRQ_BUTTONS);
+    }
 }
 
 void setup() {
@@ -82,10 +82,15 @@ void onWheelChange(int value, void* payload) {
     MIDI.sendPitchBend(value * 16, MIDIChannel);
 }
 
+static bool SendVersion = false;
+
 void i2cReceive(uint8_t length) {
     uint8_t cmd = Wire.read();
     uint8_t value;
 
+    // Reply with the version on the next read
+    SendVersion = (cmd == I2C_CMD_GET_VERSION);
+
     switch (cmd) {
         case I2C_CMD_RESET: 
             resetEncoder();
@@ -106,6 +111,14 @@ void i2cReceive(uint8_t length) {
 }
 
 void i2cRequest() {
+    if (SendVersion) {
+        SendVersion = false;
+        Wire.write(I2C_VERSION_MAGIC);
+        Wire.write(I2C_PROTOCOL_VERSION);
+        Wire.write(I2C_SLAVE_CAPABILITIES);
+        return;
+    }
+
     Wire.write(MIDIChannel);
     Wire.write((uint8_t)(wheel.value() >> 8));
     Wire.write((uint8_t)(wheel.value() & 0xFF));
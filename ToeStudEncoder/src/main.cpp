@@ -91,9 +91,14 @@ void onToeStudPress(uint8_t button, bool longPress) {
     interrupts();
 }
 
+static bool SendVersion = false;
+
 void i2cReceive(uint8_t length) {
     uint8_t cmd = Wire.read();
 
+    // Reply with the version on the next read
+    SendVersion = (cmd == I2C_CMD_GET_VERSION);
+
     switch (cmd) {
         case I2C_CMD_RESET: 
             resetEncoder();
@@ -122,6 +127,14 @@ void i2cReceive(uint8_t length) {
 
 void i2cRequest()
 {
+    if (SendVersion) {
+        SendVersion = false;
+        Wire.write(I2C_VERSION_MAGIC);
+        Wire.write(I2C_PROTOCOL_VERSION);
+        Wire.write(I2C_SLAVE_CAPABILITIES);
+        return;
+    }
+
     for (uint8_t i = 0; i < 3; i++) {
         uint16_t value = pedals[i].value();
         Wire.write((uint8_t)(value >> 8));
@@ -129,13 +142,22 @@ void i2cRequest()
     }
     clearIRQ(IRQ_PEDALS);
 
-    Wire.write(ToeStudBufferLength);
-    for (uint8_t i = 0; i < ToeStudBufferLength; i++) {
+    uint8_t count = ToeStudBufferLength < I2C_MAX_STATUS_EVENTS ? ToeStudBufferLength : I2C_MAX_STATUS_EVENTS;
+
+    Wire.write(count);
+    for (uint8_t i = 0; i < count; i++) {
         Wire.write(ToeStudBuffer[i]);
     }
-    ToeStudBufferLength = 0;
 
-    clearIRQ(IRQ_TOESTUDS);
+    // Keep the remaining events for the next read
+    for (uint8_t i = count; i < ToeStudBufferLength; i++) {
+        ToeStudBuffer[i - count] = ToeStudBuffer[i];
+    }
+    ToeStudBufferLength -= count;
+
+    if (ToeStudBufferLength == 0) {
+        clearIRQ(IRQ_TOESTUDS);
+    }
 }
 
 void setupPedal(const uint8_t *pedal, uint8_t pin)
@@ -94,6 +94,29 @@ static const uint8_t I2C_CMD_LED_INTENSITY   = 0x05;
 static const uint8_t I2C_CMD_SET_LEDS        = 0x06;
 static const uint8_t I2C_CMD_SET_MODE        = 0x07;
 static const uint8_t I2C_CMD_SET_SENSITIVITY = 0x08;
+static const uint8_t I2C_CMD_GET_VERSION     = 0x09;
+
+// Reply to the next read after I2C_CMD_GET_VERSION: <magic> <protocol version> <capabilities>.
+// The magic byte distinguishes the reply from the status sent by firmware without the command.
+static const uint8_t I2C_VERSION_MAGIC       = 0xE5;
+static const uint8_t I2C_PROTOCOL_VERSION    = 1;
+static const uint8_t I2C_VERSION_LENGTH      = 3;
+
+// Capability bits of the version reply
+static const uint8_t I2C_CAP_FAST_MODE       = 0x01;
+
+static const uint32_t I2C_STANDARD_CLOCK     = 100000;
+static const uint32_t I2C_FAST_CLOCK         = 400000;
+
+#ifdef F_CPU
+// The AVR TWI slave needs a CPU clock of at least 16 times the SCL clock
+static const uint8_t I2C_SLAVE_CAPABILITIES  = (F_CPU >= 16UL * I2C_FAST_CLOCK) ? I2C_CAP_FAST_MODE : 0;
+#endif
+
+// Maximum number of queued events an encoder sends in one status read. The event
+// count is sent before the events, so the master only needs to read the queued events;
+// events that do not fit stay queued and keep the IRQ asserted.
+static const uint8_t I2C_MAX_STATUS_EVENTS   = 7;
 
 /* ==============================================================
  * MIDI Channels and Constants